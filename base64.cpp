@@ -11,8 +11,19 @@
 */
 
 #include "base64.h"
+#include "common.h"
 #include <stdint.h>
 
+#if defined(ARC_x86) && (defined(__GNUC__) || defined(_MSC_VER))
+	#define BASE64_AVX2
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#define BASE64_TARGET_AVX2
+	#else
+		#define BASE64_TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#endif
+
 #define BASE_DECODE_RANGE_1_DONT_CALL(ch, lo1, hi1) \
 	/* ret = -1; */ \
 	(-1) + \
@@ -191,6 +202,143 @@ static inline void base64Encode3BytesDotSlashOrdered(char dest[4], const uint8_t
 	dest[3] = base64Encode6BitsDotSlashOrdered(  b2                    & 63);
 }
 
+#ifdef BASE64_AVX2
+// ********************
+// *** AVX2 Helpers ***
+// ********************
+
+// These do 24 bytes <-> 32 characters at a time. Like the scalar code there
+// are no table lookups and no branches on data. Character ranges are done
+// with compares and masks.
+
+/**
+ * Checks if the AVX2 functions can be used.
+ *
+ * @return Non-zero if AVX2 can be used, otherwise 0.
+ */
+static inline int base64HasAvx2()
+{
+	return (getInstructionSets() & (IS_AVX2 | IS_OS_YMM)) == (IS_AVX2 | IS_OS_YMM);
+}
+
+/**
+ * Encode 24 bytes of data into 32 base64 characters.
+ *
+ * @param dest - 32 base64 characters.
+ * @param src - 24 bytes of data.
+ */
+BASE64_TARGET_AVX2 static void base64Encode24BytesDotSlashOrderedAvx2(char dest[32], const uint8_t src[24])
+{
+	// Bytes 0-11 in the low lane and 12-23 in the high lane
+	__m256i in = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) src)),
+		_mm_loadl_epi64((const __m128i*) (src + 16)), 1);
+	in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6));
+
+	// Split each 3 bytes into 4 6 bit values
+	in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+		1, 0, 2, 1,  4, 3, 5, 4,  7, 6, 8, 7,  10, 9, 11, 10,
+		1, 0, 2, 1,  4, 3, 5, 4,  7, 6, 8, 7,  10, 9, 11, 10));
+	__m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+	__m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+	__m256i bits = _mm256_or_si256(t0, t1);
+
+	// ch = bits + '.'
+	// if (bits > 11) ch += 'A' - ('9' + 1);
+	// if (bits > 37) ch += 'a' - ('Z' + 1);
+	__m256i ch = _mm256_add_epi8(bits, _mm256_set1_epi8('.'));
+	ch = _mm256_add_epi8(ch, _mm256_and_si256(_mm256_cmpgt_epi8(bits, _mm256_set1_epi8(11)), _mm256_set1_epi8('A' - ('9' + 1))));
+	ch = _mm256_add_epi8(ch, _mm256_and_si256(_mm256_cmpgt_epi8(bits, _mm256_set1_epi8(37)), _mm256_set1_epi8('a' - ('Z' + 1))));
+
+	_mm256_storeu_si256((__m256i*) dest, ch);
+}
+
+/**
+ * Decode 32 base64 characters into 24 bytes of data.
+ *
+ * @param dest - 24 bytes of data.
+ * @param src - 32 base64 characters.
+ * @return Every byte is zero on success, otherwise some are 0xff.
+ */
+BASE64_TARGET_AVX2 static __m256i base64Decode24BytesDotSlashOrderedAvx2(uint8_t dest[24], const char src[32])
+{
+	__m256i ch = _mm256_loadu_si256((const __m256i*) src);
+
+	// Signed compares so 0x80-0xff are never in a range
+	__m256i in1 = _mm256_and_si256(_mm256_cmpgt_epi8(ch, _mm256_set1_epi8('.' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), ch));
+	__m256i in2 = _mm256_and_si256(_mm256_cmpgt_epi8(ch, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), ch));
+	__m256i in3 = _mm256_and_si256(_mm256_cmpgt_epi8(ch, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), ch));
+	__m256i bits = _mm256_or_si256(_mm256_or_si256(
+		_mm256_and_si256(in1, _mm256_sub_epi8(ch, _mm256_set1_epi8('.'))),
+		_mm256_and_si256(in2, _mm256_sub_epi8(ch, _mm256_set1_epi8('A' - 12)))),
+		_mm256_and_si256(in3, _mm256_sub_epi8(ch, _mm256_set1_epi8('a' - 38))));
+	__m256i bad = _mm256_andnot_si256(_mm256_or_si256(_mm256_or_si256(in1, in2), in3), _mm256_set1_epi8(-1));
+
+	// Join each 4 6 bit values into 3 bytes
+	bits = _mm256_maddubs_epi16(bits, _mm256_set1_epi32(0x01400140));
+	bits = _mm256_madd_epi16(bits, _mm256_set1_epi32(0x00011000));
+	bits = _mm256_shuffle_epi8(bits, _mm256_setr_epi8(
+		2, 1, 0,  6, 5, 4,  10, 9, 8,  14, 13, 12,  -1, -1, -1, -1,
+		2, 1, 0,  6, 5, 4,  10, 9, 8,  14, 13, 12,  -1, -1, -1, -1));
+	bits = _mm256_permutevar8x32_epi32(bits, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+
+	_mm_storeu_si128((__m128i*) dest, _mm256_castsi256_si128(bits));
+	_mm_storel_epi64((__m128i*) (dest + 16), _mm256_extracti128_si256(bits, 1));
+	return bad;
+}
+
+/**
+ * Encodes as much as it can 24 bytes at a time.
+ *
+ * @param dest - Base64 string.
+ * @param src - Data.
+ * @param srcSize - Size of data.
+ * @return Number of bytes of data encoded. This is a multiple of 24.
+ */
+BASE64_TARGET_AVX2 static size_t base64EncodeAvx2(char *dest, const uint8_t *src, size_t srcSize)
+{
+	size_t done = 0;
+
+	for (; srcSize - done >= 24; done += 24)
+	{
+		base64Encode24BytesDotSlashOrderedAvx2(dest, src + done);
+		dest += 32;
+	}
+	return done;
+}
+
+/**
+ * Decodes as much as it can 32 characters at a time. Always leaves the last
+ * characters when they might be padding.
+ *
+ * @param dest - Data.
+ * @param src - Base64 string.
+ * @param srcSize - Size of base64 string.
+ * @param err - Set to negative on error.
+ * @return Number of characters decoded. This is a multiple of 32.
+ */
+BASE64_TARGET_AVX2 static size_t base64DecodeAvx2(uint8_t *dest, const char *src, size_t srcSize, int &err)
+{
+	__m256i bad  = _mm256_setzero_si256();
+	size_t  done = 0;
+
+	// The last 4 characters go to the scalar code for padding unless there
+	// can't be any. The scalar code only treats the last 2 characters as
+	// padding. Branching on '=' is fine since it's not a data character.
+	while (srcSize - done > 32 || (srcSize - done == 32 && src[done + 30] != '=' && src[done + 31] != '='))
+	{
+		bad = _mm256_or_si256(bad, base64Decode24BytesDotSlashOrderedAvx2(dest, src + done));
+		dest += 24;
+		done += 32;
+	}
+
+	// if (bad != 0) err = -1;
+	uint32_t mask = (uint32_t) _mm256_movemask_epi8(bad);
+	err |= -(int) ((mask | (0 - mask)) >> 31);
+	return done;
+}
+#endif
+
 
 // **********************
 // *** Main Functions ***
@@ -222,14 +370,13 @@ size_t base64DecodedSize(const char *src, size_t srcSize, int flags)
 			ch       = (uint8_t) src[srcSize - 2];
 			int pad3 = ((-(ch ^ '=')) >> 8) + 1;
 			srcSize  -= pad2 + pad3;
-			// if (pad3 == 0 && pad2 == 1) size = SIZE_MAX;
-			// *** Assumption *** "SIZE_MAX == (1 << n) - 1"
-			size = (pad3 - pad2) | SIZE_MAX;
+			// if (pad3 == 1 && pad2 == 0) size = SIZE_MAX;
+			size = (size_t) 0 - (size_t) (pad3 & ~pad2);
 		}
 		// size = 3 * (srcSize / 4)
 		// if (srcSize % 4 != 0) size += srcSize % 4 - 1;
 		// *** Assumption *** "SIZE_MAX == (1 << n) - 1"
-		size |= 3 * (srcSize / 4) + srcSize % 4 - ((-(int) (srcSize % 4)) & 1);
+		size |= 3 * (srcSize / 4) + srcSize % 4 - ((srcSize % 4 + 3) >> 2);
 	}
 	return size;
 }
@@ -247,6 +394,16 @@ size_t base64Encode(char *dest, const void *src, size_t srcSize, int flags)
 {
 	char *dest_ = dest;
 
+#ifdef BASE64_AVX2
+	if (srcSize >= 24 && base64HasAvx2())
+	{
+		size_t done = base64EncodeAvx2(dest, (const uint8_t*) src, srcSize);
+
+		dest    += done / 3 * 4;
+		src      = (const uint8_t*) src + done;
+		srcSize -= done;
+	}
+#endif
 	for (; srcSize >= 3; srcSize -= 3)
 	{
 		base64Encode3BytesDotSlashOrdered(dest, (const uint8_t*) src);
@@ -305,6 +462,20 @@ int base64Decode(void *dest, const char *src, size_t srcSize, int flags)
 	}
 	else if (srcSize > 0)
 	{
+#ifdef BASE64_AVX2
+		if (srcSize >= 32 && base64HasAvx2())
+		{
+			size_t done = base64DecodeAvx2((uint8_t*) dest, src, srcSize, err);
+
+			dest     = (uint8_t*) dest + done / 4 * 3;
+			src     += done;
+			srcSize -= done;
+			if (srcSize == 0)
+			{
+				return (err >> 8) & 1;
+			}
+		}
+#endif
 		for (; srcSize > 4; srcSize -= 4)
 		{
 			err |= base64Decode3BytesDotSlashOrdered((uint8_t*) dest, src);
@@ -329,9 +500,9 @@ int base64Decode(void *dest, const char *src, size_t srcSize, int flags)
 			int pad3 = ((-(ch ^ '=')) >> 8) + 1;
 			srcSize  -= pad2 + pad3;
 
-			// if (src[2] != '=' || src[3] != '=') c2 = base64Decode6BitsDotSlashOrdered(src[2])
-			// if (src[3] != '=')                  c3 = base64Decode6BitsDotSlashOrdered(src[3])
-			c2 = base64Decode6BitsDotSlashOrdered(src[2]) & ~(-(pad2 | pad3));
+			// if (src[2] != '=') c2 = base64Decode6BitsDotSlashOrdered(src[2])
+			// if (src[3] != '=') c3 = base64Decode6BitsDotSlashOrdered(src[3])
+			c2 = base64Decode6BitsDotSlashOrdered(src[2]) & ~(-pad2);
 			c3 = base64Decode6BitsDotSlashOrdered(src[3]) & ~(-pad3);
 			err |= c2 | c3;
 
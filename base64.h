@@ -12,6 +12,8 @@
 
 #pragma once
 
+#include <stddef.h>
+
 const int BASE64_FLAG_NONE                  = 0;
 const int BASE64_ENCODE_FLAG_NO_PAD         = 1;
 const int BASE64_DECODE_FLAG_IGNORE_NO_PAD  = 1;
@@ -17,6 +17,14 @@
 #include "common.h"
 #include "csprng.h"
 #include "threads.h"
+#include "threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+	#include <errno.h>
+	#include <unistd.h>
+#endif
 
 #define ROTR64(n, s) (((n) >> (s)) | ((n) << (64 - (s))))
 
@@ -43,8 +51,12 @@ static inline void bscrypt_work_fill(uint64_t *sbox, const uint64_t seed[8], siz
 	}
 }
 
-static inline void bscrypt_work_finish(uint64_t work[8], uint64_t iv, uint64_t *sbox, size_t count)
+static inline void bscrypt_work_finish(uint64_t work[8], uint64_t *sbox, size_t count)
 {
+	// iv = ((((((h ^ g) + f) ^ e) + d) ^ c) + b) ^ a
+	const uint64_t *state = sbox + count;
+	uint64_t iv = ((((((state[7] ^ state[6]) + state[5]) ^ state[4]) + state[3]) ^ state[2]) + state[1]) ^ state[0];
+
 	for (int i = 0; i < 16; i++)
 	{
 		sbox[i] = (sbox[i] + iv) ^ sbox[i + 16];
@@ -71,11 +83,23 @@ static inline void bscrypt_work_finish(uint64_t work[8], uint64_t iv, uint64_t *
 	blake2b_nativeInOut(work, sbox, 16 * sizeof(uint64_t));
 }
 
-static void bscrypt_work_32_4x(uint64_t work[8], const uint64_t seed[8], uint64_t *sbox, size_t sboxOffset, size_t count, size_t mask, uint32_t iterations, uint32_t threadId)
+static inline int bscrypt_cancelTokenCheck(bscrypt_cancelToken *cancel)
+{
+	if (cancel->canceled.load(std::memory_order_acquire))
+	{
+		return 1;
+	}
+	if (cancel->deadlineUs != 0 && getTimeUs() >= cancel->deadlineUs)
+	{
+		cancel->canceled.store(1, std::memory_order_release);
+		return 1;
+	}
+	return 0;
+}
+
+static inline void bscrypt_work_init(const uint64_t seed[8], uint64_t *sbox, size_t count, uint32_t threadId)
 {
 	// Init sboxes
-	uint64_t *s0 = sbox;
-	uint64_t *s1 = s0 + sboxOffset;
 	bscrypt_work_fill(sbox, seed, count, threadId);
 
 	// Init state
@@ -85,6 +109,13 @@ static void bscrypt_work_32_4x(uint64_t work[8], const uint64_t seed[8], uint64_
 		sbox[count + i] = sbox[i];
 	}
 	blake2b_nativeInOut(sbox + count, sbox + count - 8, 16 * sizeof(uint64_t));
+}
+
+// State is kept in sbox[count..count+8] between calls
+static inline void bscrypt_work_iterate(uint64_t *sbox, size_t sboxOffset, size_t count, size_t mask, uint32_t iterations)
+{
+	uint64_t *s0 = sbox;
+	uint64_t *s1 = s0 + sboxOffset;
 	uint64_t a = sbox[count    ];
 	uint64_t b = sbox[count + 1];
 	uint64_t c = sbox[count + 2];
@@ -220,72 +251,428 @@ static void bscrypt_work_32_4x(uint64_t work[8], const uint64_t seed[8], uint64_
 		}
 	}
 
+	sbox[count    ] = a;
+	sbox[count + 1] = b;
+	sbox[count + 2] = c;
+	sbox[count + 3] = d;
+	sbox[count + 4] = e;
+	sbox[count + 5] = f;
+	sbox[count + 6] = g;
+	sbox[count + 7] = h;
+}
+
+static int bscrypt_work_32_4x(uint64_t work[8], const uint64_t seed[8], uint64_t *sbox, size_t sboxOffset, size_t count, size_t mask, uint32_t iterations, uint32_t threadId, bscrypt_cancelToken *cancel)
+{
+	bscrypt_work_init(seed, sbox, count, threadId);
+
+	// Main loop
+	if (cancel == NULL)
+	{
+		bscrypt_work_iterate(sbox, sboxOffset, count, mask, iterations);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < iterations; i++)
+		{
+			// Once per iteration is noise compared to count / 16 inner loops
+			if (bscrypt_cancelTokenCheck(cancel))
+			{
+				secureClearMemory(sbox, sizeof(uint64_t) * (count + 8));
+				return BSCRYPT_ERROR_CANCELED;
+			}
+			bscrypt_work_iterate(sbox, sboxOffset, count, mask, 1);
+		}
+	}
+
 	// Finish
-	bscrypt_work_finish(work, ((((((h ^ g) + f) ^ e) + d) ^ c) + b) ^ a, sbox, count);
-}
-
-struct bscrypt_threadArgs
-{
-	PMUTEX          pmutex;
-	uint32_t       *threadId;
-	uint64_t       *work;
-	const uint64_t *seed;
-	uint64_t       *sbox;
-	size_t          sboxOffset;
-	size_t          count;
-	size_t          mask;
-	uint32_t        iterations;
-	uint32_t        parallelism;
-	int             wipeSboxes;
+	bscrypt_work_finish(work, sbox, count);
+
+	return 0;
+}
+
+// Max threads per request: the caller plus up to this minus one workers
+const uint32_t BSCRYPT_CTX_MAX_THREADS = 64;
+
+struct bscrypt_sbox
+{
+	bscrypt_sbox *next;
+	uint64_t     *mem;
+	uint64_t     *aligned;
+	size_t        count;
+	uint64_t      bytes;
+};
+
+/**
+ * Gets a sbox from the context's cache or allocates one if there are none big enough.
+ *
+ * @param bscrypt_ctx *ctx   - The context.
+ * @param size_t       count - Number of uint64_t needed, not counting the 8 for state.
+ * @return A sbox.
+ */
+static bscrypt_sbox *bscrypt_sboxGet(bscrypt_ctx *ctx, size_t count)
+{
+	bscrypt_sbox *sbox;
+
+	MUTEX_LOCK(ctx->mutex);
+	for (bscrypt_sbox **cur = &ctx->sboxes; *cur != NULL; cur = &(*cur)->next)
+	{
+		if ((*cur)->count >= count)
+		{
+			sbox = *cur;
+			*cur = sbox->next;
+			ctx->sboxesCached--;
+			ctx->sboxBytesCached -= sbox->bytes;
+			ctx->stats.sboxReuses++;
+			MUTEX_UNLOCK(ctx->mutex);
+			return sbox;
+		}
+	}
+	ctx->stats.sboxAllocs++;
+	MUTEX_UNLOCK(ctx->mutex);
+
+	sbox = new bscrypt_sbox;
+	sbox->mem     = new uint64_t[count + 8 + 64 / sizeof(uint64_t)];
+	// Align to 64 bytes
+	sbox->aligned = (uint64_t*) ((((uintptr_t) sbox->mem) + 63) & ~((uintptr_t) 63));
+	sbox->count   = count;
+	sbox->bytes   = sizeof(uint64_t) * (count + 8 + 64 / sizeof(uint64_t));
+	return sbox;
+}
+
+/**
+ * Wipes a sbox and returns it to the context's cache or frees it if the cache
+ * would go over sboxCacheMaxBytes.
+ *
+ * @param bscrypt_ctx  *ctx   - The context.
+ * @param bscrypt_sbox *sbox  - The sbox.
+ * @param int           wiped - Whether the sbox was already wiped.
+ */
+static void bscrypt_sboxPut(bscrypt_ctx *ctx, bscrypt_sbox *sbox, int wiped)
+{
+	if (!wiped)
+	{
+		secureClearMemory(sbox->aligned, sizeof(uint64_t) * (sbox->count + 8));
+	}
+
+	MUTEX_LOCK(ctx->mutex);
+	if (ctx->sboxBytesCached <= ctx->sboxCacheMaxBytes &&
+		sbox->bytes <= ctx->sboxCacheMaxBytes - ctx->sboxBytesCached)
+	{
+		sbox->next   = ctx->sboxes;
+		ctx->sboxes  = sbox;
+		ctx->sboxesCached++;
+		ctx->sboxBytesCached += sbox->bytes;
+		MUTEX_UNLOCK(ctx->mutex);
+		return;
+	}
+	MUTEX_UNLOCK(ctx->mutex);
+
+	delete [] sbox->mem;
+	delete sbox;
+}
+
+// Lives on the stack of the thread that called bscrypt_ctxParallel()
+struct bscrypt_parallel
+{
+	MUTEX    mutex;
+	COND     cond;
+	void   (*func)(void *arg);
+	void    *arg;
+	uint32_t helpersDone;
+};
+
+static void bscrypt_parallelHelper(void *arg)
+{
+	bscrypt_parallel *parallel = (bscrypt_parallel*) arg;
+
+	parallel->func(parallel->arg);
+
+	MUTEX_LOCK(parallel->mutex);
+	parallel->helpersDone++;
+	COND_SIGNAL(parallel->cond);
+	MUTEX_UNLOCK(parallel->mutex);
+}
+
+/**
+ * Runs func(arg) on the calling thread and on up to numHelpers of the
+ * context's workers. func should claim work from a shared counter until there
+ * is none left. Helpers that haven't started by the time the caller runs out
+ * of work are taken back off the queue. So this can't deadlock when called
+ * from a worker and nothing is allocated.
+ *
+ * @param bscrypt_ctx *ctx          - The context.
+ * @param uint32_t     numHelpers   - The maximum number of workers to use.
+ * @param void       (*func)(void*) - The function.
+ * @param void        *arg          - Passed to func.
+ */
+static void bscrypt_ctxParallel(bscrypt_ctx *ctx, uint32_t numHelpers, void (*func)(void *arg), void *arg)
+{
+	bscrypt_parallel parallel;
+	threadPoolTask   helpers[BSCRYPT_CTX_MAX_THREADS - 1];
+	uint32_t         started;
+
+	if (!ctx->poolStarted)
+	{
+		numHelpers = 0;
+	}
+	if (numHelpers > BSCRYPT_CTX_MAX_THREADS - 1)
+	{
+		numHelpers = BSCRYPT_CTX_MAX_THREADS - 1;
+	}
+	if (numHelpers == 0)
+	{
+		func(arg);
+		return;
+	}
+
+	MUTEX_CREATE(parallel.mutex);
+	COND_CREATE(parallel.cond);
+	parallel.func        = func;
+	parallel.arg         = arg;
+	parallel.helpersDone = 0;
+
+	// Run
+	for (uint32_t i = 0; i < numHelpers; i++)
+	{
+		helpers[i].func = bscrypt_parallelHelper;
+		helpers[i].arg  = &parallel;
+		threadPool_submit(&ctx->pool, helpers + i);
+	}
+	func(arg);
+
+	// Wait
+	started = numHelpers;
+	for (uint32_t i = 0; i < numHelpers; i++)
+	{
+		if (threadPool_remove(&ctx->pool, helpers + i))
+		{
+			started--;
+		}
+	}
+	MUTEX_LOCK(parallel.mutex);
+	while (parallel.helpersDone < started)
+	{
+		COND_WAIT(parallel.cond, parallel.mutex);
+	}
+	MUTEX_UNLOCK(parallel.mutex);
+
+	// Clean up
+	COND_DELETE(parallel.cond);
+	MUTEX_DELETE(parallel.mutex);
+}
+
+// Lives on the stack of the thread that called bscrypt_ctxParallelFor()
+struct bscrypt_parallelFor
+{
+	MUTEX    mutex;
+	size_t   next;
+	size_t   count;
+	size_t   claimSize;
+	void   (*func)(void *arg, size_t i);
+	void    *arg;
+};
+
+static void bscrypt_parallelForRun(void *arg)
+{
+	bscrypt_parallelFor *parallelFor = (bscrypt_parallelFor*) arg;
+	size_t               start;
+	size_t               end;
+
+	while (1)
+	{
+		// Claim a few at a time to keep the lock cold
+		MUTEX_LOCK(parallelFor->mutex);
+		start = parallelFor->next;
+		end   = parallelFor->count;
+		if (end - start > parallelFor->claimSize)
+		{
+			end = start + parallelFor->claimSize;
+		}
+		parallelFor->next = end;
+		MUTEX_UNLOCK(parallelFor->mutex);
+		if (start >= end)
+		{
+			break;
+		}
+
+		for (size_t i = start; i < end; i++)
+		{
+			parallelFor->func(parallelFor->arg, i);
+		}
+	}
+}
+
+/**
+ * Runs func(arg, i) for i in [0, count) on the calling thread and the
+ * context's workers with one thread per minPerThread calls. If ctx is NULL
+ * everything runs on the calling thread.
+ *
+ * @param bscrypt_ctx *ctx                   - The context or NULL.
+ * @param size_t       count                 - Number of calls.
+ * @param size_t       minPerThread          - Minimum calls worth a thread.
+ * @param void       (*func)(void*, size_t) - The function.
+ * @param void        *arg                   - Passed to func.
+ */
+void bscrypt_ctxParallelFor(bscrypt_ctx *ctx, size_t count, size_t minPerThread, void (*func)(void *arg, size_t i), void *arg)
+{
+	bscrypt_parallelFor parallelFor;
+	size_t              numHelpers = 0;
+
+	if (ctx != NULL && ctx->poolStarted)
+	{
+		numHelpers = count / minPerThread;
+		if (numHelpers > 0)
+		{
+			numHelpers--;
+		}
+		if (numHelpers > ctx->pool.numThreads)
+		{
+			numHelpers = ctx->pool.numThreads;
+		}
+	}
+	if (numHelpers == 0)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			func(arg, i);
+		}
+		return;
+	}
+
+	MUTEX_CREATE(parallelFor.mutex);
+	parallelFor.next      = 0;
+	parallelFor.count     = count;
+	parallelFor.claimSize = minPerThread / 4 + 1;
+	parallelFor.func      = func;
+	parallelFor.arg       = arg;
+	bscrypt_ctxParallel(ctx, (uint32_t) numHelpers, bscrypt_parallelForRun, &parallelFor);
+	MUTEX_DELETE(parallelFor.mutex);
+}
+
+// Lives on the stack of the thread that called bscrypt_kdf()
+struct bscrypt_lanes
+{
+	MUTEX                mutex;
+	bscrypt_ctx         *ctx;
+	uint64_t            *work;
+	const uint64_t      *seed;
+	size_t               sboxOffset;
+	size_t               count;
+	size_t               mask;
+	uint32_t             iterations;
+	uint32_t             parallelism;
+	uint32_t             nextLane;
+	uint64_t            *scratch;
+	size_t               scratchSlotSize;
+	uint32_t             nextSlot;
+	int                  wipeSboxes;
+	int                  ret;
+	bscrypt_cancelToken *cancel;
 };
 
-static void *bscrypt_thread(void *args)
-{
-	uint64_t        threadWork[8];
-	PMUTEX          pmutex      = ((bscrypt_threadArgs*) args)->pmutex;
-	uint32_t       *threadId    = ((bscrypt_threadArgs*) args)->threadId;
-	uint64_t       *work        = ((bscrypt_threadArgs*) args)->work;
-	const uint64_t *seed        = ((bscrypt_threadArgs*) args)->seed;
-	uint64_t       *sbox        = ((bscrypt_threadArgs*) args)->sbox;
-	size_t          sboxOffset  = ((bscrypt_threadArgs*) args)->sboxOffset;
-	size_t          count       = ((bscrypt_threadArgs*) args)->count;
-	size_t          mask        = ((bscrypt_threadArgs*) args)->mask;
-	uint32_t        iterations  = ((bscrypt_threadArgs*) args)->iterations;
-	uint32_t        parallelism = ((bscrypt_threadArgs*) args)->parallelism;
-	uint32_t        currentThreadId;
+static void bscrypt_lanesRun(void *arg)
+{
+	bscrypt_lanes *lanes       = (bscrypt_lanes*) arg;
+	uint64_t       threadWork[8];
+	bscrypt_sbox  *sbox        = NULL;
+	uint64_t      *sboxAligned = NULL;
+	int            canceled    = 0;
+	uint32_t       lane;
+	int            stop;
 
 	while (1)
 	{
-		// Next work
-		PMUTEX_LOCK(pmutex);
-		currentThreadId = *threadId;
-		(*threadId)++;
-		PMUTEX_UNLOCK(pmutex);
-		if (currentThreadId >= parallelism)
+		// Next lane
+		MUTEX_LOCK(lanes->mutex);
+		lane = lanes->nextLane;
+		lanes->nextLane++;
+		stop = lane >= lanes->parallelism || lanes->ret != 0;
+		MUTEX_UNLOCK(lanes->mutex);
+		if (stop)
 		{
 			break;
 		}
+		if (sboxAligned == NULL)
+		{
+			if (lanes->scratch != NULL)
+			{
+				// Each thread gets its own slot
+				MUTEX_LOCK(lanes->mutex);
+				sboxAligned = lanes->scratch + lanes->scratchSlotSize * lanes->nextSlot;
+				lanes->nextSlot++;
+				MUTEX_UNLOCK(lanes->mutex);
+			}
+			else
+			{
+				sbox = bscrypt_sboxGet(lanes->ctx, lanes->count);
+				sboxAligned = sbox->aligned;
+			}
+		}
 
 		// Do work
-		bscrypt_work_32_4x(threadWork, seed, sbox, sboxOffset, count, mask, iterations, currentThreadId);
+		if (bscrypt_work_32_4x(threadWork, lanes->seed, sboxAligned, lanes->sboxOffset, lanes->count, lanes->mask, lanes->iterations, lane, lanes->cancel))
+		{
+			// Canceled lanes already wiped their sbox
+			canceled = 1;
+			MUTEX_LOCK(lanes->mutex);
+			lanes->ret = BSCRYPT_ERROR_CANCELED;
+			MUTEX_UNLOCK(lanes->mutex);
+			break;
+		}
 
 		// Combine work
-		PMUTEX_LOCK(pmutex);
+		MUTEX_LOCK(lanes->mutex);
 		for (uint32_t i = 0; i < 8; i++)
 		{
-			work[i] ^= threadWork[i];
+			lanes->work[i] ^= threadWork[i];
 		}
-		PMUTEX_UNLOCK(pmutex);
+		MUTEX_UNLOCK(lanes->mutex);
 	}
 
 	// Clear
 	secureClearMemory(threadWork, sizeof(threadWork));
-	if (((bscrypt_threadArgs*) args)->wipeSboxes)
+	if (sbox != NULL)
 	{
-		secureClearMemory(sbox, sizeof(uint64_t) * (count + 8));
+		// Cached sboxes are always wiped
+		bscrypt_sboxPut(lanes->ctx, sbox, canceled);
 	}
+	else if (sboxAligned != NULL && lanes->wipeSboxes && !canceled)
+	{
+		secureClearMemory(sboxAligned, sizeof(uint64_t) * (lanes->count + 8));
+	}
+}
 
-	return NULL;
+/**
+ * Runs all lanes on "threads" threads. Nothing is allocated. If scratch isn't
+ * NULL, it has "threads" slots of scratchSlotSize uint64_t and sboxes come from
+ * there instead of the context's cache.
+ */
+static int bscrypt_lanesRunAll(bscrypt_ctx *ctx, uint64_t work[8], const uint64_t seed[8], size_t sboxOffset, size_t count, size_t mask, uint32_t iterations, uint32_t parallelism, uint32_t threads, int wipeSboxes, uint64_t *scratch, size_t scratchSlotSize, bscrypt_cancelToken *cancel)
+{
+	bscrypt_lanes lanes;
+
+	MUTEX_CREATE(lanes.mutex);
+	lanes.ctx             = ctx;
+	lanes.work            = work;
+	lanes.seed            = seed;
+	lanes.sboxOffset      = sboxOffset;
+	lanes.count           = count;
+	lanes.mask            = mask;
+	lanes.iterations      = iterations;
+	lanes.parallelism     = parallelism;
+	lanes.nextLane        = 0;
+	lanes.scratch         = scratch;
+	lanes.scratchSlotSize = scratchSlotSize;
+	lanes.nextSlot        = 0;
+	lanes.wipeSboxes      = wipeSboxes;
+	lanes.ret             = 0;
+	lanes.cancel          = cancel;
+
+	bscrypt_ctxParallel(ctx, threads - 1, bscrypt_lanesRun, &lanes);
+
+	MUTEX_DELETE(lanes.mutex);
+
+	return lanes.ret;
 }
 
 static size_t readUint32(uint32_t &out, const char *str, size_t offset, char endingChar)
@@ -370,35 +757,12 @@ static size_t bscrypt_decodeHash(const char hash[BSCRYPT_HASH_MAX_SIZE], uint32_
 	return offset;
 }
 
-/**
- * Generates a key with bscrypt.
- *
- * @param void       *output       - Output of bscrypt.
- * @param size_t      outputSize   - Output size.
- * @param const void *password     - The password.
- * @param size_t      passwordSize - Size of the password.
- * @param const void *salt         - The salt.
- * @param size_t      saltSize     - Size of the salt.
- * @param uint32_t    memoryKiB    - The size of the sboxes in KiB (m).
- * @param uint32_t    iterations   - The number of iterations (t).
- * @param uint32_t    parallelism  - The amount of parallelism (p).
- * @param uint32_t    maxThreads   - The maximum number of threads.
- * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
- * @return On success 0, otherwise non-zero.
- */
-int bscrypt_kdf(void *output, size_t outputSize, const void *password, size_t passwordSize, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes)
+static int bscrypt_getSboxInfo(uint32_t memoryKiB, size_t &count, size_t &sboxOffset, size_t &mask)
 {
-	size_t sboxOffset;
-	size_t count;
-	size_t mask;
-
-	// Limits
-	if      (memoryKiB   > MEMORY_KIB_MAX)           { memoryKiB = MEMORY_KIB_MAX; }
-	else if (memoryKiB   < MEMORY_KIB_MIN)           { memoryKiB = MEMORY_KIB_MIN; }
-	if      (memoryKiB   > SIZE_MAX / (size_t) 1024) { return 1; }
-	if      (iterations  < ITERATIONS_MIN)           { iterations = ITERATIONS_MIN; }
-	if      (parallelism < 1)                        { parallelism = 1; }
-	if      (maxThreads  > parallelism)              { maxThreads = parallelism; }
+	if (memoryKiB > SIZE_MAX / (size_t) 1024)
+	{
+		return 1;
+	}
 
 	count = (size_t) 1024 / sizeof(uint64_t) * memoryKiB;
 
@@ -430,324 +794,2386 @@ int bscrypt_kdf(void *output, size_t outputSize, const void *password, size_t pa
 		mask = sboxSize - 1;
 	}
 
-	union
-	{
-		uint64_t workSeed[16];
-		struct
-		{
-			uint64_t work[8];
-			uint64_t seed[8];
-		};
-	};
-	memset(work, 0, sizeof(work));
+	return 0;
+}
 
-	// Step 1: seed = H(inputs)
+static void bscrypt_seedInit(blake2b_ctx *ctx, const void *salt, size_t saltSize)
+{
+	// seed = H(H(salt) || password)
+	uint64_t saltHash[8];
+	blake2b_init(ctx, 8 * sizeof(uint64_t));
+	blake2b_update(ctx, salt, saltSize);
+	blake2b_finish(ctx, saltHash);
+	blake2b_update(ctx, saltHash, 8 * sizeof(uint64_t));
+	secureClearMemory(saltHash, sizeof(saltHash));
+}
+
+static void bscrypt_seed(uint64_t seed[8], const void *password, size_t passwordSize, const void *salt, size_t saltSize)
+{
 	// seed = H(H(salt) || password)
 	blake2b_ctx ctx;
-	blake2b_init(&ctx, sizeof(seed));
-	blake2b_update(&ctx, salt, saltSize);
-	blake2b_finish(&ctx, seed);
-	blake2b_update(&ctx, seed, sizeof(seed));
+	bscrypt_seedInit(&ctx, salt, saltSize);
 	blake2b_update(&ctx, password, passwordSize);
 	blake2b_finish(&ctx, seed);
+}
 
-	// Step 2: work = doWork(seed)
-	if (maxThreads == 1)
+static void bscrypt_seedParts(uint64_t seed[8], const bscrypt_passwordPart *parts, size_t numParts, const void *salt, size_t saltSize)
+{
+	// seed = H(H(salt) || part[0] || part[1] || ...)
+	blake2b_ctx ctx;
+	bscrypt_seedInit(&ctx, salt, saltSize);
+	for (size_t i = 0; i < numParts; i++)
 	{
-		uint64_t threadWork[8];
-		uint64_t *sbox = new uint64_t[count + 8 + 64 / sizeof(uint64_t)];
-		// Align to 64 bytes
-		uint64_t *sboxAligned = (uint64_t*) ((((uintptr_t) sbox) + 63) & ~((uintptr_t) 63));
-		
-		for (uint32_t i = 0; i < parallelism; i++)
-		{
-			bscrypt_work_32_4x(threadWork, seed, sboxAligned, sboxOffset, count, mask, iterations, i);
+		blake2b_update(&ctx, parts[i].data, parts[i].size);
+	}
+	blake2b_finish(&ctx, seed);
+}
 
-			for (uint32_t j = 0; j < 8; j++)
-			{
-				work[j] ^= threadWork[j];
-			}
-		}
+// Expanding less than this many 64 byte chunks isn't worth another thread
+const size_t BSCRYPT_EXPAND_CHUNKS_PER_THREAD = 256;
 
-		// Clean up
-		secureClearMemory(threadWork, sizeof(threadWork));
-		if (wipeSboxes)
-		{
-			secureClearMemory(sboxAligned, sizeof(uint64_t) * (count + 8));
-		}
-		delete [] sbox;
-	}
-	else
-	{
-		THREAD              *threads       = new THREAD[maxThreads];
-		bscrypt_threadArgs  *args          = new bscrypt_threadArgs[maxThreads];
-		uint64_t           **sboxes        = new uint64_t*[maxThreads];
-		uint64_t           **sboxesAligned = new uint64_t*[maxThreads];
-		PMUTEX               pmutex;
-		uint32_t             threadId = 0;
-
-		// Init
-		PMUTEX_CREATE(pmutex);
-		for (uint32_t i = 0; i < maxThreads; i++)
-		{
-			sboxes[i] = new uint64_t[count + 8 + 64 / sizeof(uint64_t)];
-
-			args[i].pmutex      = pmutex;
-			args[i].threadId    = &threadId;
-			args[i].work        = work;
-			args[i].seed        = seed;
-			// Align to 64 bytes
-			args[i].sbox        = (uint64_t*) ((((uintptr_t) sboxes[i]) + 63) & ~((uintptr_t) 63));
-			args[i].sboxOffset  = sboxOffset;
-			args[i].count       = count;
-			args[i].mask        = mask;
-			args[i].iterations  = iterations;
-			args[i].parallelism = parallelism;
-			args[i].wipeSboxes  = wipeSboxes;
-		}
-
-		// Run threads
-		for (uint32_t i = 0; i < maxThreads; i++)
-		{
-			if (THREAD_CREATE(threads[i], bscrypt_thread, args + i))
-			{
-				if (i > 0)
-				{
-					// At least a thread was created just let them run and exit
-					for (uint32_t j = 0; j < i; j++)
-					{
-						THREAD_WAIT(threads[j]);
-					}
-					for (uint32_t i = 0; i < maxThreads; i++)
-					{
-						delete [] sboxes[i];
-					}
-					maxThreads = 0;
-				}
-				else
-				{
-					// Can't create a thread, clean up and go single threaded
-
-					// Clean up
-					PMUTEX_DELETE(pmutex);
-					for (uint32_t i = 0; i < maxThreads; i++)
-					{
-						delete [] sboxes[i];
-					}
-					delete [] threads;
-					delete [] args;
-					delete [] sboxes;
-					delete [] sboxesAligned;
-
-					return bscrypt_kdf(output, outputSize, password, passwordSize, salt, saltSize, memoryKiB, iterations, parallelism, 1, wipeSboxes);
-				}
-			}
-		}
-		for (uint32_t i = 0; i < maxThreads; i++)
-		{
-			THREAD_WAIT(threads[i]);
-		}
+struct bscrypt_outputArgs
+{
+	uint8_t        *output;
+	size_t          outputSize;
+	const uint64_t *workSeed;
+};
 
-		// Clean up
-		PMUTEX_DELETE(pmutex);
-		for (uint32_t i = 0; i < maxThreads; i++)
-		{
-			delete [] sboxes[i];
-		}
-		delete [] threads;
-		delete [] args;
-		delete [] sboxes;
-		delete [] sboxesAligned;
-	}
+static void bscrypt_outputChunk(void *arg, size_t i)
+{
+	bscrypt_outputArgs *args = (bscrypt_outputArgs*) arg;
+	uint64_t            workSeed[16];
+	size_t              size = args->outputSize - 64 * i;
+	uint64_t            k    = (uint64_t) i;
 
-	// Step 3: output = kdf(work, seed)
-	uint64_t i = 1;
-	while (outputSize > 64)
+	if (size > 64)
 	{
-		blake2b_nativeIn(output, 64, workSeed, 16 * sizeof(uint64_t));
-		output = ((uint8_t*) output) + 64;
-		outputSize -= 64;
-		workSeed[0] ^= i;
-		i++;
+		size = 64;
 	}
-	if (outputSize != 0)
+
+	// Chunk i has workSeed[0] ^= 1 ^ 2 ^ ... ^ i
+	memcpy(workSeed, args->workSeed, sizeof(workSeed));
+	switch (k % 4)
 	{
-		blake2b_nativeIn(output, outputSize, workSeed, 16 * sizeof(uint64_t));
+		case 0: workSeed[0] ^= k;     break;
+		case 1: workSeed[0] ^= 1;     break;
+		case 2: workSeed[0] ^= k + 1; break;
+		case 3:                       break;
 	}
+	blake2b_nativeIn(args->output + 64 * i, size, workSeed, 16 * sizeof(uint64_t));
 
 	// Clear
 	secureClearMemory(workSeed, sizeof(workSeed));
+}
 
-	return 0;
+/**
+ * Step 3: output = kdf(work, seed). Chunks are independent so large outputs
+ * are spread across the context's workers.
+ *
+ * @param bscrypt_ctx    *ctx        - The context or NULL for the calling thread only.
+ * @param void           *output     - Output of bscrypt.
+ * @param size_t          outputSize - Output size.
+ * @param const uint64_t  workSeed[16] - work || seed.
+ */
+static void bscrypt_output(bscrypt_ctx *ctx, void *output, size_t outputSize, const uint64_t workSeed[16])
+{
+	bscrypt_outputArgs args;
+
+	args.output     = (uint8_t*) output;
+	args.outputSize = outputSize;
+	args.workSeed   = workSeed;
+	bscrypt_ctxParallelFor(ctx, (outputSize + 63) / 64, BSCRYPT_EXPAND_CHUNKS_PER_THREAD, bscrypt_outputChunk, &args);
 }
 
-static int bscrypt_hash_(char hash[BSCRYPT_HASH_MAX_SIZE], const void *password, size_t passwordSize, const uint8_t salt[16], uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams)
+/**
+ * Picks the number of threads for a request and counts them as active.
+ *
+ * For BSCRYPT_THREADS_AUTO, threads already running bscrypt_kdf() plus jobs
+ * waiting for the context's workers are the load. Whatever cores are left
+ * over are used up to parallelism. When there are none it's 1 thread which is
+ * the best for throughput when saturated.
+ *
+ * @param bscrypt_ctx *ctx         - The context.
+ * @param uint32_t     maxThreads  - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param uint32_t     parallelism - The amount of parallelism (p).
+ * @param uint32_t     maxSlots    - The maximum number of sboxes available.
+ * @return The number of threads to use.
+ */
+static uint32_t bscrypt_ctxThreadsStart(bscrypt_ctx *ctx, uint32_t maxThreads, uint32_t parallelism, uint32_t maxSlots)
 {
-	uint8_t hashBytes[BSCRYPT_ENCRYPTED_HASH_MAX_SIZE];
-	size_t hashBytesSize = 24;
+	uint32_t limit   = 1;
+	uint32_t busy    = 0;
+	uint32_t queued  = 0;
+	uint32_t threads = maxThreads;
 
-	// Limits
-	if (memoryKiB > MEMORY_KIB_MAX)
-	{
-		memoryKiB = MEMORY_KIB_MAX;
-	}
-	else if (memoryKiB < MEMORY_KIB_MIN)
+	if (ctx->poolStarted)
 	{
-		memoryKiB = MEMORY_KIB_MIN;
+		limit = ctx->pool.numThreads + 1;
+		if (limit > BSCRYPT_CTX_MAX_THREADS)
+		{
+			limit = BSCRYPT_CTX_MAX_THREADS;
+		}
+		if (maxThreads == BSCRYPT_THREADS_AUTO)
+		{
+			threadPool_load(&ctx->pool, busy, queued);
+		}
 	}
-	if (iterations < ITERATIONS_MIN)
+	if (limit > parallelism)
 	{
-		iterations = ITERATIONS_MIN;
+		limit = parallelism;
 	}
-	if (parallelism < 1)
+	if (limit > maxSlots)
 	{
-		parallelism = 1;
+		limit = maxSlots;
 	}
 
-	// Generate hash
-	if (bscrypt_kdf(hashBytes, hashBytesSize, password, passwordSize, salt, 16 * sizeof(uint8_t), memoryKiB, iterations, parallelism, maxThreads, wipeSboxes))
+	MUTEX_LOCK(ctx->mutex);
+	ctx->stats.kdfCalls++;
+	if (maxThreads == BSCRYPT_THREADS_AUTO)
 	{
-		hash[0] = 0;
-		return 1;
-	}
+		uint32_t used = ctx->activeThreads + queued;
 
-	// Encrypt
-	if (encryptFunc != NULL)
-	{
-		hashBytesSize = encryptFunc(encryptHashParams, hashBytes, hashBytesSize, BSCRYPT_ENCRYPTED_HASH_MAX_SIZE);
-		if (hashBytesSize > BSCRYPT_ENCRYPTED_HASH_MAX_SIZE)
+		threads = 1;
+		if (ctx->numCores > used)
 		{
-			return 1;
+			threads = ctx->numCores - used;
 		}
-	}
-
+		if (threads > limit)
+		{
+			threads = limit;
+		}
+
+		bscrypt_autoThreadsStats &stats = ctx->stats.autoThreads;
+		stats.decisions++;
+		stats.threadsTotal += threads;
+		stats.loadTotal    += used;
+		stats.lastThreads   = threads;
+		stats.lastLoad      = used;
+		if (threads == 1)
+		{
+			stats.serial++;
+		}
+		if (threads == parallelism)
+		{
+			stats.full++;
+		}
+	}
+	else if (threads > limit)
+	{
+		threads = limit;
+	}
+	ctx->activeThreads += threads;
+	MUTEX_UNLOCK(ctx->mutex);
+
+	return threads;
+}
+
+static void bscrypt_ctxThreadsDone(bscrypt_ctx *ctx, uint32_t threads, int ret)
+{
+	MUTEX_LOCK(ctx->mutex);
+	ctx->activeThreads -= threads;
+	if (ret == BSCRYPT_ERROR_CANCELED)
+	{
+		ctx->stats.canceled++;
+	}
+	MUTEX_UNLOCK(ctx->mutex);
+}
+
+/**
+ * Creates a context. It owns a worker pool, a cache of sboxes, and stats.
+ * After the first few calls, bscrypt_ctxKdf(), bscrypt_ctxHash(), and
+ * bscrypt_ctxVerify() don't allocate memory. Change maxThreads, wipeSboxes,
+ * and the limits (max*) after this if you don't want the defaults.
+ *
+ * @param bscrypt_ctx *ctx        - The context.
+ * @param uint32_t     numWorkers - Number of worker threads or 0 for the number of cores.
+ * @return On success 0. Otherwise, non-zero but the context still works with only the calling thread.
+ */
+int bscrypt_ctxInit(bscrypt_ctx *ctx, uint32_t numWorkers)
+{
+	int cores = getNumCores();
+
+	MUTEX_CREATE(ctx->mutex);
+	ctx->poolStarted       = threadPool_init(&ctx->pool, numWorkers) == 0;
+	ctx->numCores          = cores > 1 ? (uint32_t) cores : 1;
+	ctx->sboxes            = NULL;
+	ctx->sboxesCached      = 0;
+	ctx->sboxBytesCached   = 0;
+	ctx->sboxCacheMaxBytes = BSCRYPT_SBOX_CACHE_DEFAULT_BYTES;
+	ctx->activeThreads     = 0;
+	ctx->maxThreads        = BSCRYPT_THREADS_AUTO;
+	ctx->wipeSboxes        = 0;
+	ctx->maxMemoryKiB      = MEMORY_KIB_MAX;
+	ctx->maxIterations     = UINT32_MAX;
+	ctx->maxParallelism    = UINT32_MAX;
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+
+	return !ctx->poolStarted;
+}
+
+/**
+ * Destroys a context. Nothing may be using it.
+ *
+ * @param bscrypt_ctx *ctx - The context.
+ */
+void bscrypt_ctxDestroy(bscrypt_ctx *ctx)
+{
+	if (ctx->poolStarted)
+	{
+		threadPool_destroy(&ctx->pool);
+		ctx->poolStarted = 0;
+	}
+	bscrypt_ctxTrim(ctx);
+	MUTEX_DELETE(ctx->mutex);
+}
+
+/**
+ * Wipes and frees the context's cached sboxes.
+ *
+ * @param bscrypt_ctx *ctx - The context.
+ */
+void bscrypt_ctxTrim(bscrypt_ctx *ctx)
+{
+	bscrypt_sbox *sboxes;
+
+	MUTEX_LOCK(ctx->mutex);
+	sboxes = ctx->sboxes;
+	ctx->sboxes          = NULL;
+	ctx->sboxesCached    = 0;
+	ctx->sboxBytesCached = 0;
+	MUTEX_UNLOCK(ctx->mutex);
+
+	while (sboxes != NULL)
+	{
+		bscrypt_sbox *next = sboxes->next;
+
+		secureClearMemory(sboxes->mem, sboxes->bytes);
+		delete [] sboxes->mem;
+		delete sboxes;
+		sboxes = next;
+	}
+}
+
+/**
+ * Gets a context's stats.
+ *
+ * @param bscrypt_ctx      *ctx   - The context.
+ * @param bscrypt_ctxStats *stats - Receives the stats.
+ */
+void bscrypt_ctxGetStats(bscrypt_ctx *ctx, bscrypt_ctxStats *stats)
+{
+	MUTEX_LOCK(ctx->mutex);
+	*stats = ctx->stats;
+	stats->sboxesCached    = ctx->sboxesCached;
+	stats->sboxBytesCached = ctx->sboxBytesCached;
+	stats->autoThreads.activeThreads = ctx->activeThreads;
+	MUTEX_UNLOCK(ctx->mutex);
+}
+
+static bscrypt_ctx *bscrypt_createDefaultCtx()
+{
+	bscrypt_ctx *ctx = new bscrypt_ctx;
+
+	// If the workers don't start everything runs on the calling thread
+	bscrypt_ctxInit(ctx, 0);
+	return ctx;
+}
+
+/**
+ * Gets the default context used by the functions that don't take one. It's
+ * created on first use with a worker per core.
+ *
+ * @return The default context.
+ */
+bscrypt_ctx *bscrypt_getDefaultCtx()
+{
+	// Thread safe in C++11
+	static bscrypt_ctx *ctx = bscrypt_createDefaultCtx();
+
+	return ctx;
+}
+
+/**
+ * Gets the decisions made for BSCRYPT_THREADS_AUTO by the default context.
+ * Compare average threads (threadsTotal / decisions) with average load
+ * (loadTotal / decisions) to see that it tracks load.
+ *
+ * @param bscrypt_autoThreadsStats *stats - Receives the stats.
+ */
+void bscrypt_getAutoThreadsStats(bscrypt_autoThreadsStats *stats)
+{
+	bscrypt_ctxStats ctxStats;
+
+	bscrypt_ctxGetStats(bscrypt_getDefaultCtx(), &ctxStats);
+	*stats = ctxStats.autoThreads;
+}
+
+/**
+ * Gets the size of a scratch slot which holds one sbox plus the 8 uint64_t of
+ * lane state rounded up to 64 bytes.
+ *
+ * @param size_t count - Number of uint64_t in the sbox.
+ * @return Size in uint64_t.
+ */
+static size_t bscrypt_scratchSlotSize(size_t count)
+{
+	return (count + 8 + 7) & ~(size_t) 7;
+}
+
+/**
+ * Step 2 of bscrypt_kdf(). The caller does step 1 into seed and clears work
+ * and seed.
+ *
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero.
+ */
+static int bscrypt_kdfWork_(bscrypt_ctx *ctx, uint64_t work[8], const uint64_t seed[8], uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, void *scratch, size_t scratchSize, bscrypt_cancelToken *cancel)
+{
+	size_t   sboxOffset;
+	size_t   count;
+	size_t   mask;
+	size_t   slotSize = 0;
+	uint32_t maxSlots = UINT32_MAX;
+	uint32_t threads;
+	int      ret;
+
+	// Limits
+	if      (memoryKiB   > MEMORY_KIB_MAX)           { memoryKiB = MEMORY_KIB_MAX; }
+	else if (memoryKiB   < MEMORY_KIB_MIN)           { memoryKiB = MEMORY_KIB_MIN; }
+	if      (iterations  < ITERATIONS_MIN)           { iterations = ITERATIONS_MIN; }
+	if      (parallelism < 1)                        { parallelism = 1; }
+
+	if (memoryKiB   > ctx->maxMemoryKiB  ||
+		iterations  > ctx->maxIterations ||
+		parallelism > ctx->maxParallelism)
+	{
+		MUTEX_LOCK(ctx->mutex);
+		ctx->stats.overLimits++;
+		MUTEX_UNLOCK(ctx->mutex);
+		return 1;
+	}
+	if (bscrypt_getSboxInfo(memoryKiB, count, sboxOffset, mask))
+	{
+		return 1;
+	}
+	if (scratch != NULL)
+	{
+		size_t slots;
+
+		slotSize = bscrypt_scratchSlotSize(count);
+		slots    = scratchSize / sizeof(uint64_t) / slotSize;
+		if ((((uintptr_t) scratch) & 63) != 0 || slots == 0)
+		{
+			return 1;
+		}
+		if (slots < maxSlots)
+		{
+			maxSlots = (uint32_t) slots;
+		}
+	}
+
+	memset(work, 0, 8 * sizeof(uint64_t));
+
+	// Step 2: work = doWork(seed)
+	threads = bscrypt_ctxThreadsStart(ctx, maxThreads, parallelism, maxSlots);
+	ret = bscrypt_lanesRunAll(ctx, work, seed, sboxOffset, count, mask, iterations, parallelism, threads, wipeSboxes, (uint64_t*) scratch, slotSize, cancel);
+	bscrypt_ctxThreadsDone(ctx, threads, ret);
+
+	return ret;
+}
+
+/**
+ * Steps 2 and 3 of bscrypt_kdf(). workSeed's seed half is from step 1.
+ * workSeed is cleared.
+ */
+static int bscrypt_kdfSeeded_(bscrypt_ctx *ctx, void *output, size_t outputSize, uint64_t workSeed[16], uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, void *scratch, size_t scratchSize, bscrypt_cancelToken *cancel)
+{
+	// Step 2: work = doWork(seed)
+	int ret = bscrypt_kdfWork_(ctx, workSeed, workSeed + 8, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, scratch, scratchSize, cancel);
+	if (ret == 0)
+	{
+		// Step 3: output = kdf(work, seed)
+		bscrypt_output(ctx, output, outputSize, workSeed);
+	}
+
+	// Clear
+	secureClearMemory(workSeed, 16 * sizeof(uint64_t));
+
+	return ret;
+}
+
+static int bscrypt_kdf_(bscrypt_ctx *ctx, void *output, size_t outputSize, const void *password, size_t passwordSize, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, void *scratch, size_t scratchSize, bscrypt_cancelToken *cancel)
+{
+	uint64_t workSeed[16];
+
+	// Step 1: seed = H(inputs)
+	bscrypt_seed(workSeed + 8, password, passwordSize, salt, saltSize);
+
+	return bscrypt_kdfSeeded_(ctx, output, outputSize, workSeed, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, scratch, scratchSize, cancel);
+}
+
+static int bscrypt_kdfParts_(bscrypt_ctx *ctx, void *output, size_t outputSize, const bscrypt_passwordPart *parts, size_t numParts, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel)
+{
+	uint64_t workSeed[16];
+
+	// Step 1: seed = H(inputs)
+	bscrypt_seedParts(workSeed + 8, parts, numParts, salt, saltSize);
+
+	return bscrypt_kdfSeeded_(ctx, output, outputSize, workSeed, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, NULL, 0, cancel);
+}
+
+struct bscrypt_subkeysArgs
+{
+	const bscrypt_subkey *subkeys;
+	const uint8_t        *keys;
+	const size_t         *firstChunks;
+	size_t                count;
+};
+
+static void bscrypt_subkeysChunk(void *arg, size_t i)
+{
+	bscrypt_subkeysArgs *args = (bscrypt_subkeysArgs*) arg;
+	blake2b_ctx          ctx;
+	uint8_t              chunkNum[8];
+	size_t               k    = 0;
+	size_t               size;
+
+	// Find subkey for chunk i
+	size_t lo = 0;
+	size_t hi = args->count;
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+
+		if (args->firstChunks[mid] <= i)
+		{
+			lo = mid;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	k = lo;
+	i -= args->firstChunks[k];
+	size = args->subkeys[k].outputSize - 64 * i;
+	if (size > 64)
+	{
+		size = 64;
+	}
+
+	// chunk = H(subkeyKey || i)
+	for (size_t j = 0; j < 8; j++)
+	{
+		chunkNum[j] = (uint8_t) (((uint64_t) i) >> (8 * j));
+	}
+	blake2b_init(&ctx, size);
+	blake2b_update(&ctx, args->keys + 64 * k, 64);
+	blake2b_update(&ctx, chunkNum, sizeof(chunkNum));
+	blake2b_finish(&ctx, ((uint8_t*) args->subkeys[k].output) + 64 * i);
+	secureClearMemory(&ctx, sizeof(ctx));
+}
+
+static int bscrypt_kdfSubkeys_(bscrypt_ctx *ctx, bscrypt_subkey *subkeys, size_t count, const void *password, size_t passwordSize, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel)
+{
+	bscrypt_subkeysArgs args;
+	uint8_t             workSeedBytes[16 * sizeof(uint64_t)];
+	uint8_t            *keys;
+	size_t             *firstChunks;
+	size_t              numChunks = 0;
+	uint64_t            workSeed[16];
+
+	if (count == 0)
+	{
+		return 1;
+	}
+	// Same label means same subkey
+	for (size_t k = 1; k < count; k++)
+	{
+		const char *label = subkeys[k].label != NULL ? subkeys[k].label : "";
+
+		for (size_t j = 0; j < k; j++)
+		{
+			if (strcmp(label, subkeys[j].label != NULL ? subkeys[j].label : "") == 0)
+			{
+				return BSCRYPT_ERROR_DUPLICATE_LABEL;
+			}
+		}
+	}
+
+	// Step 1: seed = H(inputs)
+	bscrypt_seed(workSeed + 8, password, passwordSize, salt, saltSize);
+
+	// Step 2: work = doWork(seed)
+	int ret = bscrypt_kdfWork_(ctx, workSeed, workSeed + 8, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, NULL, 0, cancel);
+	if (ret)
+	{
+		secureClearMemory(workSeed, sizeof(workSeed));
+		return ret;
+	}
+	for (size_t i = 0; i < 16 * sizeof(uint64_t); i++)
+	{
+		workSeedBytes[i] = (uint8_t) (workSeed[i / 8] >> (8 * (i % 8)));
+	}
+
+	// Subkey keys: key = H(work || seed || len(label) || label)
+	// The input is longer than step 3's so they can't collide
+	keys        = new uint8_t[64 * count];
+	firstChunks = new size_t[count];
+	for (size_t k = 0; k < count; k++)
+	{
+		blake2b_ctx b2ctx;
+		uint64_t    labelSize = 0;
+		uint8_t     labelSizeBytes[8];
+
+		if (subkeys[k].label != NULL)
+		{
+			labelSize = strlen(subkeys[k].label);
+		}
+		for (size_t j = 0; j < 8; j++)
+		{
+			labelSizeBytes[j] = (uint8_t) (labelSize >> (8 * j));
+		}
+		blake2b_init(&b2ctx, 64);
+		blake2b_update(&b2ctx, workSeedBytes, sizeof(workSeedBytes));
+		blake2b_update(&b2ctx, labelSizeBytes, sizeof(labelSizeBytes));
+		blake2b_update(&b2ctx, subkeys[k].label, (size_t) labelSize);
+		blake2b_finish(&b2ctx, keys + 64 * k);
+		secureClearMemory(&b2ctx, sizeof(b2ctx));
+
+		firstChunks[k] = numChunks;
+		numChunks += (subkeys[k].outputSize + 63) / 64;
+	}
+
+	// Expand
+	args.subkeys     = subkeys;
+	args.keys        = keys;
+	args.firstChunks = firstChunks;
+	args.count       = count;
+	bscrypt_ctxParallelFor(ctx, numChunks, BSCRYPT_EXPAND_CHUNKS_PER_THREAD, bscrypt_subkeysChunk, &args);
+
+	// Clear
+	secureClearMemory(keys, 64 * count);
+	secureClearMemory(workSeedBytes, sizeof(workSeedBytes));
+	secureClearMemory(workSeed, sizeof(workSeed));
+	delete [] keys;
+	delete [] firstChunks;
+
+	return 0;
+}
+
+/**
+ * Generates a key with bscrypt.
+ *
+ * @param void       *output       - Output of bscrypt.
+ * @param size_t      outputSize   - Output size.
+ * @param const void *password     - The password.
+ * @param size_t      passwordSize - Size of the password.
+ * @param const void *salt         - The salt.
+ * @param size_t      saltSize     - Size of the salt.
+ * @param uint32_t    memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t    iterations   - The number of iterations (t).
+ * @param uint32_t    parallelism  - The amount of parallelism (p).
+ * @param uint32_t    maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param bscrypt_cancelToken *cancel - Optional cancellation token.
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero.
+ */
+int bscrypt_kdf(void *output, size_t outputSize, const void *password, size_t passwordSize, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_kdf_(bscrypt_getDefaultCtx(), output, outputSize, password, passwordSize, salt, saltSize, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, NULL, 0, cancel);
+}
+
+/**
+ * Gets the size and alignment of the scratch memory needed by
+ * bscrypt_kdfScratch() to run "threads" lanes at once.
+ *
+ * @param uint32_t  memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t  parallelism - The amount of parallelism (p).
+ * @param uint32_t  threads     - The number of threads or BSCRYPT_THREADS_AUTO for p.
+ * @param size_t   *size        - Receives the size in bytes.
+ * @param size_t   *alignment   - Receives the alignment in bytes.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_kdfScratchSize(uint32_t memoryKiB, uint32_t parallelism, uint32_t threads, size_t *size, size_t *alignment)
+{
+	size_t sboxOffset;
+	size_t count;
+	size_t mask;
+	size_t slotSize;
+
+	// Limits
+	if      (memoryKiB   > MEMORY_KIB_MAX) { memoryKiB = MEMORY_KIB_MAX; }
+	else if (memoryKiB   < MEMORY_KIB_MIN) { memoryKiB = MEMORY_KIB_MIN; }
+	if      (parallelism < 1)              { parallelism = 1; }
+	if (threads == BSCRYPT_THREADS_AUTO || threads > parallelism)
+	{
+		threads = parallelism;
+	}
+	if (threads > BSCRYPT_CTX_MAX_THREADS)
+	{
+		threads = BSCRYPT_CTX_MAX_THREADS;
+	}
+
+	if (bscrypt_getSboxInfo(memoryKiB, count, sboxOffset, mask))
+	{
+		return 1;
+	}
+	slotSize = bscrypt_scratchSlotSize(count);
+	if (slotSize > SIZE_MAX / sizeof(uint64_t) / threads)
+	{
+		return 1;
+	}
+
+	*size      = slotSize * sizeof(uint64_t) * threads;
+	*alignment = 64;
+	return 0;
+}
+
+/**
+ * Generates a key with bscrypt using caller supplied scratch memory for the
+ * sboxes. Nothing is allocated (after the default context is created). The
+ * number of threads is also limited by how many sboxes fit in the scratch
+ * memory. Get the size with bscrypt_kdfScratchSize().
+ *
+ * @param void       *output       - Output of bscrypt.
+ * @param size_t      outputSize   - Output size.
+ * @param const void *password     - The password.
+ * @param size_t      passwordSize - Size of the password.
+ * @param const void *salt         - The salt.
+ * @param size_t      saltSize     - Size of the salt.
+ * @param uint32_t    memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t    iterations   - The number of iterations (t).
+ * @param uint32_t    parallelism  - The amount of parallelism (p).
+ * @param uint32_t    maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param void       *scratch      - Scratch memory. Must be aligned to 64 bytes.
+ * @param size_t      scratchSize  - Size of the scratch memory in bytes.
+ * @param bscrypt_cancelToken *cancel - Optional cancellation token.
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero (including scratch memory that is too small or misaligned).
+ */
+int bscrypt_kdfScratch(void *output, size_t outputSize, const void *password, size_t passwordSize, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, void *scratch, size_t scratchSize, bscrypt_cancelToken *cancel)
+{
+	if (scratch == NULL)
+	{
+		return 1;
+	}
+	return bscrypt_kdf_(bscrypt_getDefaultCtx(), output, outputSize, password, passwordSize, salt, saltSize, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, scratch, scratchSize, cancel);
+}
+
+/**
+ * Generates a key with bscrypt using a context's settings.
+ *
+ * @param bscrypt_ctx *ctx          - The context.
+ * @param void        *output       - Output of bscrypt.
+ * @param size_t       outputSize   - Output size.
+ * @param const void  *password     - The password.
+ * @param size_t       passwordSize - Size of the password.
+ * @param const void  *salt         - The salt.
+ * @param size_t       saltSize     - Size of the salt.
+ * @param uint32_t     memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t     iterations   - The number of iterations (t).
+ * @param uint32_t     parallelism  - The amount of parallelism (p).
+ * @param bscrypt_cancelToken *cancel - Optional cancellation token.
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero (including over the context's limits).
+ */
+int bscrypt_ctxKdf(bscrypt_ctx *ctx, void *output, size_t outputSize, const void *password, size_t passwordSize, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_kdf_(ctx, output, outputSize, password, passwordSize, salt, saltSize, memoryKiB, iterations, parallelism, ctx->maxThreads, ctx->wipeSboxes, NULL, 0, cancel);
+}
+
+/**
+ * Derives several labelled subkeys from one bscrypt run. Each subkey is
+ * independent of the others and of bscrypt_kdf()'s output. Large subkeys are
+ * expanded on the default context's workers.
+ *
+ * @param bscrypt_subkey *subkeys      - The subkeys. Each needs a label (unique), output, and outputSize.
+ * @param size_t          count        - Number of subkeys.
+ * @param const void     *password     - The password.
+ * @param size_t          passwordSize - Size of the password.
+ * @param const void     *salt         - The salt.
+ * @param size_t          saltSize     - Size of the salt.
+ * @param uint32_t        memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t        iterations   - The number of iterations (t).
+ * @param uint32_t        parallelism  - The amount of parallelism (p).
+ * @param uint32_t        maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int             wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param bscrypt_cancelToken *cancel  - Optional cancellation token.
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, if two labels are the same BSCRYPT_ERROR_DUPLICATE_LABEL, otherwise non-zero.
+ */
+int bscrypt_kdfSubkeys(bscrypt_subkey *subkeys, size_t count, const void *password, size_t passwordSize, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_kdfSubkeys_(bscrypt_getDefaultCtx(), subkeys, count, password, passwordSize, salt, saltSize, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, cancel);
+}
+
+/**
+ * Derives several labelled subkeys from one bscrypt run using a context's
+ * settings. See bscrypt_kdfSubkeys().
+ *
+ * @param bscrypt_ctx    *ctx          - The context.
+ * @param bscrypt_subkey *subkeys      - The subkeys. Each needs a label (unique), output, and outputSize.
+ * @param size_t          count        - Number of subkeys.
+ * @param const void     *password     - The password.
+ * @param size_t          passwordSize - Size of the password.
+ * @param const void     *salt         - The salt.
+ * @param size_t          saltSize     - Size of the salt.
+ * @param uint32_t        memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t        iterations   - The number of iterations (t).
+ * @param uint32_t        parallelism  - The amount of parallelism (p).
+ * @param bscrypt_cancelToken *cancel  - Optional cancellation token.
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, if two labels are the same BSCRYPT_ERROR_DUPLICATE_LABEL, otherwise non-zero.
+ */
+int bscrypt_ctxKdfSubkeys(bscrypt_ctx *ctx, bscrypt_subkey *subkeys, size_t count, const void *password, size_t passwordSize, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_kdfSubkeys_(ctx, subkeys, count, password, passwordSize, salt, saltSize, memoryKiB, iterations, parallelism, ctx->maxThreads, ctx->wipeSboxes, cancel);
+}
+
+/**
+ * Same as bscrypt_kdf() but the password is the concatenation of parts. So
+ * pepper || username || password doesn't need to be copied together. The
+ * output is the same as bscrypt_kdf() on the concatenation.
+ *
+ * @param void                       *output       - Output of bscrypt.
+ * @param size_t                      outputSize   - Output size.
+ * @param const bscrypt_passwordPart *parts        - The password's parts.
+ * @param size_t                      numParts     - Number of parts.
+ * @param const void                 *salt         - The salt.
+ * @param size_t                      saltSize     - Size of the salt.
+ * @param uint32_t                    memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t                    iterations   - The number of iterations (t).
+ * @param uint32_t                    parallelism  - The amount of parallelism (p).
+ * @param uint32_t                    maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int                         wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param bscrypt_cancelToken        *cancel       - Optional cancellation token.
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero.
+ */
+int bscrypt_kdfParts(void *output, size_t outputSize, const bscrypt_passwordPart *parts, size_t numParts, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_kdfParts_(bscrypt_getDefaultCtx(), output, outputSize, parts, numParts, salt, saltSize, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, cancel);
+}
+
+/**
+ * Same as bscrypt_kdfParts() but with a context's settings.
+ *
+ * @param bscrypt_ctx                *ctx          - The context.
+ * @param void                       *output       - Output of bscrypt.
+ * @param size_t                      outputSize   - Output size.
+ * @param const bscrypt_passwordPart *parts        - The password's parts.
+ * @param size_t                      numParts     - Number of parts.
+ * @param const void                 *salt         - The salt.
+ * @param size_t                      saltSize     - Size of the salt.
+ * @param uint32_t                    memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t                    iterations   - The number of iterations (t).
+ * @param uint32_t                    parallelism  - The amount of parallelism (p).
+ * @param bscrypt_cancelToken        *cancel       - Optional cancellation token.
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero.
+ */
+int bscrypt_ctxKdfParts(bscrypt_ctx *ctx, void *output, size_t outputSize, const bscrypt_passwordPart *parts, size_t numParts, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_kdfParts_(ctx, output, outputSize, parts, numParts, salt, saltSize, memoryKiB, iterations, parallelism, ctx->maxThreads, ctx->wipeSboxes, cancel);
+}
+
+/**
+ * Starts a streamed password. Feed the password with bscrypt_kdfInputUpdate()
+ * or bscrypt_kdfInputUpdateFile() and end with bscrypt_kdfInputFinish() or
+ * bscrypt_kdfInputAbort().
+ *
+ * @param bscrypt_kdfInput *input    - The input state.
+ * @param const void       *salt     - The salt.
+ * @param size_t            saltSize - Size of the salt.
+ */
+void bscrypt_kdfInputInit(bscrypt_kdfInput *input, const void *salt, size_t saltSize)
+{
+	bscrypt_seedInit(&input->ctx, salt, saltSize);
+}
+
+/**
+ * Adds the next part of the password.
+ *
+ * @param bscrypt_kdfInput *input - The input state.
+ * @param const void       *data  - Part of the password.
+ * @param size_t            size  - Size of data.
+ */
+void bscrypt_kdfInputUpdate(bscrypt_kdfInput *input, const void *data, size_t size)
+{
+	blake2b_update(&input->ctx, data, size);
+}
+
+/**
+ * Adds a file's contents as the next part of the password. The file is read
+ * in chunks so it never needs to fit in memory.
+ *
+ * @param bscrypt_kdfInput *input - The input state.
+ * @param const char       *path  - Path to the file.
+ * @return On success 0, otherwise non-zero. On error the input state is undefined so abort it.
+ */
+int bscrypt_kdfInputUpdateFile(bscrypt_kdfInput *input, const char *path)
+{
+	const size_t  bufferSize = 64 * 1024;
+	uint8_t      *buffer;
+	FILE         *file;
+	int           ret = 0;
+
+	file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		return 1;
+	}
+	buffer = new uint8_t[bufferSize];
+	while (1)
+	{
+		size_t size = fread(buffer, 1, bufferSize, file);
+
+		blake2b_update(&input->ctx, buffer, size);
+		if (size < bufferSize)
+		{
+			ret = ferror(file) != 0;
+			break;
+		}
+	}
+	fclose(file);
+
+	// Clear
+	secureClearMemory(buffer, bufferSize);
+	delete [] buffer;
+
+	return ret;
+}
+
+/**
+ * Finishes a streamed password and runs the rest of bscrypt_kdf(). The input
+ * state is cleared.
+ *
+ * @param bscrypt_kdfInput    *input       - The input state.
+ * @param void                *output      - Output of bscrypt.
+ * @param size_t               outputSize  - Output size.
+ * @param uint32_t             memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t             iterations  - The number of iterations (t).
+ * @param uint32_t             parallelism - The amount of parallelism (p).
+ * @param uint32_t             maxThreads  - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int                  wipeSboxes  - Whether to wipe the sboxes afterward.
+ * @param bscrypt_cancelToken *cancel      - Optional cancellation token.
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero.
+ */
+int bscrypt_kdfInputFinish(bscrypt_kdfInput *input, void *output, size_t outputSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel)
+{
+	uint64_t workSeed[16];
+
+	// Step 1: seed = H(inputs)
+	blake2b_finish(&input->ctx, workSeed + 8);
+	secureClearMemory(&input->ctx, sizeof(input->ctx));
+
+	return bscrypt_kdfSeeded_(bscrypt_getDefaultCtx(), output, outputSize, workSeed, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, NULL, 0, cancel);
+}
+
+/**
+ * Same as bscrypt_kdfInputFinish() but with a context's settings.
+ *
+ * @param bscrypt_ctx         *ctx         - The context.
+ * @param bscrypt_kdfInput    *input       - The input state.
+ * @param void                *output      - Output of bscrypt.
+ * @param size_t               outputSize  - Output size.
+ * @param uint32_t             memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t             iterations  - The number of iterations (t).
+ * @param uint32_t             parallelism - The amount of parallelism (p).
+ * @param bscrypt_cancelToken *cancel      - Optional cancellation token.
+ * @return On success 0, if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero.
+ */
+int bscrypt_ctxKdfInputFinish(bscrypt_ctx *ctx, bscrypt_kdfInput *input, void *output, size_t outputSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, bscrypt_cancelToken *cancel)
+{
+	uint64_t workSeed[16];
+
+	// Step 1: seed = H(inputs)
+	blake2b_finish(&input->ctx, workSeed + 8);
+	secureClearMemory(&input->ctx, sizeof(input->ctx));
+
+	return bscrypt_kdfSeeded_(ctx, output, outputSize, workSeed, memoryKiB, iterations, parallelism, ctx->maxThreads, ctx->wipeSboxes, NULL, 0, cancel);
+}
+
+/**
+ * Throws away a streamed password.
+ *
+ * @param bscrypt_kdfInput *input - The input state.
+ */
+void bscrypt_kdfInputAbort(bscrypt_kdfInput *input)
+{
+	secureClearMemory(&input->ctx, sizeof(input->ctx));
+}
+
+/**
+ * Initializes a cancellation token.
+ *
+ * @param bscrypt_cancelToken *cancel    - The cancellation token.
+ * @param uint32_t             timeoutMs - Timeout in milliseconds from now or 0 for none.
+ */
+void bscrypt_cancelTokenInit(bscrypt_cancelToken *cancel, uint32_t timeoutMs)
+{
+	cancel->canceled.store(0, std::memory_order_relaxed);
+	cancel->deadlineUs = 0;
+	if (timeoutMs != 0)
+	{
+		cancel->deadlineUs = getTimeUs() + (uint64_t) timeoutMs * 1000;
+	}
+}
+
+/**
+ * Cancels everything using this cancellation token. Safe to call from any thread.
+ *
+ * @param bscrypt_cancelToken *cancel - The cancellation token.
+ */
+void bscrypt_cancelTokenCancel(bscrypt_cancelToken *cancel)
+{
+	cancel->canceled.store(1, std::memory_order_release);
+}
+
+/**
+ * Checks if a cancellation token was canceled or its deadline passed. Safe to
+ * call from any thread.
+ *
+ * @param bscrypt_cancelToken *cancel - The cancellation token.
+ * @return If canceled, non-zero. Otherwise, 0.
+ */
+int bscrypt_cancelTokenIsCanceled(bscrypt_cancelToken *cancel)
+{
+	return bscrypt_cancelTokenCheck(cancel);
+}
+
+/**
+ * Formats a parsed hash back into a hash string. This is the inverse of
+ * bscrypt_parseHash().
+ *
+ * @param char                  hash[BSCRYPT_HASH_MAX_SIZE] - Receives the hash.
+ * @param const bscrypt_params *params                      - The parsed hash.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_formatHash(char hash[BSCRYPT_HASH_MAX_SIZE], const bscrypt_params *params)
+{
+	if (params->digestSize == 0 || params->digestSize > BSCRYPT_ENCRYPTED_HASH_MAX_SIZE)
+	{
+		hash[0] = 0;
+		return 1;
+	}
+
 	// Encode
 	// $bscrypt$m=#,t=#,p=#$salt..................hash............................
 	size_t offset = 11;
 	memcpy(hash, "$bscrypt$m=", 11);
-	offset += writeUint32(hash + offset, memoryKiB);
+	offset += writeUint32(hash + offset, params->memoryKiB);
 	memcpy(hash + offset, ",t=", 3);
 	offset += 3;
-	offset += writeUint32(hash + offset, iterations);
+	offset += writeUint32(hash + offset, params->iterations);
 	memcpy(hash + offset, ",p=", 3);
 	offset += 3;
-	offset += writeUint32(hash + offset, parallelism);
+	offset += writeUint32(hash + offset, params->parallelism);
 	hash[offset++] = '$';
-	offset += base64Encode(hash + offset, salt, 16 * sizeof(uint8_t), BASE64_ENCODE_FLAG_NO_PAD);
-	offset += base64Encode(hash + offset, hashBytes, hashBytesSize, BASE64_ENCODE_FLAG_NO_PAD);
+	offset += base64Encode(hash + offset, params->salt, 16 * sizeof(uint8_t), BASE64_ENCODE_FLAG_NO_PAD);
+	offset += base64Encode(hash + offset, params->digest, params->digestSize, BASE64_ENCODE_FLAG_NO_PAD);
 	hash[offset] = 0;
 
-	// Clear
-	secureClearMemory(hashBytes, sizeof(hashBytes));
+	return 0;
+}
+
+static int bscrypt_encodeHash(char hash[BSCRYPT_HASH_MAX_SIZE], uint8_t hashBytes[BSCRYPT_ENCRYPTED_HASH_MAX_SIZE], const uint8_t salt[16], uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams)
+{
+	bscrypt_params params;
+	size_t         hashBytesSize = 24;
+	int            ret;
+
+	// Limits
+	if (memoryKiB > MEMORY_KIB_MAX)
+	{
+		memoryKiB = MEMORY_KIB_MAX;
+	}
+	else if (memoryKiB < MEMORY_KIB_MIN)
+	{
+		memoryKiB = MEMORY_KIB_MIN;
+	}
+	if (iterations < ITERATIONS_MIN)
+	{
+		iterations = ITERATIONS_MIN;
+	}
+	if (parallelism < 1)
+	{
+		parallelism = 1;
+	}
+
+	// Encrypt
+	if (encryptFunc != NULL)
+	{
+		hashBytesSize = encryptFunc(encryptHashParams, hashBytes, hashBytesSize, BSCRYPT_ENCRYPTED_HASH_MAX_SIZE);
+		if (hashBytesSize > BSCRYPT_ENCRYPTED_HASH_MAX_SIZE)
+		{
+			return 1;
+		}
+	}
+
+	// Encode
+	params.memoryKiB   = memoryKiB;
+	params.iterations  = iterations;
+	params.parallelism = parallelism;
+	params.digestSize  = (uint32_t) hashBytesSize;
+	memcpy(params.salt, salt, 16 * sizeof(uint8_t));
+	memcpy(params.digest, hashBytes, hashBytesSize);
+	ret = bscrypt_formatHash(hash, &params);
+
+	// Clear
+	secureClearMemory(&params, sizeof(params));
+
+	return ret;
+}
+
+static int bscrypt_hash_(bscrypt_ctx *ctx, char hash[BSCRYPT_HASH_MAX_SIZE], const void *password, size_t passwordSize, const uint8_t salt[16], uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	uint8_t hashBytes[BSCRYPT_ENCRYPTED_HASH_MAX_SIZE];
+	int     ret;
+
+	// Generate hash
+	ret = bscrypt_kdf_(ctx, hashBytes, 24, password, passwordSize, salt, 16 * sizeof(uint8_t), memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, NULL, 0, cancel);
+	if (ret)
+	{
+		hash[0] = 0;
+		return ret;
+	}
+
+	// Encrypt and encode
+	ret = bscrypt_encodeHash(hash, hashBytes, salt, memoryKiB, iterations, parallelism, encryptFunc, encryptHashParams);
+
+	// Clear
+	secureClearMemory(hashBytes, sizeof(hashBytes));
+
+	return ret;
+}
+
+static int bscrypt_hashRandomSalt_(bscrypt_ctx *ctx, char hash[BSCRYPT_HASH_MAX_SIZE], const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	uint8_t salt[16];
+
+	// Generate salt
+	if (getRandomBuffered(salt, sizeof(salt)))
+	{
+		hash[0] = 0;
+		return 1;
+	}
+
+	// Hash
+	int ret = bscrypt_hash_(ctx, hash, password, passwordSize, salt, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+
+	// Clear
+	secureClearMemory(salt, sizeof(salt));
+
+	return ret;
+}
+
+/**
+ * Parses a bscrypt hash once so it can be kept next to the user record and
+ * verified with bscrypt_verifyParams() without re-encoding. Only hashes that
+ * bscrypt_hash() could have made are accepted: settings in range and canonical
+ * numbers and base64.
+ *
+ * @param bscrypt_params *params - Receives the parsed hash.
+ * @param const char     *hash   - The hash.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_parseHash(bscrypt_params *params, const char *hash)
+{
+	char   encoded[BSCRYPT_HASH_MAX_SIZE];
+	size_t offset;
+	size_t digestChars = 0;
+	size_t digestSize;
+
+	// Settings
+	offset = bscrypt_decodeHash(hash, params->memoryKiB, params->iterations, params->parallelism);
+	if (offset == SIZE_MAX ||
+		params->memoryKiB   < MEMORY_KIB_MIN ||
+		params->memoryKiB   > MEMORY_KIB_MAX ||
+		params->iterations  < ITERATIONS_MIN ||
+		params->parallelism < 1)
+	{
+		return 1;
+	}
+
+	// Salt
+	if (base64Decode(params->salt, hash + offset, 22, BASE64_DECODE_FLAG_IGNORE_NO_PAD) ||
+		base64Encode(encoded, params->salt, 16 * sizeof(uint8_t), BASE64_ENCODE_FLAG_NO_PAD) != 22 ||
+		memcmp(encoded, hash + offset, 22) != 0)
+	{
+		return 1;
+	}
+	offset += 22;
+
+	// Digest
+	while (hash[offset + digestChars] != 0)
+	{
+		digestChars++;
+		if (digestChars > BSCRYPT_HASH_MAX_SIZE - offset - 1)
+		{
+			return 1;
+		}
+	}
+	digestSize = base64DecodedSize(hash + offset, digestChars, BASE64_DECODE_FLAG_IGNORE_NO_PAD);
+	if (digestSize == 0 || digestSize > BSCRYPT_ENCRYPTED_HASH_MAX_SIZE ||
+		base64Decode(params->digest, hash + offset, digestChars, BASE64_DECODE_FLAG_IGNORE_NO_PAD) ||
+		base64Encode(encoded, params->digest, digestSize, BASE64_ENCODE_FLAG_NO_PAD) != digestChars ||
+		memcmp(encoded, hash + offset, digestChars) != 0)
+	{
+		return 1;
+	}
+	params->digestSize = (uint32_t) digestSize;
+
+	return 0;
+}
+
+/**
+ * @param int *failed - Optional. Set to non-zero if the hash couldn't be computed (over a limit, canceled, ...) rather than the password being wrong.
+ */
+static int bscrypt_verifyParams_(bscrypt_ctx *ctx, const bscrypt_params *params, const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel, int *failed = NULL)
+{
+	uint8_t hashBytes[BSCRYPT_ENCRYPTED_HASH_MAX_SIZE];
+	size_t  hashBytesSize = 24;
+	int     ret;
+
+	if (params->digestSize > BSCRYPT_ENCRYPTED_HASH_MAX_SIZE)
+	{
+		if (failed != NULL)
+		{
+			*failed = 1;
+		}
+		return 0;
+	}
+
+	// Hash
+	if (bscrypt_kdf_(ctx, hashBytes, 24, password, passwordSize, params->salt, 16 * sizeof(uint8_t), params->memoryKiB, params->iterations, params->parallelism, maxThreads, wipeSboxes, NULL, 0, cancel))
+	{
+		secureClearMemory(hashBytes, sizeof(hashBytes));
+		if (failed != NULL)
+		{
+			*failed = 1;
+		}
+		return 0;
+	}
+
+	// Encrypt
+	if (encryptFunc != NULL)
+	{
+		hashBytesSize = encryptFunc(encryptHashParams, hashBytes, hashBytesSize, BSCRYPT_ENCRYPTED_HASH_MAX_SIZE);
+	}
+
+	// Compare
+	ret = constTimeCmpEq(hashBytes, params->digest, params->digestSize) & (hashBytesSize == params->digestSize);
+
+	// Clear
+	secureClearMemory(hashBytes, sizeof(hashBytes));
+
+	return ret;
+}
+
+static int bscrypt_verify_(bscrypt_ctx *ctx, const char *hash, const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	bscrypt_params params;
+
+	// Decode
+	if (bscrypt_parseHash(&params, hash))
+	{
+		return 0;
+	}
+
+	// Hash and compare
+	int ret = bscrypt_verifyParams_(ctx, &params, password, passwordSize, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+
+	// Clear
+	secureClearMemory(&params, sizeof(params));
+
+	return ret;
+}
+
+/**
+ * Generates a bscrypt hash.
+ *
+ * @param char        hash[BSCRYPT_HASH_MAX_SIZE] - The hash.
+ * @param const void *password     - The password.
+ * @param size_t      passwordSize - Size of the password.
+ * @param uint32_t    memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t    iterations   - The number of iterations (t).
+ * @param uint32_t    parallelism  - The amount of parallelism (p).
+ * @param uint32_t    maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On success, 0. If canceled, BSCRYPT_ERROR_CANCELED. Otherwise, non-zero.
+ */
+int bscrypt_hash(char hash[BSCRYPT_HASH_MAX_SIZE], const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_hashRandomSalt_(bscrypt_getDefaultCtx(), hash, password, passwordSize, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+/**
+ * Generates a bscrypt hash using a context's settings.
+ *
+ * @param bscrypt_ctx *ctx          - The context.
+ * @param char         hash[BSCRYPT_HASH_MAX_SIZE] - The hash.
+ * @param const void  *password     - The password.
+ * @param size_t       passwordSize - Size of the password.
+ * @param uint32_t     memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t     iterations   - The number of iterations (t).
+ * @param uint32_t     parallelism  - The amount of parallelism (p).
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On success, 0. If canceled, BSCRYPT_ERROR_CANCELED. Otherwise, non-zero.
+ */
+int bscrypt_ctxHash(bscrypt_ctx *ctx, char hash[BSCRYPT_HASH_MAX_SIZE], const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_hashRandomSalt_(ctx, hash, password, passwordSize, memoryKiB, iterations, parallelism, ctx->maxThreads, ctx->wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+// Lives on the stack of the thread that called bscrypt_hashBatch()
+struct bscrypt_hashBatchState
+{
+	MUTEX                           mutex;
+	bscrypt_ctx                    *ctx;
+	char                          (*hashes)[BSCRYPT_HASH_MAX_SIZE];
+	const void *const              *passwords;
+	const size_t                   *passwordSizes;
+	const uint8_t                  *salts;
+	int                            *results;
+	size_t                          count;
+	size_t                          next;
+	size_t                          done;
+	size_t                          failed;
+	uint32_t                        memoryKiB;
+	uint32_t                        iterations;
+	uint32_t                        parallelism;
+	int                             wipeSboxes;
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc;
+	void                           *encryptHashParams;
+	BSCRYPT_PROGRESS_FUNC           progress;
+	void                           *progressUser;
+	bscrypt_cancelToken            *cancel;
+};
+
+static void bscrypt_hashBatchRun(void *arg)
+{
+	bscrypt_hashBatchState *batch = (bscrypt_hashBatchState*) arg;
+	size_t                  i;
+
+	while (1)
+	{
+		// Next entry
+		MUTEX_LOCK(batch->mutex);
+		i = batch->next;
+		batch->next++;
+		MUTEX_UNLOCK(batch->mutex);
+		if (i >= batch->count)
+		{
+			break;
+		}
+
+		// Hash with 1 thread since the batch is the parallelism
+		int ret = bscrypt_hash_(batch->ctx, batch->hashes[i], batch->passwords[i], batch->passwordSizes[i], batch->salts + 16 * i, batch->memoryKiB, batch->iterations, batch->parallelism, 1, batch->wipeSboxes, batch->encryptFunc, batch->encryptHashParams, batch->cancel);
+		if (batch->results != NULL)
+		{
+			batch->results[i] = ret;
+		}
+
+		// Progress is reported in order under the lock
+		MUTEX_LOCK(batch->mutex);
+		batch->done++;
+		if (ret)
+		{
+			batch->failed++;
+		}
+		if (batch->progress != NULL)
+		{
+			batch->progress(batch->progressUser, batch->done, batch->count);
+		}
+		MUTEX_UNLOCK(batch->mutex);
+	}
+}
+
+static int bscrypt_hashBatch_(bscrypt_ctx *ctx, char (*hashes)[BSCRYPT_HASH_MAX_SIZE], const void *const *passwords, const size_t *passwordSizes, size_t count, int *results, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, BSCRYPT_PROGRESS_FUNC progress, void *progressUser, bscrypt_cancelToken *cancel)
+{
+	bscrypt_hashBatchState batch;
+	uint8_t               *salts;
+	uint32_t               numHelpers = 0;
+
+	if (count == 0)
+	{
+		return 0;
+	}
+	if (count > SIZE_MAX / 16)
+	{
+		return 1;
+	}
+
+	// Generate all salts at once
+	salts = new uint8_t[16 * count];
+	if (getRandom(salts, 16 * count))
+	{
+		delete [] salts;
+		for (size_t i = 0; i < count; i++)
+		{
+			hashes[i][0] = 0;
+			if (results != NULL)
+			{
+				results[i] = 1;
+			}
+		}
+		return 1;
+	}
+
+	// Threads
+	if (ctx->poolStarted)
+	{
+		numHelpers = ctx->pool.numThreads;
+	}
+	if (maxThreads != BSCRYPT_THREADS_AUTO && numHelpers > maxThreads - 1)
+	{
+		numHelpers = maxThreads - 1;
+	}
+	if (numHelpers > count - 1)
+	{
+		numHelpers = (uint32_t) (count - 1);
+	}
+
+	// Run
+	MUTEX_CREATE(batch.mutex);
+	batch.ctx               = ctx;
+	batch.hashes            = hashes;
+	batch.passwords         = passwords;
+	batch.passwordSizes     = passwordSizes;
+	batch.salts             = salts;
+	batch.results           = results;
+	batch.count             = count;
+	batch.next              = 0;
+	batch.done              = 0;
+	batch.failed            = 0;
+	batch.memoryKiB         = memoryKiB;
+	batch.iterations        = iterations;
+	batch.parallelism       = parallelism;
+	batch.wipeSboxes        = wipeSboxes;
+	batch.encryptFunc       = encryptFunc;
+	batch.encryptHashParams = encryptHashParams;
+	batch.progress          = progress;
+	batch.progressUser      = progressUser;
+	batch.cancel            = cancel;
+	bscrypt_ctxParallel(ctx, numHelpers, bscrypt_hashBatchRun, &batch);
+	MUTEX_DELETE(batch.mutex);
+
+	// Clear
+	secureClearMemory(salts, 16 * count);
+	delete [] salts;
+
+	return batch.failed != 0;
+}
+
+/**
+ * Generates many bscrypt hashes with the same settings. All salts come from
+ * one CSPRNG call and each hash runs on 1 thread with up to maxThreads hashes
+ * at once.
+ *
+ * @param char             (*hashes)[BSCRYPT_HASH_MAX_SIZE] - Receives the hashes. Failed entries are empty.
+ * @param const void *const *passwords     - The passwords.
+ * @param const size_t      *passwordSizes - Sizes of the passwords.
+ * @param size_t             count         - Number of entries.
+ * @param int               *results       - Optional. Receives for each entry what bscrypt_hash() would return.
+ * @param uint32_t           memoryKiB     - The size of the sboxes in KiB (m).
+ * @param uint32_t           iterations    - The number of iterations (t).
+ * @param uint32_t           parallelism   - The amount of parallelism (p).
+ * @param uint32_t           maxThreads    - The maximum number of threads or BSCRYPT_THREADS_AUTO for all workers.
+ * @param int                wipeSboxes    - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param BSCRYPT_PROGRESS_FUNC            progress          - Optional. Called after each entry.
+ * @param void                            *progressUser      - Passed to progress.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return If all succeed, 0. Otherwise, non-zero.
+ */
+int bscrypt_hashBatch(char (*hashes)[BSCRYPT_HASH_MAX_SIZE], const void *const *passwords, const size_t *passwordSizes, size_t count, int *results, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, BSCRYPT_PROGRESS_FUNC progress, void *progressUser, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_hashBatch_(bscrypt_getDefaultCtx(), hashes, passwords, passwordSizes, count, results, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, progress, progressUser, cancel);
+}
+
+/**
+ * Generates many bscrypt hashes with the same settings using a context's
+ * settings. See bscrypt_hashBatch().
+ *
+ * @param bscrypt_ctx       *ctx           - The context.
+ * @param char             (*hashes)[BSCRYPT_HASH_MAX_SIZE] - Receives the hashes. Failed entries are empty.
+ * @param const void *const *passwords     - The passwords.
+ * @param const size_t      *passwordSizes - Sizes of the passwords.
+ * @param size_t             count         - Number of entries.
+ * @param int               *results       - Optional. Receives for each entry what bscrypt_hash() would return.
+ * @param uint32_t           memoryKiB     - The size of the sboxes in KiB (m).
+ * @param uint32_t           iterations    - The number of iterations (t).
+ * @param uint32_t           parallelism   - The amount of parallelism (p).
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param BSCRYPT_PROGRESS_FUNC            progress          - Optional. Called after each entry.
+ * @param void                            *progressUser      - Passed to progress.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return If all succeed, 0. Otherwise, non-zero.
+ */
+int bscrypt_ctxHashBatch(bscrypt_ctx *ctx, char (*hashes)[BSCRYPT_HASH_MAX_SIZE], const void *const *passwords, const size_t *passwordSizes, size_t count, int *results, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, BSCRYPT_PROGRESS_FUNC progress, void *progressUser, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_hashBatch_(ctx, hashes, passwords, passwordSizes, count, results, memoryKiB, iterations, parallelism, ctx->maxThreads, ctx->wipeSboxes, encryptFunc, encryptHashParams, progress, progressUser, cancel);
+}
+
+/**
+ * Verifies a password against a bscrypt hash.
+ *
+ * @param const char *hash         - The hash.
+ * @param const void *password     - The password.
+ * @param size_t      passwordSize - Size of the password.
+ * @param uint32_t    maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On correct password, non-zero. Otherwise, 0 (check bscrypt_cancelTokenIsCanceled() for a timeout).
+ */
+int bscrypt_verify(const char *hash, const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_verify_(bscrypt_getDefaultCtx(), hash, password, passwordSize, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+/**
+ * Verifies a password against a bscrypt hash using a context's settings.
+ * Hashes over the context's limits fail.
+ *
+ * @param bscrypt_ctx *ctx          - The context.
+ * @param const char  *hash         - The hash.
+ * @param const void  *password     - The password.
+ * @param size_t       passwordSize - Size of the password.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On correct password, non-zero. Otherwise, 0 (check bscrypt_cancelTokenIsCanceled() for a timeout).
+ */
+int bscrypt_ctxVerify(bscrypt_ctx *ctx, const char *hash, const void *password, size_t passwordSize, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_verify_(ctx, hash, password, passwordSize, ctx->maxThreads, ctx->wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+/**
+ * Verifies a password against a hash parsed with bscrypt_parseHash(). The raw
+ * (or encrypted) digest is compared so nothing is re-encoded.
+ *
+ * @param const bscrypt_params *params       - The parsed hash.
+ * @param const void           *password     - The password.
+ * @param size_t                passwordSize - Size of the password.
+ * @param uint32_t              maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int                   wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On correct password, non-zero. Otherwise, 0 (check bscrypt_cancelTokenIsCanceled() for a timeout).
+ */
+int bscrypt_verifyParams(const bscrypt_params *params, const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_verifyParams_(bscrypt_getDefaultCtx(), params, password, passwordSize, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+/**
+ * Verifies a password against a hash parsed with bscrypt_parseHash() using a
+ * context's settings.
+ *
+ * @param bscrypt_ctx          *ctx          - The context.
+ * @param const bscrypt_params *params       - The parsed hash.
+ * @param const void           *password     - The password.
+ * @param size_t                passwordSize - Size of the password.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On correct password, non-zero. Otherwise, 0 (check bscrypt_cancelTokenIsCanceled() for a timeout).
+ */
+int bscrypt_ctxVerifyParams(bscrypt_ctx *ctx, const bscrypt_params *params, const void *password, size_t passwordSize, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_verifyParams_(ctx, params, password, passwordSize, ctx->maxThreads, ctx->wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+struct bscrypt_batchEntry
+{
+	bscrypt_params params;
+	size_t         index;
+	int            ok;
+};
+
+// Lives on the stack of the thread that called bscrypt_verifyBatch()
+struct bscrypt_verifyBatchState
+{
+	MUTEX                           mutex;
+	bscrypt_ctx                    *ctx;
+	bscrypt_batchEntry             *entries;
+	const void *const              *passwords;
+	const size_t                   *passwordSizes;
+	int                            *results;
+	size_t                          count;
+	size_t                          next;
+	size_t                          failed;
+	int                             wipeSboxes;
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc;
+	void                           *encryptHashParams;
+	bscrypt_cancelToken            *cancel;
+};
+
+static int bscrypt_batchEntryCmp(const void *a, const void *b)
+{
+	const bscrypt_params *pa = &((const bscrypt_batchEntry*) a)->params;
+	const bscrypt_params *pb = &((const bscrypt_batchEntry*) b)->params;
+
+	if (pa->memoryKiB   != pb->memoryKiB)   { return pa->memoryKiB   < pb->memoryKiB   ? -1 : 1; }
+	if (pa->iterations  != pb->iterations)  { return pa->iterations  < pb->iterations  ? -1 : 1; }
+	if (pa->parallelism != pb->parallelism) { return pa->parallelism < pb->parallelism ? -1 : 1; }
+	return 0;
+}
+
+static void bscrypt_verifyBatchRun(void *arg)
+{
+	bscrypt_verifyBatchState *batch = (bscrypt_verifyBatchState*) arg;
+	size_t                    i;
+
+	while (1)
+	{
+		// Next entry
+		MUTEX_LOCK(batch->mutex);
+		i = batch->next;
+		batch->next++;
+		MUTEX_UNLOCK(batch->mutex);
+		if (i >= batch->count)
+		{
+			break;
+		}
+
+		// Verify with 1 thread since the batch is the parallelism
+		bscrypt_batchEntry *entry  = batch->entries + i;
+		int                 ret    = 0;
+		int                 failed = !entry->ok;
+
+		if (entry->ok)
+		{
+			ret = bscrypt_verifyParams_(batch->ctx, &entry->params, batch->passwords[entry->index], batch->passwordSizes[entry->index], 1, batch->wipeSboxes, batch->encryptFunc, batch->encryptHashParams, batch->cancel, &failed);
+		}
+		batch->results[entry->index] = ret;
+		if (failed)
+		{
+			MUTEX_LOCK(batch->mutex);
+			batch->failed++;
+			MUTEX_UNLOCK(batch->mutex);
+		}
+	}
+}
+
+static int bscrypt_verifyBatch_(bscrypt_ctx *ctx, const char *const *hashes, const void *const *passwords, const size_t *passwordSizes, size_t count, int *results, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	bscrypt_verifyBatchState batch;
+	uint32_t                 numHelpers = 0;
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	// Parse and group by settings so runs of the same sbox size reuse sboxes
+	batch.entries = new bscrypt_batchEntry[count];
+	for (size_t i = 0; i < count; i++)
+	{
+		batch.entries[i].index = i;
+		batch.entries[i].ok    = bscrypt_parseHash(&batch.entries[i].params, hashes[i]) == 0;
+		if (!batch.entries[i].ok)
+		{
+			memset(&batch.entries[i].params, 0, sizeof(batch.entries[i].params));
+		}
+	}
+	qsort(batch.entries, count, sizeof(bscrypt_batchEntry), bscrypt_batchEntryCmp);
+
+	// Threads
+	if (ctx->poolStarted)
+	{
+		numHelpers = ctx->pool.numThreads;
+	}
+	if (maxThreads != BSCRYPT_THREADS_AUTO && numHelpers > maxThreads - 1)
+	{
+		numHelpers = maxThreads - 1;
+	}
+	if (numHelpers > count - 1)
+	{
+		numHelpers = (uint32_t) (count - 1);
+	}
+
+	// Run
+	MUTEX_CREATE(batch.mutex);
+	batch.ctx               = ctx;
+	batch.passwords         = passwords;
+	batch.passwordSizes     = passwordSizes;
+	batch.results           = results;
+	batch.count             = count;
+	batch.next              = 0;
+	batch.failed            = 0;
+	batch.wipeSboxes        = wipeSboxes;
+	batch.encryptFunc       = encryptFunc;
+	batch.encryptHashParams = encryptHashParams;
+	batch.cancel            = cancel;
+	bscrypt_ctxParallel(ctx, numHelpers, bscrypt_verifyBatchRun, &batch);
+	MUTEX_DELETE(batch.mutex);
+
+	// Clear
+	secureClearMemory(batch.entries, count * sizeof(bscrypt_batchEntry));
+	delete [] batch.entries;
+
+	return batch.failed != 0;
+}
+
+/**
+ * Verifies many passwords against their hashes. Entries are grouped by
+ * settings and each entry runs on 1 thread with up to maxThreads entries at
+ * once. This gets more verifies per second than calling bscrypt_verify() with
+ * many threads for each. Each result is from the same constant time compare as
+ * bscrypt_verify().
+ *
+ * @param const char *const *hashes        - The hashes.
+ * @param const void *const *passwords     - The passwords.
+ * @param const size_t      *passwordSizes - Sizes of the passwords.
+ * @param size_t             count         - Number of entries.
+ * @param int               *results       - Receives for each entry: on correct password non-zero, otherwise 0.
+ * @param uint32_t           maxThreads    - The maximum number of threads or BSCRYPT_THREADS_AUTO for all workers.
+ * @param int                wipeSboxes    - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return If every entry was checked 0. Otherwise, non-zero if any hash couldn't be parsed or computed (over a limit, canceled, ...). Those entries' results are 0. A wrong password isn't an error.
+ */
+int bscrypt_verifyBatch(const char *const *hashes, const void *const *passwords, const size_t *passwordSizes, size_t count, int *results, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_verifyBatch_(bscrypt_getDefaultCtx(), hashes, passwords, passwordSizes, count, results, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+/**
+ * Verifies many passwords against their hashes using a context's settings.
+ * See bscrypt_verifyBatch().
+ *
+ * @param bscrypt_ctx       *ctx           - The context.
+ * @param const char *const *hashes        - The hashes.
+ * @param const void *const *passwords     - The passwords.
+ * @param const size_t      *passwordSizes - Sizes of the passwords.
+ * @param size_t             count         - Number of entries.
+ * @param int               *results       - Receives for each entry: on correct password non-zero, otherwise 0.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return If every entry was checked 0. Otherwise, non-zero (see bscrypt_verifyBatch()).
+ */
+int bscrypt_ctxVerifyBatch(bscrypt_ctx *ctx, const char *const *hashes, const void *const *passwords, const size_t *passwordSizes, size_t count, int *results, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_verifyBatch_(ctx, hashes, passwords, passwordSizes, count, results, ctx->maxThreads, ctx->wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+/**
+ * Checks if the hash needs to be upgraded.
+ *
+ * @param const char *hash        - The hash.
+ * @param uint32_t    memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t    iterations  - The number of iterations (t).
+ * @param uint32_t    parallelism - The amount of parallelism (p).
+ * @return If upgrade needed, non-zero. Otherwise, 0.
+ */
+int bscrypt_needsRehash(const char *hash, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+{
+	uint32_t hashMemoryKiB;
+	uint32_t hashIterations;
+	uint32_t hashParallelism;
+
+	if (bscrypt_decodeHash(hash, hashMemoryKiB, hashIterations, hashParallelism) == SIZE_MAX ||
+		hashMemoryKiB   != memoryKiB  ||
+		hashIterations  != iterations ||
+		hashParallelism != parallelism)
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Gets the fewest iterations for the security floor. That's at least
+ * BSCRYPT_CALIBRATE_MIN_WORK bytes of sbox work, which keeps GPU attackers
+ * under 10 kH/s/GPU (see README.md).
+ *
+ * @param uint32_t memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t parallelism - The amount of parallelism (p).
+ * @return The minimum number of iterations (t).
+ */
+uint32_t bscrypt_minIterations(uint32_t memoryKiB, uint32_t parallelism)
+{
+	uint64_t work = (uint64_t) memoryKiB * 1024 * (parallelism == 0 ? 1 : parallelism);
+	uint64_t iterations;
+
+	if (work == 0)
+	{
+		return UINT32_MAX;
+	}
+	iterations = (BSCRYPT_CALIBRATE_MIN_WORK + work - 1) / work;
+	if (iterations < ITERATIONS_MIN)
+	{
+		iterations = ITERATIONS_MIN;
+	}
+	return (uint32_t) iterations;
+}
+
+static int bscrypt_doubleCmp(const void *a, const void *b)
+{
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Times bscrypt_kdf_().
+ *
+ * @return The median of a few runs in ms or a negative number on error.
+ */
+static double bscrypt_calibrateMeasure(bscrypt_ctx *ctx, uint32_t maxThreads, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+{
+	const uint8_t salt[16] = {0};
+	uint8_t       output[32];
+	double        ms[BSCRYPT_CALIBRATE_RUNS];
+
+	for (uint32_t i = 0; i < BSCRYPT_CALIBRATE_RUNS; i++)
+	{
+		uint64_t start = getTimeUs();
+
+		if (bscrypt_kdf_(ctx, output, sizeof(output), "password", sizeof("password") - 1, salt, sizeof(salt), memoryKiB, iterations, parallelism, maxThreads, 0, NULL, 0, NULL))
+		{
+			return -1.0;
+		}
+		ms[i] = (getTimeUs() - start) / 1000.0;
+	}
+	qsort(ms, BSCRYPT_CALIBRATE_RUNS, sizeof(double), bscrypt_doubleCmp);
+	return ms[BSCRYPT_CALIBRATE_RUNS / 2];
+}
+
+/**
+ * Makes the tuning profile key for these settings on this machine. The
+ * instruction sets pick the kernel and the threads are the topology.
+ */
+static void bscrypt_calibrateKey(bscrypt_ctx *ctx, uint32_t maxThreads, char *key, size_t keySize, uint32_t targetMs, uint32_t memoryKiB, uint32_t parallelism)
+{
+	char model[128];
+
+	getCpuModel(model, sizeof(model));
+	snprintf(key, keySize, "%s\t%x\t%u\t%u\t%u\t%u\t%u",
+		model, getInstructionSets(), ctx->poolStarted ? ctx->pool.numThreads : 0, maxThreads,
+		memoryKiB, parallelism, targetMs);
+}
+
+/**
+ * Looks up iterations in the tuning profile.
+ *
+ * @return On success 0, otherwise non-zero.
+ */
+static int bscrypt_calibrateLoad(const char *profilePath, const char *key, uint32_t *iterations)
+{
+	FILE  *file = fopen(profilePath, "r");
+	char   line[512];
+	size_t keySize = strlen(key);
+	int    ret     = 1;
+
+	if (file == NULL)
+	{
+		return 1;
+	}
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char          *end;
+		unsigned long  value;
+
+		if (strncmp(line, key, keySize) != 0 || line[keySize] != '\t')
+		{
+			continue;
+		}
+		value = strtoul(line + keySize + 1, &end, 10);
+		if (end != line + keySize + 1 && (*end == '\n' || *end == '\r' || *end == 0) && value > 0 && value <= UINT32_MAX)
+		{
+			// Later lines win
+			*iterations = (uint32_t) value;
+			ret = 0;
+		}
+	}
+	fclose(file);
+	return ret;
+}
+
+static int bscrypt_calibrate_(bscrypt_ctx *ctx, uint32_t *iterations, uint32_t targetMs, uint32_t memoryKiB, uint32_t parallelism, uint32_t maxThreads, const char *profilePath)
+{
+	char     key[256];
+	uint32_t minIterations = bscrypt_minIterations(memoryKiB, parallelism);
+	uint32_t lowT          = ITERATIONS_MIN;
+	uint32_t highT;
+	uint64_t t             = 0;
+	double   lowMs;
+	double   highMs;
+
+	if (targetMs == 0 || minIterations == UINT32_MAX)
+	{
+		return 1;
+	}
+	if (profilePath != NULL)
+	{
+		bscrypt_calibrateKey(ctx, maxThreads, key, sizeof(key), targetMs, memoryKiB, parallelism);
+		if (bscrypt_calibrateLoad(profilePath, key, iterations) == 0)
+		{
+			if (*iterations < minIterations)
+			{
+				*iterations = minIterations;
+			}
+			return 0;
+		}
+	}
+
+	// Warm up (sbox allocation, threads, clocks)
+	if (bscrypt_calibrateMeasure(ctx, maxThreads, memoryKiB, lowT, parallelism) < 0)
+	{
+		return 1;
+	}
+	lowMs = bscrypt_calibrateMeasure(ctx, maxThreads, memoryKiB, lowT, parallelism);
+
+	// Time is about a + b * t so get a point near the target and fit a line
+	highT  = lowT;
+	highMs = lowMs;
+	while (highMs < targetMs / 4.0 && highT < UINT32_MAX / 2)
+	{
+		highT *= 2;
+		highMs = bscrypt_calibrateMeasure(ctx, maxThreads, memoryKiB, highT, parallelism);
+		if (highMs < 0)
+		{
+			return 1;
+		}
+	}
+	t = highT;
+	for (uint32_t i = 0; i < BSCRYPT_CALIBRATE_REFINE; i++)
+	{
+		double slope;
+		double ms;
+
+		if (highT == lowT || highMs <= lowMs)
+		{
+			t = highT;
+			break;
+		}
+		slope = (highMs - lowMs) / (highT - lowT);
+		t     = lowT;
+		if (targetMs > lowMs)
+		{
+			t = lowT + (uint64_t) ((targetMs - lowMs) / slope + 0.999);
+		}
+		if (t > UINT32_MAX)
+		{
+			t = UINT32_MAX;
+		}
+		if (t == highT)
+		{
+			break;
+		}
+
+		// Check and refit with the new point
+		ms = bscrypt_calibrateMeasure(ctx, maxThreads, memoryKiB, (uint32_t) t, parallelism);
+		if (ms < 0)
+		{
+			return 1;
+		}
+		highT  = (uint32_t) t;
+		highMs = ms;
+	}
+	if (t < minIterations)
+	{
+		t = minIterations;
+	}
+	*iterations = (uint32_t) t;
+
+	if (profilePath != NULL)
+	{
+		FILE *file = fopen(profilePath, "a");
 
+		if (file != NULL)
+		{
+			if (ftell(file) == 0)
+			{
+				fprintf(file, "# bscrypt tuning profile: CPU model, instruction sets, workers, maxThreads, m, p, target ms, t\n");
+			}
+			fprintf(file, "%s\t%u\n", key, *iterations);
+			fclose(file);
+		}
+	}
 	return 0;
 }
 
 /**
- * Generates a bscrypt hash.
+ * Finds the number of iterations (t) that takes targetMs on this machine with
+ * the context's threads and kernel. This is the smallest t that takes at least
+ * targetMs and isn't below bscrypt_minIterations(). Measuring takes about
+ * 20 * targetMs. With profilePath, the result is saved in a tuning profile
+ * keyed by the CPU model, kernel, threads, and arguments so later calls (like
+ * at service start up) return right away.
  *
- * @param char        hash[BSCRYPT_HASH_MAX_SIZE] - The hash.
- * @param const void *password     - The password.
- * @param size_t      passwordSize - Size of the password.
- * @param uint32_t    memoryKiB    - The size of the sboxes in KiB (m).
- * @param uint32_t    iterations   - The number of iterations (t).
- * @param uint32_t    parallelism  - The amount of parallelism (p).
- * @param uint32_t    maxThreads   - The maximum number of threads.
- * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
- * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
- * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
- * @return On success, 0. Otherwise, non-zero.
+ * @param bscrypt_ctx *ctx         - The context.
+ * @param uint32_t    *iterations  - Receives the number of iterations (t).
+ * @param uint32_t     targetMs    - Target time for a hash or verify in ms.
+ * @param uint32_t     memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t     parallelism - The amount of parallelism (p).
+ * @param const char  *profilePath - Optional. The tuning profile file.
+ * @return On success 0, otherwise non-zero.
  */
-int bscrypt_hash(char hash[BSCRYPT_HASH_MAX_SIZE], const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams)
+int bscrypt_ctxCalibrate(bscrypt_ctx *ctx, uint32_t *iterations, uint32_t targetMs, uint32_t memoryKiB, uint32_t parallelism, const char *profilePath)
 {
-	uint8_t salt[16];
+	return bscrypt_calibrate_(ctx, iterations, targetMs, memoryKiB, parallelism, ctx->maxThreads, profilePath);
+}
 
-	// Generate salt
-	if (getRandom(salt, sizeof(salt)))
+/**
+ * Finds the number of iterations (t) that takes targetMs on this machine. See
+ * bscrypt_ctxCalibrate().
+ *
+ * @param uint32_t   *iterations  - Receives the number of iterations (t).
+ * @param uint32_t    targetMs    - Target time for a hash or verify in ms.
+ * @param uint32_t    memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t    parallelism - The amount of parallelism (p).
+ * @param uint32_t    maxThreads  - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param const char *profilePath - Optional. The tuning profile file.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_calibrate(uint32_t *iterations, uint32_t targetMs, uint32_t memoryKiB, uint32_t parallelism, uint32_t maxThreads, const char *profilePath)
+{
+	return bscrypt_calibrate_(bscrypt_getDefaultCtx(), iterations, targetMs, memoryKiB, parallelism, maxThreads, profilePath);
+}
+
+/**
+ * Starts generating a key with bscrypt in steps. This does step 1 (seed) and
+ * allocates the sbox. Either bscrypt_kdfFinish() or bscrypt_kdfAbort() must be
+ * called afterward.
+ *
+ * @param bscrypt_kdfState *state        - The state.
+ * @param const void       *password     - The password.
+ * @param size_t            passwordSize - Size of the password.
+ * @param const void       *salt         - The salt.
+ * @param size_t            saltSize     - Size of the salt.
+ * @param uint32_t          memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t          iterations   - The number of iterations (t).
+ * @param uint32_t          parallelism  - The amount of parallelism (p).
+ * @param int               wipeSboxes   - Whether to wipe the sbox afterward.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_kdfInit(bscrypt_kdfState *state, const void *password, size_t passwordSize, const void *salt, size_t saltSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, int wipeSboxes)
+{
+	// Limits
+	if      (memoryKiB   > MEMORY_KIB_MAX)           { memoryKiB = MEMORY_KIB_MAX; }
+	else if (memoryKiB   < MEMORY_KIB_MIN)           { memoryKiB = MEMORY_KIB_MIN; }
+	if      (iterations  < ITERATIONS_MIN)           { iterations = ITERATIONS_MIN; }
+	if      (parallelism < 1)                        { parallelism = 1; }
+
+	state->sbox = NULL;
+	if (bscrypt_getSboxInfo(memoryKiB, state->count, state->sboxOffset, state->mask))
 	{
-		hash[0] = 0;
 		return 1;
 	}
+	state->iterations  = iterations;
+	state->parallelism = parallelism;
+	state->lane        = 0;
+	state->iteration   = 0;
+	state->phase       = BSCRYPT_PHASE_FILL;
+	state->wipeSboxes  = wipeSboxes;
 
-	// Hash
-	int ret = bscrypt_hash_(hash, password, passwordSize, salt, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, encryptFunc, encryptHashParams);
+	// Step 1: seed = H(inputs)
+	memset(state->workSeed, 0, 8 * sizeof(uint64_t));
+	bscrypt_seed(state->workSeed + 8, password, passwordSize, salt, saltSize);
 
-	// Clear
-	secureClearMemory(salt, sizeof(salt));
+	state->sbox = new uint64_t[state->count + 8 + 64 / sizeof(uint64_t)];
+	// Align to 64 bytes
+	state->sboxAligned = (uint64_t*) ((((uintptr_t) state->sbox) + 63) & ~((uintptr_t) 63));
+
+	return 0;
+}
+
+/**
+ * Runs step 2 (work) until either the time budget is used or the work is done.
+ * At least one unit of work is done per call. The longest unit is either
+ * filling or one iteration over a sbox, which is roughly memoryKiB / 8 us.
+ *
+ * @param bscrypt_kdfState *state    - The state.
+ * @param uint32_t          budgetUs - The time budget in microseconds.
+ * @return If more steps are needed, non-zero. When ready for bscrypt_kdfFinish(), 0.
+ */
+int bscrypt_kdfStep(bscrypt_kdfState *state, uint32_t budgetUs)
+{
+	uint64_t  start = getTimeUs();
+	uint64_t *sbox  = state->sboxAligned;
+	size_t    count = state->count;
+
+	do
+	{
+		if (state->phase == BSCRYPT_PHASE_FILL)
+		{
+			bscrypt_work_init(state->workSeed + 8, sbox, count, state->lane);
+			state->iteration = 0;
+			state->phase     = BSCRYPT_PHASE_ITERATIONS;
+		}
+		else if (state->phase == BSCRYPT_PHASE_ITERATIONS)
+		{
+			bscrypt_work_iterate(sbox, state->sboxOffset, count, state->mask, 1);
+			state->iteration++;
+			if (state->iteration >= state->iterations)
+			{
+				state->phase = BSCRYPT_PHASE_FINISH;
+			}
+		}
+		else if (state->phase == BSCRYPT_PHASE_FINISH)
+		{
+			uint64_t threadWork[8];
+
+			bscrypt_work_finish(threadWork, sbox, count);
+			for (uint32_t i = 0; i < 8; i++)
+			{
+				state->workSeed[i] ^= threadWork[i];
+			}
+			secureClearMemory(threadWork, sizeof(threadWork));
+
+			state->lane++;
+			state->phase = BSCRYPT_PHASE_FILL;
+			if (state->lane >= state->parallelism)
+			{
+				state->phase = BSCRYPT_PHASE_OUTPUT;
+			}
+		}
+		if (state->phase == BSCRYPT_PHASE_OUTPUT)
+		{
+			return 0;
+		}
+	} while (getTimeUs() - start < budgetUs);
+
+	return 1;
+}
+
+/**
+ * Finishes generating a key with bscrypt in steps. Any remaining work is done
+ * before step 3 (output). The state is cleared and the sbox is freed.
+ *
+ * @param bscrypt_kdfState *state      - The state.
+ * @param void             *output     - Output of bscrypt.
+ * @param size_t            outputSize - Output size.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_kdfFinish(bscrypt_kdfState *state, void *output, size_t outputSize)
+{
+	if (state->sbox == NULL)
+	{
+		return 1;
+	}
+
+	// Step 2: work = doWork(seed)
+	while (bscrypt_kdfStep(state, UINT32_MAX))
+	{
+	}
+
+	// Step 3: output = kdf(work, seed)
+	bscrypt_output(NULL, output, outputSize, state->workSeed);
+
+	// Clean up
+	bscrypt_kdfAbort(state);
+
+	return 0;
+}
+
+/**
+ * Stops generating a key with bscrypt in steps. The state is cleared and the
+ * sbox is freed. Safe to call more than once.
+ *
+ * @param bscrypt_kdfState *state - The state.
+ */
+void bscrypt_kdfAbort(bscrypt_kdfState *state)
+{
+	if (state->sbox != NULL)
+	{
+		// A partial sbox is always wiped
+		if (state->wipeSboxes || state->phase != BSCRYPT_PHASE_OUTPUT)
+		{
+			secureClearMemory(state->sboxAligned, sizeof(uint64_t) * (state->count + 8));
+		}
+		delete [] state->sbox;
+		state->sbox = NULL;
+	}
+	secureClearMemory(state->workSeed, sizeof(state->workSeed));
+	secureClearMemory(&state->params, sizeof(state->params));
+}
+
+/**
+ * Starts verifying a password against a bscrypt hash in steps. Run
+ * bscrypt_kdfStep() until it returns 0 then call bscrypt_verifyFinish() with
+ * the same hash. Or call bscrypt_kdfAbort() to give up.
+ *
+ * @param bscrypt_kdfState *state        - The state.
+ * @param const char       *hash         - The hash.
+ * @param const void       *password     - The password.
+ * @param size_t            passwordSize - Size of the password.
+ * @param int               wipeSboxes   - Whether to wipe the sbox afterward.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_verifyInit(bscrypt_kdfState *state, const char *hash, const void *password, size_t passwordSize, int wipeSboxes)
+{
+	state->sbox = NULL;
+
+	// Decode
+	if (bscrypt_parseHash(&state->params, hash))
+	{
+		secureClearMemory(&state->params, sizeof(state->params));
+		return 1;
+	}
+
+	// Hash
+	int ret = bscrypt_kdfInit(state, password, passwordSize, state->params.salt, sizeof(state->params.salt), state->params.memoryKiB, state->params.iterations, state->params.parallelism, wipeSboxes);
+	if (ret)
+	{
+		secureClearMemory(&state->params, sizeof(state->params));
+	}
 
 	return ret;
 }
 
 /**
- * Verifies a password against a bscrypt hash.
+ * Finishes verifying a password against a bscrypt hash in steps. The state is
+ * cleared and the sbox is freed.
  *
- * @param const char *hash         - The hash.
- * @param const void *password     - The password.
- * @param size_t      passwordSize - Size of the password.
- * @param uint32_t    maxThreads   - The maximum number of threads.
- * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param bscrypt_kdfState *state - The state.
+ * @param const char       *hash  - The hash given to bscrypt_verifyInit(). Unused since the state keeps the parsed hash.
  * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
  * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
  * @return On correct password, non-zero. Otherwise, 0.
  */
-int bscrypt_verify(const char *hash, const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams)
+int bscrypt_verifyFinish(bscrypt_kdfState *state, const char *hash, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams)
 {
-	size_t   offset;
-	uint32_t memoryKiB;
-	uint32_t iterations;
-	uint32_t parallelism;
-	uint8_t  salt[16];
-	char     hashTest[BSCRYPT_HASH_MAX_SIZE];
+	bscrypt_params params         = state->params; // bscrypt_kdfFinish() clears the state
+	uint8_t        hashBytes[BSCRYPT_ENCRYPTED_HASH_MAX_SIZE];
+	size_t         hashBytesSize  = 24;
+	int            ret            = 0;
 
-	// Decode
-	offset = bscrypt_decodeHash(hash, memoryKiB, iterations, parallelism);
-	if (offset == SIZE_MAX)
+	(void) hash;
+
+	// Hash
+	if (bscrypt_kdfFinish(state, hashBytes, 24) == 0)
 	{
-		return 0;
+		// Encrypt
+		if (encryptFunc != NULL)
+		{
+			hashBytesSize = encryptFunc(encryptHashParams, hashBytes, hashBytesSize, BSCRYPT_ENCRYPTED_HASH_MAX_SIZE);
+		}
+
+		// Compare
+		ret = constTimeCmpEq(hashBytes, params.digest, params.digestSize) & (hashBytesSize == params.digestSize);
 	}
-	if (base64Decode(salt, hash + offset, 22, BASE64_DECODE_FLAG_IGNORE_NO_PAD))
+
+	// Clear
+	secureClearMemory(hashBytes, sizeof(hashBytes));
+	secureClearMemory(&params, sizeof(params));
+
+	return ret;
+}
+
+/**
+ * Writes 8 bytes (a uint64_t of 1) to an async job's notifyFd.
+ *
+ * @param int notifyFd - The eventfd or pipe, or -1 for none.
+ */
+static void bscrypt_asyncNotify(int notifyFd)
+{
+#ifndef _WIN32
+	if (notifyFd != -1)
 	{
-		return 0;
+		uint64_t one = 1;
+
+		// eventfd needs exactly 8 bytes and a full pipe already means "wake up"
+		while (write(notifyFd, &one, sizeof(one)) == -1 && errno == EINTR)
+		{
+		}
 	}
+#else
+	(void) notifyFd;
+#endif
+}
 
-	// Hash
-	if (bscrypt_hash_(hashTest, password, passwordSize, salt, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, encryptFunc, encryptHashParams))
+static void bscrypt_asyncRun(void *arg)
+{
+	bscrypt_async *job = (bscrypt_async*) arg;
+
+	if (job->isVerify)
 	{
-		return 0;
+		job->result = bscrypt_verify_(job->ctx, job->verifyHash, job->password, job->passwordSize, job->maxThreads, job->wipeSboxes, job->encryptFunc, job->encryptHashParams, job->cancel);
+	}
+	else
+	{
+		job->result = bscrypt_hashRandomSalt_(job->ctx, job->hash, job->password, job->passwordSize, job->memoryKiB, job->iterations, job->parallelism, job->maxThreads, job->wipeSboxes, job->encryptFunc, job->encryptHashParams, job->cancel);
 	}
 
-	// Compare
-	// constTimeCmpEq() to avoid dumb bug reports
-	int ret = constTimeCmpEq(hashTest, hash, offset + 55);
+	// Notify
+	// The job may be gone once "done" is set or the callback is called, but notifyFd must still be open
+	BSCRYPT_COMPLETION_FUNC callback = job->callback;
+	int                     notifyFd = job->notifyFd;
+	if (callback == NULL)
+	{
+		bscrypt_asyncNotify(notifyFd);
+		job->done.store(1, std::memory_order_release);
+		return;
+	}
+	// The callback owns the job so "done" isn't set
+	callback(job);
+	bscrypt_asyncNotify(notifyFd);
+}
 
-	// Clear
-	secureClearMemory(hashTest, sizeof(hashTest));
+/**
+ * Sets up an async job's completion notification.
+ *
+ * @param bscrypt_async           *job      - The job.
+ * @param BSCRYPT_COMPLETION_FUNC  callback - Optional function called by the worker when done. It owns the job and "done" isn't set.
+ * @param void                    *user     - Anything you want. Copied to job->user.
+ * @param int                      notifyFd - Optional eventfd or pipe to write 8 bytes to when done, otherwise -1. With a callback it's written after the callback returns, so keep it open. Not on Windows.
+ */
+void bscrypt_asyncInit(bscrypt_async *job, BSCRYPT_COMPLETION_FUNC callback, void *user, int notifyFd)
+{
+	job->hash[0]  = 0;
+	job->result   = 0;
+	job->done.store(0, std::memory_order_relaxed);
+	job->user     = user;
+	job->callback = callback;
+	job->notifyFd = notifyFd;
+}
 
-	return ret;
+static int bscrypt_hashAsync_(bscrypt_ctx *ctx, bscrypt_async *job, const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	if (!ctx->poolStarted)
+	{
+		return 1;
+	}
+
+	job->ctx               = ctx;
+	job->isVerify          = 0;
+	job->verifyHash        = NULL;
+	job->password          = password;
+	job->passwordSize      = passwordSize;
+	job->memoryKiB         = memoryKiB;
+	job->iterations        = iterations;
+	job->parallelism       = parallelism;
+	job->maxThreads        = maxThreads;
+	job->wipeSboxes        = wipeSboxes;
+	job->encryptFunc       = encryptFunc;
+	job->encryptHashParams = encryptHashParams;
+	job->cancel            = cancel;
+	job->done.store(0, std::memory_order_relaxed);
+	job->task.func         = bscrypt_asyncRun;
+	job->task.arg          = job;
+	threadPool_submit(&ctx->pool, &job->task);
+
+	return 0;
 }
 
 /**
- * Checks if the hash needs to be upgraded.
+ * Queues generating a bscrypt hash on the library's workers. When done,
+ * job->result is what bscrypt_hash() returned and job->hash has the hash.
  *
- * @param const char *hash        - The hash.
- * @param uint32_t    memoryKiB   - The size of the sboxes in KiB (m).
- * @param uint32_t    iterations  - The number of iterations (t).
- * @param uint32_t    parallelism - The amount of parallelism (p).
- * @return If upgrade needed, non-zero. Otherwise, 0.
+ * @param bscrypt_async *job          - The job from bscrypt_asyncInit().
+ * @param const void    *password     - The password. Must stay valid until done.
+ * @param size_t         passwordSize - Size of the password.
+ * @param uint32_t       memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t       iterations   - The number of iterations (t).
+ * @param uint32_t       parallelism  - The amount of parallelism (p).
+ * @param uint32_t       maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int            wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On success (queued), 0. Otherwise, non-zero and the job will not complete.
  */
-int bscrypt_needsRehash(const char *hash, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+int bscrypt_hashAsync(bscrypt_async *job, const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
 {
-	uint32_t hashMemoryKiB;
-	uint32_t hashIterations;
-	uint32_t hashParallelism;
+	return bscrypt_hashAsync_(bscrypt_getDefaultCtx(), job, password, passwordSize, memoryKiB, iterations, parallelism, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
 
-	if (bscrypt_decodeHash(hash, hashMemoryKiB, hashIterations, hashParallelism) == SIZE_MAX ||
-		hashMemoryKiB   != memoryKiB  ||
-		hashIterations  != iterations ||
-		hashParallelism != parallelism)
+static int bscrypt_verifyAsync_(bscrypt_ctx *ctx, bscrypt_async *job, const char *hash, const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	if (!ctx->poolStarted)
 	{
 		return 1;
 	}
 
+	job->ctx               = ctx;
+	job->isVerify          = 1;
+	job->verifyHash        = hash;
+	job->password          = password;
+	job->passwordSize      = passwordSize;
+	job->maxThreads        = maxThreads;
+	job->wipeSboxes        = wipeSboxes;
+	job->encryptFunc       = encryptFunc;
+	job->encryptHashParams = encryptHashParams;
+	job->cancel            = cancel;
+	job->done.store(0, std::memory_order_relaxed);
+	job->task.func         = bscrypt_asyncRun;
+	job->task.arg          = job;
+	threadPool_submit(&ctx->pool, &job->task);
+
 	return 0;
 }
+
+/**
+ * Queues verifying a password against a bscrypt hash on the library's workers.
+ * When done, job->result is what bscrypt_verify() returned.
+ *
+ * @param bscrypt_async *job          - The job from bscrypt_asyncInit().
+ * @param const char    *hash         - The hash. Must stay valid until done.
+ * @param const void    *password     - The password. Must stay valid until done.
+ * @param size_t         passwordSize - Size of the password.
+ * @param uint32_t       maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int            wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On success (queued), 0. Otherwise, non-zero and the job will not complete.
+ */
+int bscrypt_verifyAsync(bscrypt_async *job, const char *hash, const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_verifyAsync_(bscrypt_getDefaultCtx(), job, hash, password, passwordSize, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+/**
+ * Queues generating a bscrypt hash on a context's workers with the context's
+ * settings. See bscrypt_hashAsync().
+ *
+ * @param bscrypt_ctx   *ctx          - The context.
+ * @param bscrypt_async *job          - The job from bscrypt_asyncInit().
+ * @param const void    *password     - The password. Must stay valid until done.
+ * @param size_t         passwordSize - Size of the password.
+ * @param uint32_t       memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t       iterations   - The number of iterations (t).
+ * @param uint32_t       parallelism  - The amount of parallelism (p).
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On success (queued), 0. Otherwise, non-zero and the job will not complete.
+ */
+int bscrypt_ctxHashAsync(bscrypt_ctx *ctx, bscrypt_async *job, const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_hashAsync_(ctx, job, password, passwordSize, memoryKiB, iterations, parallelism, ctx->maxThreads, ctx->wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
+
+/**
+ * Queues verifying a password on a context's workers with the context's
+ * settings. See bscrypt_verifyAsync().
+ *
+ * @param bscrypt_ctx   *ctx          - The context.
+ * @param bscrypt_async *job          - The job from bscrypt_asyncInit().
+ * @param const char    *hash         - The hash. Must stay valid until done.
+ * @param const void    *password     - The password. Must stay valid until done.
+ * @param size_t         passwordSize - Size of the password.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On success (queued), 0. Otherwise, non-zero and the job will not complete.
+ */
+int bscrypt_ctxVerifyAsync(bscrypt_ctx *ctx, bscrypt_async *job, const char *hash, const void *password, size_t passwordSize, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	return bscrypt_verifyAsync_(ctx, job, hash, password, passwordSize, ctx->maxThreads, ctx->wipeSboxes, encryptFunc, encryptHashParams, cancel);
+}
@@ -13,6 +13,9 @@
 #pragma once
 
 #include <stdint.h>
+#include <atomic>
+#include "blake2b.h"
+#include "threadpool.h"
 
 /**
  * This function is called after the hashing has finish and given a binary hash.
@@ -37,6 +40,53 @@ typedef size_t (*DETERMINISTIC_ENCRYPT_HASH_FUNC)(
 	size_t  hashSize,
 	size_t  maxEncryptedHashSize);
 
+/**
+ * The inverse of your DETERMINISTIC_ENCRYPT_HASH_FUNC. This is only used to
+ * rotate keys (see rotate.h). Decrypt in place and return the size of the
+ * decrypted hash. Return 0 if the encrypted hash is invalid.
+ *
+ * @param void *decryptHashParams  - Your decrypt hash params. Anything needed for your implementation.
+ * @param void *encryptedHash      - Encrypted hash to decrypt.
+ * @param size_t encryptedHashSize - Size of encrypted hash.
+ * @param size_t maxHashSize       - Maximum size of the decrypted hash.
+ * @return size_t - Size of decrypted hash or 0 on error.
+ */
+typedef size_t (*DETERMINISTIC_DECRYPT_HASH_FUNC)(
+	void   *decryptHashParams,
+	void   *encryptedHash,
+	size_t  encryptedHashSize,
+	size_t  maxHashSize);
+
+/**
+ * Cancellation token for bscrypt_kdf(), bscrypt_hash(), and bscrypt_verify().
+ * This is checked by every lane at the start of each iteration. To cancel, call
+ * bscrypt_cancelTokenCancel() from any thread. For a timeout, give a non-zero
+ * timeout to bscrypt_cancelTokenInit(). Once a deadline passes the token is
+ * marked as canceled. So after bscrypt_verify() returns 0 you can call
+ * bscrypt_cancelTokenIsCanceled() to tell a timeout from a wrong password.
+ */
+struct bscrypt_cancelToken
+{
+	std::atomic<int> canceled;
+	uint64_t         deadlineUs;
+};
+
+/**
+ * Decisions made for maxThreads = BSCRYPT_THREADS_AUTO. Load is threads
+ * running bscrypt_kdf() plus jobs waiting for the library's workers.
+ */
+struct bscrypt_autoThreadsStats
+{
+	uint64_t decisions;     // Number of auto decisions
+	uint64_t serial;        // Decisions for 1 thread
+	uint64_t full;          // Decisions for p threads
+	uint64_t threadsTotal;  // Sum of threads picked
+	uint64_t loadTotal;     // Sum of load seen
+	uint32_t lastThreads;   // Threads picked last time
+	uint32_t lastLoad;      // Load seen last time
+	uint32_t activeThreads; // Threads running bscrypt_kdf() now
+};
+
 // $bscrypt$m=67108864,t=4294967295,p=4294967295$salt..................hash............................[.........]
 const size_t BSCRYPT_HASH_MAX_SIZE           = 112;
 const size_t BSCRYPT_ENCRYPTED_HASH_MAX_SIZE = 32;
@@ -44,21 +94,404 @@ const uint32_t MEMORY_KIB_MIN = 16;
 const uint32_t MEMORY_KIB_MAX = 67108864;
 const uint32_t ITERATIONS_MIN = 2;
 
+const uint32_t BSCRYPT_THREADS_AUTO = 0;
+const uint64_t BSCRYPT_SBOX_CACHE_DEFAULT_BYTES = 256 * 1024 * 1024;
+
+// Security floor for bscrypt_calibrate(): bytes of sbox work (m * 1024 * p * t)
+const uint64_t BSCRYPT_CALIBRATE_MIN_WORK = 1900000;
+const uint32_t BSCRYPT_CALIBRATE_RUNS     = 5; // Median of this many runs per measurement
+const uint32_t BSCRYPT_CALIBRATE_REFINE   = 3; // Refits toward the target
+
+const int BSCRYPT_ERROR_CANCELED        = 2;
+const int BSCRYPT_ERROR_DUPLICATE_LABEL = 3; // bscrypt_kdfSubkeys() got the same label twice
+
+const int BSCRYPT_PHASE_FILL       = 0;
+const int BSCRYPT_PHASE_ITERATIONS = 1;
+const int BSCRYPT_PHASE_FINISH     = 2;
+const int BSCRYPT_PHASE_OUTPUT     = 3;
+
+/**
+ * A parsed bscrypt hash from bscrypt_parseHash(). The digest is the raw (or
+ * encrypted) hash bytes.
+ */
+struct bscrypt_params
+{
+	uint32_t memoryKiB;
+	uint32_t iterations;
+	uint32_t parallelism;
+	uint8_t  salt[16];
+	uint8_t  digest[BSCRYPT_ENCRYPTED_HASH_MAX_SIZE];
+	uint32_t digestSize;
+};
+
+/**
+ * State for running bscrypt_kdf() in small steps from an event loop. This runs
+ * lanes one after another on a single sbox, like maxThreads = 1, so the sbox
+ * stays in cache between steps. bscrypt_kdfInit() does step 1 (seed) and each
+ * call to bscrypt_kdfStep() does one or more of: fill a lane's sbox, one
+ * iteration, or finish a lane. bscrypt_kdfFinish() does the output step. Treat
+ * everything but "phase" (BSCRYPT_PHASE_*), "lane", and "iteration" as private.
+ */
+struct bscrypt_kdfState
+{
+	uint64_t        workSeed[16];
+	uint64_t       *sbox;
+	uint64_t       *sboxAligned;
+	size_t          sboxOffset;
+	size_t          count;
+	size_t          mask;
+	uint32_t        iterations;
+	uint32_t        parallelism;
+	uint32_t        lane;
+	uint32_t        iteration;
+	int             phase;
+	int             wipeSboxes;
+	bscrypt_params  params; // bscrypt_verifyInit()'s hash
+};
+
+/**
+ * A subkey for bscrypt_kdfSubkeys(). Labels must be unique (a NULL label is
+ * the same as "") and are NUL-terminated strings like "encryption" or "mac".
+ */
+struct bscrypt_subkey
+{
+	const char *label;
+	void       *output;
+	size_t      outputSize;
+};
+
+/**
+ * One part of a password for bscrypt_kdfParts(). The password is all the
+ * parts concatenated.
+ */
+struct bscrypt_passwordPart
+{
+	const void *data;
+	size_t      size;
+};
+
+/**
+ * A password fed in pieces for bscrypt_kdfInputFinish(). Treat as private.
+ */
+struct bscrypt_kdfInput
+{
+	blake2b_ctx ctx;
+};
+
+struct bscrypt_sbox;
+
+struct bscrypt_ctxStats
+{
+	uint64_t                 kdfCalls;        // Calls that ran lanes
+	uint64_t                 canceled;        // Calls that were canceled
+	uint64_t                 overLimits;      // Calls refused for being over the limits
+	uint64_t                 sboxAllocs;      // Sboxes allocated
+	uint64_t                 sboxReuses;      // Sboxes taken from the cache
+	uint32_t                 sboxesCached;    // Sboxes in the cache now
+	uint64_t                 sboxBytesCached; // Bytes of sboxes in the cache now
+	bscrypt_autoThreadsStats autoThreads;
+};
+
+/**
+ * A reusable context with its own workers, a cache of sboxes, limits, and
+ * stats. Set up with bscrypt_ctxInit(). Once warmed up, calls don't allocate
+ * memory as long as their sboxes fit in the cache. Requests use at most
+ * "workers + 1" threads since the calling thread runs lanes too. Settable after bscrypt_ctxInit(): maxThreads (default
+ * BSCRYPT_THREADS_AUTO), wipeSboxes (default 0), the max* limits (default
+ * no limit), and sboxCacheMaxBytes (default BSCRYPT_SBOX_CACHE_DEFAULT_BYTES).
+ * Cached sboxes are always wiped. Treat everything else as private.
+ */
+struct bscrypt_ctx
+{
+	threadPool       pool;
+	int              poolStarted;
+	MUTEX            mutex;
+	bscrypt_sbox    *sboxes;
+	uint32_t         sboxesCached;
+	uint64_t         sboxBytesCached;
+	uint64_t         sboxCacheMaxBytes;
+	uint32_t         numCores;
+	uint32_t         activeThreads;
+	uint32_t         maxThreads;
+	int              wipeSboxes;
+	uint32_t         maxMemoryKiB;
+	uint32_t         maxIterations;
+	uint32_t         maxParallelism;
+	bscrypt_ctxStats stats;
+};
+
+/**
+ * This function is called during a batch after each entry is done. Calls are
+ * made one at a time in order, from whichever thread finished the entry. Don't
+ * do anything slow in here as it holds up the batch.
+ *
+ * @param void  *user  - The user pointer given to the batch.
+ * @param size_t done  - Number of entries done.
+ * @param size_t total - Number of entries.
+ */
+typedef void (*BSCRYPT_PROGRESS_FUNC)(void *user, size_t done, size_t total);
+
+struct bscrypt_async;
+
+/**
+ * This function is called by a worker thread when an async hash or verify is
+ * done. The job is yours from here, "done" isn't set, and the worker doesn't
+ * touch it again, so this may free it. The job's notifyFd is written after
+ * this returns, so it must stay open even if the job is freed. Don't do
+ * anything slow in here as it holds up a worker.
+ *
+ * @param bscrypt_async *job - The finished job. "result" (and "hash" for a hash) is set.
+ */
+typedef void (*BSCRYPT_COMPLETION_FUNC)(bscrypt_async *job);
+
+/**
+ * An async hash or verify job. Set up with bscrypt_asyncInit() then submit with
+ * bscrypt_hashAsync() or bscrypt_verifyAsync(). The job, password, and hash
+ * must stay valid until it's done. When done: "result" is set, 8 bytes (a
+ * uint64_t of 1) are written to notifyFd, and then "done" is set to non-zero
+ * with a release store. So notifyFd can be an eventfd or the write end of a
+ * pipe to add to epoll. Once woken, "done" may lag by a moment, so wait for it
+ * before touching the job. With a callback, the callback is called instead of
+ * setting "done" and then notifyFd is written. The job isn't touched once the
+ * callback is called, so the callback may free it, but notifyFd must stay open
+ * until after the callback returns. Treat everything but "hash", "result",
+ * "done", and "user" as private.
+ */
+struct bscrypt_async
+{
+	char                            hash[BSCRYPT_HASH_MAX_SIZE];
+	int                             result;
+	std::atomic<int>                done;
+	void                           *user;
+	BSCRYPT_COMPLETION_FUNC         callback;
+	int                             notifyFd;
+	bscrypt_ctx                    *ctx;
+	int                             isVerify;
+	const char                     *verifyHash;
+	const void                     *password;
+	size_t                          passwordSize;
+	uint32_t                        memoryKiB;
+	uint32_t                        iterations;
+	uint32_t                        parallelism;
+	uint32_t                        maxThreads;
+	int                             wipeSboxes;
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc;
+	void                           *encryptHashParams;
+	bscrypt_cancelToken            *cancel;
+	threadPoolTask                  task;
+};
+
+void bscrypt_cancelTokenInit(bscrypt_cancelToken *cancel, uint32_t timeoutMs = 0);
+void bscrypt_cancelTokenCancel(bscrypt_cancelToken *cancel);
+int  bscrypt_cancelTokenIsCanceled(bscrypt_cancelToken *cancel);
+
 int bscrypt_kdf(
 	void       *output,   size_t outputSize,
 	const void *password, size_t passwordSize,
 	const void *salt,     size_t saltSize,
 	uint32_t    memoryKiB, uint32_t iterations, uint32_t parallelism,
-	uint32_t    maxThreads, int wipeSboxes);
+	uint32_t    maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel = NULL);
+int bscrypt_kdfSubkeys(
+	bscrypt_subkey *subkeys, size_t count,
+	const void     *password, size_t passwordSize,
+	const void     *salt,     size_t saltSize,
+	uint32_t        memoryKiB, uint32_t iterations, uint32_t parallelism,
+	uint32_t        maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel = NULL);
+int bscrypt_kdfParts(
+	void                       *output,   size_t outputSize,
+	const bscrypt_passwordPart *parts,    size_t numParts,
+	const void                 *salt,     size_t saltSize,
+	uint32_t                    memoryKiB, uint32_t iterations, uint32_t parallelism,
+	uint32_t                    maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel = NULL);
+void bscrypt_kdfInputInit(bscrypt_kdfInput *input, const void *salt, size_t saltSize);
+void bscrypt_kdfInputUpdate(bscrypt_kdfInput *input, const void *data, size_t size);
+int  bscrypt_kdfInputUpdateFile(bscrypt_kdfInput *input, const char *path);
+int  bscrypt_kdfInputFinish(
+	bscrypt_kdfInput *input,
+	void             *output, size_t outputSize,
+	uint32_t          memoryKiB, uint32_t iterations, uint32_t parallelism,
+	uint32_t          maxThreads, int wipeSboxes, bscrypt_cancelToken *cancel = NULL);
+void bscrypt_kdfInputAbort(bscrypt_kdfInput *input);
+int bscrypt_kdfScratchSize(uint32_t memoryKiB, uint32_t parallelism, uint32_t threads, size_t *size, size_t *alignment);
+int bscrypt_kdfScratch(
+	void       *output,   size_t outputSize,
+	const void *password, size_t passwordSize,
+	const void *salt,     size_t saltSize,
+	uint32_t    memoryKiB, uint32_t iterations, uint32_t parallelism,
+	uint32_t    maxThreads, int wipeSboxes,
+	void       *scratch,  size_t scratchSize,
+	bscrypt_cancelToken *cancel = NULL);
 int bscrypt_hash(
 	char        hash[BSCRYPT_HASH_MAX_SIZE],
 	const void *password, size_t passwordSize,
 	uint32_t    memoryKiB, uint32_t iterations, uint32_t parallelism,
-	uint32_t    maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL);
+	uint32_t    maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
 int bscrypt_verify(
 	const char *hash,
 	const void *password, size_t passwordSize,
-	uint32_t    maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL);
+	uint32_t    maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+
+int bscrypt_hashBatch(
+	char             (*hashes)[BSCRYPT_HASH_MAX_SIZE],
+	const void *const *passwords, const size_t *passwordSizes,
+	size_t             count,
+	int               *results,
+	uint32_t           memoryKiB, uint32_t iterations, uint32_t parallelism,
+	uint32_t           maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	BSCRYPT_PROGRESS_FUNC progress = NULL, void *progressUser = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_verifyBatch(
+	const char *const *hashes,
+	const void *const *passwords, const size_t *passwordSizes,
+	size_t             count,
+	int               *results,
+	uint32_t           maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+
+int bscrypt_parseHash(bscrypt_params *params, const char *hash);
+int bscrypt_formatHash(char hash[BSCRYPT_HASH_MAX_SIZE], const bscrypt_params *params);
+int bscrypt_verifyParams(
+	const bscrypt_params *params,
+	const void *password, size_t passwordSize,
+	uint32_t    maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+
+int  bscrypt_kdfInit(
+	bscrypt_kdfState *state,
+	const void *password, size_t passwordSize,
+	const void *salt,     size_t saltSize,
+	uint32_t    memoryKiB, uint32_t iterations, uint32_t parallelism,
+	int         wipeSboxes);
+int  bscrypt_kdfStep(bscrypt_kdfState *state, uint32_t budgetUs);
+int  bscrypt_kdfFinish(bscrypt_kdfState *state, void *output, size_t outputSize);
+void bscrypt_kdfAbort(bscrypt_kdfState *state);
+int  bscrypt_verifyInit(
+	bscrypt_kdfState *state,
+	const char *hash,
+	const void *password, size_t passwordSize,
+	int         wipeSboxes);
+int  bscrypt_verifyFinish(
+	bscrypt_kdfState *state,
+	const char *hash,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL);
+
+void bscrypt_asyncInit(bscrypt_async *job, BSCRYPT_COMPLETION_FUNC callback = NULL, void *user = NULL, int notifyFd = -1);
+int  bscrypt_hashAsync(
+	bscrypt_async *job,
+	const void    *password, size_t passwordSize,
+	uint32_t       memoryKiB, uint32_t iterations, uint32_t parallelism,
+	uint32_t       maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+int  bscrypt_verifyAsync(
+	bscrypt_async *job,
+	const char    *hash,
+	const void    *password, size_t passwordSize,
+	uint32_t       maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+
+void bscrypt_getAutoThreadsStats(bscrypt_autoThreadsStats *stats);
+
+int          bscrypt_ctxInit(bscrypt_ctx *ctx, uint32_t numWorkers = 0);
+void         bscrypt_ctxDestroy(bscrypt_ctx *ctx);
+void         bscrypt_ctxTrim(bscrypt_ctx *ctx);
+void         bscrypt_ctxGetStats(bscrypt_ctx *ctx, bscrypt_ctxStats *stats);
+bscrypt_ctx *bscrypt_getDefaultCtx();
+void         bscrypt_ctxParallelFor(bscrypt_ctx *ctx, size_t count, size_t minPerThread, void (*func)(void *arg, size_t i), void *arg);
+int bscrypt_ctxKdf(
+	bscrypt_ctx *ctx,
+	void        *output,   size_t outputSize,
+	const void  *password, size_t passwordSize,
+	const void  *salt,     size_t saltSize,
+	uint32_t     memoryKiB, uint32_t iterations, uint32_t parallelism,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_ctxKdfSubkeys(
+	bscrypt_ctx    *ctx,
+	bscrypt_subkey *subkeys, size_t count,
+	const void     *password, size_t passwordSize,
+	const void     *salt,     size_t saltSize,
+	uint32_t        memoryKiB, uint32_t iterations, uint32_t parallelism,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_ctxKdfParts(
+	bscrypt_ctx                *ctx,
+	void                       *output,   size_t outputSize,
+	const bscrypt_passwordPart *parts,    size_t numParts,
+	const void                 *salt,     size_t saltSize,
+	uint32_t                    memoryKiB, uint32_t iterations, uint32_t parallelism,
+	bscrypt_cancelToken        *cancel = NULL);
+int bscrypt_ctxKdfInputFinish(
+	bscrypt_ctx      *ctx,
+	bscrypt_kdfInput *input,
+	void             *output, size_t outputSize,
+	uint32_t          memoryKiB, uint32_t iterations, uint32_t parallelism,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_ctxHash(
+	bscrypt_ctx *ctx,
+	char         hash[BSCRYPT_HASH_MAX_SIZE],
+	const void  *password, size_t passwordSize,
+	uint32_t     memoryKiB, uint32_t iterations, uint32_t parallelism,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_ctxHashBatch(
+	bscrypt_ctx       *ctx,
+	char             (*hashes)[BSCRYPT_HASH_MAX_SIZE],
+	const void *const *passwords, const size_t *passwordSizes,
+	size_t             count,
+	int               *results,
+	uint32_t           memoryKiB, uint32_t iterations, uint32_t parallelism,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	BSCRYPT_PROGRESS_FUNC progress = NULL, void *progressUser = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_ctxVerify(
+	bscrypt_ctx *ctx,
+	const char  *hash,
+	const void  *password, size_t passwordSize,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_ctxVerifyParams(
+	bscrypt_ctx          *ctx,
+	const bscrypt_params *params,
+	const void           *password, size_t passwordSize,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_ctxHashAsync(
+	bscrypt_ctx   *ctx,
+	bscrypt_async *job,
+	const void    *password, size_t passwordSize,
+	uint32_t       memoryKiB, uint32_t iterations, uint32_t parallelism,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_ctxVerifyAsync(
+	bscrypt_ctx   *ctx,
+	bscrypt_async *job,
+	const char    *hash,
+	const void    *password, size_t passwordSize,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+int bscrypt_ctxVerifyBatch(
+	bscrypt_ctx       *ctx,
+	const char *const *hashes,
+	const void *const *passwords, const size_t *passwordSizes,
+	size_t             count,
+	int               *results,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
+
 int bscrypt_needsRehash(
 	const char *hash,
 	uint32_t    memoryKiB, uint32_t iterations, uint32_t parallelism);
+
+uint32_t bscrypt_minIterations(uint32_t memoryKiB, uint32_t parallelism);
+int bscrypt_calibrate(
+	uint32_t   *iterations,
+	uint32_t    targetMs,
+	uint32_t    memoryKiB, uint32_t parallelism,
+	uint32_t    maxThreads,
+	const char *profilePath = NULL);
+int bscrypt_ctxCalibrate(
+	bscrypt_ctx *ctx,
+	uint32_t    *iterations,
+	uint32_t     targetMs,
+	uint32_t     memoryKiB, uint32_t parallelism,
+	const char  *profilePath = NULL);
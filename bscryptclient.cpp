@@ -0,0 +1,902 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include "bscryptclient.h"
+#include "common.h"
+#include <string.h>
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+	// SIGPIPE is your problem on systems without this
+	#define MSG_NOSIGNAL 0
+#endif
+
+// Wait this long before reconnecting to a daemon that failed
+const uint64_t BSCRYPTCLIENTPOOL_RETRY_US = 1000000;
+
+struct bscryptClient
+{
+	int      fd;
+	uint32_t nextId;
+	uint8_t  buffer[BSCRYPTD_HEADER_SIZE + BSCRYPTD_MAX_PAYLOAD];
+};
+
+struct bscryptClientPool_daemon
+{
+	bscryptClient *client;     // NULL when down
+	char          *path;
+	uint32_t       queueDepth; // From its last response
+	uint32_t       abandoned;  // Responses we no longer want
+	uint32_t       triedId;    // Last request sent here
+	uint64_t       retryUs;
+};
+
+struct bscryptClientPool
+{
+	bscryptClientPool_daemon *daemons;
+	uint32_t                  numDaemons;
+	uint32_t                  hedgeAfterMs;
+	uint32_t                  nextId;
+	uint32_t                  rotate;
+	bscryptClientPool_stats   stats;
+};
+
+// What to (re)send
+struct bscryptClientPool_request
+{
+	uint8_t     op;
+	const char *hash;
+	const void *password;
+	size_t      passwordSize;
+	uint32_t    memoryKiB;
+	uint32_t    iterations;
+	uint32_t    parallelism;
+};
+
+static void writeUint32Le(uint8_t *out, uint32_t num)
+{
+	out[0] = (uint8_t)  num;
+	out[1] = (uint8_t) (num >>  8);
+	out[2] = (uint8_t) (num >> 16);
+	out[3] = (uint8_t) (num >> 24);
+}
+
+static uint32_t readUint32Le(const uint8_t *in)
+{
+	return
+		 (uint32_t) in[0]        |
+		((uint32_t) in[1] <<  8) |
+		((uint32_t) in[2] << 16) |
+		((uint32_t) in[3] << 24);
+}
+
+static int bscryptClient_writeAll(int fd, const uint8_t *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t ret = send(fd, data, size, MSG_NOSIGNAL);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return 1;
+		}
+		data += ret;
+		size -= (size_t) ret;
+	}
+	return 0;
+}
+
+static int bscryptClient_readAll(int fd, uint8_t *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t ret = read(fd, data, size);
+
+		if (ret <= 0)
+		{
+			if (ret < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			return 1;
+		}
+		data += ret;
+		size -= (size_t) ret;
+	}
+	return 0;
+}
+
+/**
+ * Sends a request made of up to 3 pieces of payload.
+ *
+ * @return On success 0, otherwise non-zero.
+ */
+static int bscryptClient_send(bscryptClient *client, uint32_t id, uint8_t op, const void *a, size_t aSize, const void *b, size_t bSize, const void *c, size_t cSize)
+{
+	uint8_t *buffer = client->buffer;
+	size_t   size   = aSize + bSize + cSize;
+	int      ret;
+
+	if (client->fd == -1 || size > BSCRYPTD_MAX_PAYLOAD)
+	{
+		return 1;
+	}
+	writeUint32Le(buffer, (uint32_t) size);
+	writeUint32Le(buffer + 4, id);
+	buffer[8] = op;
+	memset(buffer + 9, 0, BSCRYPTD_HEADER_SIZE - 9);
+	buffer += BSCRYPTD_HEADER_SIZE;
+	memcpy(buffer, a, aSize); buffer += aSize;
+	memcpy(buffer, b, bSize); buffer += bSize;
+	memcpy(buffer, c, cSize);
+
+	ret = bscryptClient_writeAll(client->fd, client->buffer, BSCRYPTD_HEADER_SIZE + size);
+	secureClearMemory(client->buffer, BSCRYPTD_HEADER_SIZE + size);
+	return ret;
+}
+
+/**
+ * Connects to bscryptd.
+ *
+ * @param const char *path - Socket path or NULL for BSCRYPTD_DEFAULT_PATH.
+ * @return On success a client, otherwise NULL.
+ */
+bscryptClient *bscryptClient_connect(const char *path)
+{
+	bscryptClient *client;
+	sockaddr_un    addr;
+	int            fd;
+
+	if (path == NULL)
+	{
+		path = BSCRYPTD_DEFAULT_PATH;
+	}
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+	{
+		return NULL;
+	}
+	if (connect(fd, (sockaddr*) &addr, sizeof(addr)) == -1)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	client = new bscryptClient;
+	client->fd     = fd;
+	client->nextId = 0;
+	return client;
+}
+
+/**
+ * Closes the connection and frees the client.
+ *
+ * @param bscryptClient *client - The client.
+ */
+void bscryptClient_close(bscryptClient *client)
+{
+	if (client != NULL)
+	{
+		if (client->fd != -1)
+		{
+			close(client->fd);
+		}
+		secureClearMemory(client->buffer, sizeof(client->buffer));
+		delete client;
+	}
+}
+
+/**
+ * Sends a ping. The response has the daemon's queue depth.
+ *
+ * @param bscryptClient *client - The client.
+ * @param uint32_t       id     - Echoed in the response.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscryptClient_sendPing(bscryptClient *client, uint32_t id)
+{
+	return bscryptClient_send(client, id, BSCRYPTD_OP_PING, NULL, 0, NULL, 0, NULL, 0);
+}
+
+/**
+ * Sends a hash request.
+ *
+ * @param bscryptClient *client       - The client.
+ * @param uint32_t       id           - Echoed in the response.
+ * @param const void    *password     - The password.
+ * @param size_t         passwordSize - Size of the password.
+ * @param uint32_t       memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t       iterations   - The number of iterations (t).
+ * @param uint32_t       parallelism  - The amount of parallelism (p).
+ * @return On success 0, otherwise non-zero.
+ */
+int bscryptClient_sendHash(bscryptClient *client, uint32_t id, const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+{
+	uint8_t settings[12];
+
+	writeUint32Le(settings,     memoryKiB);
+	writeUint32Le(settings + 4, iterations);
+	writeUint32Le(settings + 8, parallelism);
+	return bscryptClient_send(client, id, BSCRYPTD_OP_HASH, settings, sizeof(settings), password, passwordSize, NULL, 0);
+}
+
+/**
+ * Sends a verify request.
+ *
+ * @param bscryptClient *client       - The client.
+ * @param uint32_t       id           - Echoed in the response.
+ * @param const char    *hash         - The hash.
+ * @param const void    *password     - The password.
+ * @param size_t         passwordSize - Size of the password.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscryptClient_sendVerify(bscryptClient *client, uint32_t id, const char *hash, const void *password, size_t passwordSize)
+{
+	uint8_t hashSize[4];
+
+	writeUint32Le(hashSize, (uint32_t) strlen(hash));
+	return bscryptClient_send(client, id, BSCRYPTD_OP_VERIFY, hashSize, sizeof(hashSize), hash, strlen(hash), password, passwordSize);
+}
+
+/**
+ * Sends a needs rehash request.
+ *
+ * @param bscryptClient *client      - The client.
+ * @param uint32_t       id          - Echoed in the response.
+ * @param const char    *hash        - The hash.
+ * @param uint32_t       memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t       iterations  - The number of iterations (t).
+ * @param uint32_t       parallelism - The amount of parallelism (p).
+ * @return On success 0, otherwise non-zero.
+ */
+int bscryptClient_sendNeedsRehash(bscryptClient *client, uint32_t id, const char *hash, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+{
+	uint8_t settings[12];
+
+	writeUint32Le(settings,     memoryKiB);
+	writeUint32Le(settings + 4, iterations);
+	writeUint32Le(settings + 8, parallelism);
+	return bscryptClient_send(client, id, BSCRYPTD_OP_REHASH, settings, sizeof(settings), hash, strlen(hash), NULL, 0);
+}
+
+/**
+ * Waits for the next response.
+ *
+ * @param bscryptClient          *client   - The client.
+ * @param bscryptClient_response *response - Receives the response. For a hash, "hash" is set. For a verify or needs rehash, "result" is set.
+ * @return On success 0, otherwise non-zero and the connection is unusable.
+ */
+int bscryptClient_recv(bscryptClient *client, bscryptClient_response *response)
+{
+	uint8_t  *header = client->buffer;
+	uint32_t  size;
+
+	if (client->fd == -1 || bscryptClient_readAll(client->fd, header, BSCRYPTD_HEADER_SIZE))
+	{
+		return 1;
+	}
+	size = readUint32Le(header);
+	if (size > BSCRYPTD_MAX_PAYLOAD ||
+		bscryptClient_readAll(client->fd, header + BSCRYPTD_HEADER_SIZE, size))
+	{
+		close(client->fd);
+		client->fd = -1;
+		return 1;
+	}
+
+	response->id         = readUint32Le(header + 4);
+	response->op         = header[8];
+	response->status     = header[9];
+	response->waiting    = (uint32_t) header[10] | ((uint32_t) header[11] << 8);
+	response->queueDepth = readUint32Le(header + 12);
+	response->result     = 0;
+	response->hash[0]    = 0;
+	if (response->status == BSCRYPTD_STATUS_OK)
+	{
+		if (response->op == BSCRYPTD_OP_HASH && size < BSCRYPTD_HASH_MAX_SIZE)
+		{
+			memcpy(response->hash, header + BSCRYPTD_HEADER_SIZE, size);
+			response->hash[size] = 0;
+		}
+		else if (size >= 1)
+		{
+			response->result = header[BSCRYPTD_HEADER_SIZE] != 0;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Sends a request and waits for its response.
+ *
+ * @return On success 0, otherwise non-zero.
+ */
+static int bscryptClient_wait(bscryptClient *client, uint32_t id, bscryptClient_response *response)
+{
+	if (bscryptClient_recv(client, response) || response->id != id)
+	{
+		return 1;
+	}
+	return response->status != BSCRYPTD_STATUS_OK;
+}
+
+/**
+ * Pings the daemon.
+ *
+ * @param bscryptClient *client     - The client.
+ * @param uint32_t      *queueDepth - Optional. Receives the daemon's queue depth.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscryptClient_ping(bscryptClient *client, uint32_t *queueDepth)
+{
+	bscryptClient_response response;
+	uint32_t               id = client->nextId++;
+
+	if (bscryptClient_sendPing(client, id) || bscryptClient_wait(client, id, &response))
+	{
+		return 1;
+	}
+	if (queueDepth != NULL)
+	{
+		*queueDepth = response.queueDepth;
+	}
+	return 0;
+}
+
+/**
+ * Generates a bscrypt hash on the daemon.
+ *
+ * @param bscryptClient *client       - The client.
+ * @param char           hash[BSCRYPTD_HASH_MAX_SIZE] - The hash.
+ * @param const void    *password     - The password.
+ * @param size_t         passwordSize - Size of the password.
+ * @param uint32_t       memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t       iterations   - The number of iterations (t).
+ * @param uint32_t       parallelism  - The amount of parallelism (p).
+ * @return On success 0, otherwise non-zero.
+ */
+int bscryptClient_hash(bscryptClient *client, char hash[BSCRYPTD_HASH_MAX_SIZE], const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+{
+	bscryptClient_response response;
+	uint32_t               id = client->nextId++;
+
+	hash[0] = 0;
+	if (bscryptClient_sendHash(client, id, password, passwordSize, memoryKiB, iterations, parallelism) ||
+		bscryptClient_wait(client, id, &response))
+	{
+		return 1;
+	}
+	memcpy(hash, response.hash, BSCRYPTD_HASH_MAX_SIZE);
+	return 0;
+}
+
+/**
+ * Verifies a password against a bscrypt hash on the daemon.
+ *
+ * @param bscryptClient *client       - The client.
+ * @param const char    *hash         - The hash.
+ * @param const void    *password     - The password.
+ * @param size_t         passwordSize - Size of the password.
+ * @return On correct password, non-zero. Otherwise, 0.
+ */
+int bscryptClient_verify(bscryptClient *client, const char *hash, const void *password, size_t passwordSize)
+{
+	bscryptClient_response response;
+	uint32_t               id = client->nextId++;
+
+	if (bscryptClient_sendVerify(client, id, hash, password, passwordSize) ||
+		bscryptClient_wait(client, id, &response))
+	{
+		return 0;
+	}
+	return response.result;
+}
+
+/**
+ * Checks if the hash needs to be upgraded on the daemon.
+ *
+ * @param bscryptClient *client      - The client.
+ * @param const char    *hash        - The hash.
+ * @param uint32_t       memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t       iterations  - The number of iterations (t).
+ * @param uint32_t       parallelism - The amount of parallelism (p).
+ * @return If upgrade needed or on error, non-zero. Otherwise, 0.
+ */
+int bscryptClient_needsRehash(bscryptClient *client, const char *hash, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+{
+	bscryptClient_response response;
+	uint32_t               id = client->nextId++;
+
+	if (bscryptClient_sendNeedsRehash(client, id, hash, memoryKiB, iterations, parallelism) ||
+		bscryptClient_wait(client, id, &response))
+	{
+		return 1;
+	}
+	return response.result;
+}
+
+static void bscryptClientPool_down(bscryptClientPool_daemon *daemon)
+{
+	bscryptClient_close(daemon->client);
+	daemon->client     = NULL;
+	daemon->queueDepth = 0;
+	daemon->abandoned  = 0;
+	daemon->retryUs    = getTimeUs() + BSCRYPTCLIENTPOOL_RETRY_US;
+}
+
+/**
+ * Reads any responses that are waiting for requests we gave up on. This keeps
+ * their queue depths fresh and stops them from backing up.
+ */
+static void bscryptClientPool_drain(bscryptClientPool *pool)
+{
+	for (uint32_t i = 0; i < pool->numDaemons; i++)
+	{
+		bscryptClientPool_daemon *daemon = pool->daemons + i;
+
+		while (daemon->client != NULL && daemon->abandoned > 0)
+		{
+			bscryptClient_response response;
+			pollfd                 fd;
+
+			fd.fd      = daemon->client->fd;
+			fd.events  = POLLIN;
+			fd.revents = 0;
+			if (poll(&fd, 1, 0) != 1)
+			{
+				break;
+			}
+			if (bscryptClient_recv(daemon->client, &response))
+			{
+				bscryptClientPool_down(daemon);
+				break;
+			}
+			daemon->queueDepth = response.queueDepth;
+			daemon->abandoned--;
+		}
+	}
+}
+
+/**
+ * Picks the least loaded daemon that hasn't been tried for this request.
+ * Load is the last queue depth it reported plus what we left on it. Ties are
+ * rotated so an idle pool still spreads out.
+ *
+ * @return On success the daemon, otherwise NULL.
+ */
+static bscryptClientPool_daemon *bscryptClientPool_pick(bscryptClientPool *pool, uint32_t id)
+{
+	bscryptClientPool_daemon *best     = NULL;
+	uint64_t                  bestLoad = 0;
+	uint64_t                  now      = 0;
+
+	pool->rotate++;
+	for (uint32_t i = 0; i < pool->numDaemons; i++)
+	{
+		bscryptClientPool_daemon *daemon = pool->daemons + (pool->rotate + i) % pool->numDaemons;
+		uint64_t                  load;
+
+		if (daemon->triedId == id)
+		{
+			continue;
+		}
+		if (daemon->client == NULL)
+		{
+			if (now == 0)
+			{
+				now = getTimeUs();
+			}
+			if (now < daemon->retryUs)
+			{
+				continue;
+			}
+			daemon->client = bscryptClient_connect(daemon->path);
+			if (daemon->client == NULL)
+			{
+				daemon->retryUs = now + BSCRYPTCLIENTPOOL_RETRY_US;
+				continue;
+			}
+		}
+		load = (uint64_t) daemon->queueDepth + daemon->abandoned;
+		if (best == NULL || load < bestLoad)
+		{
+			best     = daemon;
+			bestLoad = load;
+		}
+	}
+	return best;
+}
+
+/**
+ * Sends the request to the least loaded daemon that hasn't had it yet.
+ *
+ * @return On success the daemon, otherwise NULL.
+ */
+static bscryptClientPool_daemon *bscryptClientPool_send(bscryptClientPool *pool, uint32_t id, const bscryptClientPool_request *request)
+{
+	bscryptClientPool_daemon *daemon;
+
+	while ((daemon = bscryptClientPool_pick(pool, id)) != NULL)
+	{
+		int ret;
+
+		daemon->triedId = id;
+		if (request->op == BSCRYPTD_OP_HASH)
+		{
+			ret = bscryptClient_sendHash(daemon->client, id, request->password, request->passwordSize, request->memoryKiB, request->iterations, request->parallelism);
+		}
+		else if (request->op == BSCRYPTD_OP_VERIFY)
+		{
+			ret = bscryptClient_sendVerify(daemon->client, id, request->hash, request->password, request->passwordSize);
+		}
+		else
+		{
+			ret = bscryptClient_sendNeedsRehash(daemon->client, id, request->hash, request->memoryKiB, request->iterations, request->parallelism);
+		}
+		if (ret == 0)
+		{
+			break;
+		}
+		bscryptClientPool_down(daemon);
+	}
+	return daemon;
+}
+
+/**
+ * Runs a request on the least loaded daemon. If it hasn't answered after
+ * hedgeAfterMs, the daemon is pinged. Only if the ping shows requests still
+ * waiting to start is the request also sent to the next least loaded daemon,
+ * and the first answer wins. With nothing waiting the request is running and
+ * a second copy would only finish later and add load. Daemons that fail or are
+ * busy are skipped.
+ *
+ * @return On success 0, otherwise non-zero.
+ */
+static int bscryptClientPool_run(bscryptClientPool *pool, const bscryptClientPool_request *request, bscryptClient_response *response)
+{
+	bscryptClientPool_daemon *used[2];
+	bscryptClientPool_daemon *pinged  = NULL; // Owes us a ping response
+	uint32_t                  numUsed = 0;
+	uint32_t                  id      = pool->nextId++;
+	uint64_t                  hedgeUs = 0;
+
+	pool->stats.requests++;
+	bscryptClientPool_drain(pool);
+	for (uint32_t i = 0; i < pool->numDaemons; i++)
+	{
+		// Request ids wrap so make sure nothing looks tried
+		if (pool->daemons[i].triedId == id)
+		{
+			pool->daemons[i].triedId = id - 1;
+		}
+	}
+
+	used[0] = bscryptClientPool_send(pool, id, request);
+	if (used[0] == NULL)
+	{
+		return 1;
+	}
+	numUsed = 1;
+	if (pool->hedgeAfterMs > 0)
+	{
+		hedgeUs = getTimeUs() + (uint64_t) pool->hedgeAfterMs * 1000;
+	}
+
+	while (numUsed > 0)
+	{
+		pollfd fds[2];
+		int    timeoutMs = -1;
+		int    hedge     = 0;
+		int    num;
+
+		if (hedgeUs != 0)
+		{
+			uint64_t now = getTimeUs();
+
+			timeoutMs = now >= hedgeUs ? 0 : (int) ((hedgeUs - now + 999) / 1000);
+		}
+		for (uint32_t i = 0; i < numUsed; i++)
+		{
+			fds[i].fd      = used[i]->client->fd;
+			fds[i].events  = POLLIN;
+			fds[i].revents = 0;
+		}
+		num = poll(fds, numUsed, timeoutMs);
+		if (num < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		if (num == 0)
+		{
+			// Ask if it's still queued. The ping is answered right away.
+			hedgeUs = 0;
+			if (bscryptClient_sendPing(used[0]->client, id) == 0)
+			{
+				pinged = used[0];
+			}
+			else
+			{
+				hedge = 1;
+			}
+		}
+
+		for (uint32_t i = 0; i < numUsed; i++)
+		{
+			bscryptClientPool_daemon *daemon     = used[i];
+			int                       badRequest = 0;
+
+			if (fds[i].revents == 0)
+			{
+				continue;
+			}
+			if (bscryptClient_recv(daemon->client, response))
+			{
+				if (daemon == pinged)
+				{
+					pinged = NULL;
+				}
+				bscryptClientPool_down(daemon);
+			}
+			else
+			{
+				daemon->queueDepth = response->queueDepth;
+				if (response->id == id && response->op == BSCRYPTD_OP_PING && daemon == pinged)
+				{
+					pinged = NULL;
+					hedge  = response->waiting > 0;
+					continue;
+				}
+				if (response->id != id)
+				{
+					// An abandoned response
+					if (daemon->abandoned > 0)
+					{
+						daemon->abandoned--;
+					}
+					continue;
+				}
+				if (response->status == BSCRYPTD_STATUS_OK)
+				{
+					if (i > 0)
+					{
+						pool->stats.hedgeWins++;
+					}
+					// Nobody is waiting on the others or the ping
+					for (uint32_t j = 0; j < numUsed; j++)
+					{
+						if (j != i)
+						{
+							used[j]->abandoned++;
+						}
+					}
+					if (pinged != NULL)
+					{
+						pinged->abandoned++;
+					}
+					return 0;
+				}
+				badRequest = response->status == BSCRYPTD_STATUS_BAD_REQUEST;
+			}
+
+			// A bad request fails everywhere, otherwise try somewhere else
+			if (daemon == pinged)
+			{
+				daemon->abandoned++;
+				pinged = NULL;
+			}
+			used[i] = used[--numUsed];
+			fds[i]  = fds[numUsed];
+			i--;
+			if (badRequest)
+			{
+				for (uint32_t j = 0; j < numUsed; j++)
+				{
+					used[j]->abandoned++;
+				}
+				if (pinged != NULL)
+				{
+					pinged->abandoned++;
+				}
+				return 1;
+			}
+			if (numUsed == 0)
+			{
+				used[0] = bscryptClientPool_send(pool, id, request);
+				if (used[0] != NULL)
+				{
+					numUsed = 1;
+					pool->stats.failovers++;
+				}
+			}
+		}
+
+		if (hedge && numUsed == 1)
+		{
+			used[1] = bscryptClientPool_send(pool, id, request);
+			if (used[1] != NULL)
+			{
+				numUsed = 2;
+				pool->stats.hedged++;
+			}
+		}
+	}
+	if (pinged != NULL)
+	{
+		pinged->abandoned++;
+	}
+	return 1;
+}
+
+/**
+ * Connects to several daemons. Requests go to the one reporting the smallest
+ * queue and are hedged to a second one when they wait too long to start.
+ * Daemons that are down are skipped and retried later. This is for one thread
+ * at a time.
+ *
+ * @param const char *const *paths        - Socket paths.
+ * @param uint32_t           numPaths     - Number of paths.
+ * @param uint32_t           hedgeAfterMs - Send to a second daemon if there's no response after this many ms and it still has requests waiting to start. 0 to never hedge.
+ * @return On success a pool, otherwise NULL.
+ */
+bscryptClientPool *bscryptClientPool_create(const char *const *paths, uint32_t numPaths, uint32_t hedgeAfterMs)
+{
+	bscryptClientPool *pool;
+
+	if (numPaths == 0)
+	{
+		return NULL;
+	}
+	pool = new bscryptClientPool;
+	pool->daemons      = new bscryptClientPool_daemon[numPaths];
+	pool->numDaemons   = numPaths;
+	pool->hedgeAfterMs = hedgeAfterMs;
+	pool->nextId       = 1;
+	pool->rotate       = 0;
+	memset(&pool->stats, 0, sizeof(pool->stats));
+	for (uint32_t i = 0; i < numPaths; i++)
+	{
+		size_t size = strlen(paths[i]) + 1;
+
+		pool->daemons[i].path       = new char[size];
+		memcpy(pool->daemons[i].path, paths[i], size);
+		pool->daemons[i].client     = bscryptClient_connect(paths[i]);
+		pool->daemons[i].queueDepth = 0;
+		pool->daemons[i].abandoned  = 0;
+		pool->daemons[i].triedId    = 0;
+		pool->daemons[i].retryUs    = getTimeUs() + BSCRYPTCLIENTPOOL_RETRY_US;
+	}
+	return pool;
+}
+
+/**
+ * Closes all connections and frees the pool.
+ *
+ * @param bscryptClientPool *pool - The pool.
+ */
+void bscryptClientPool_destroy(bscryptClientPool *pool)
+{
+	if (pool != NULL)
+	{
+		for (uint32_t i = 0; i < pool->numDaemons; i++)
+		{
+			bscryptClient_close(pool->daemons[i].client);
+			delete [] pool->daemons[i].path;
+		}
+		delete [] pool->daemons;
+		delete pool;
+	}
+}
+
+/**
+ * Gets counts of requests, hedges and failovers.
+ *
+ * @param bscryptClientPool       *pool  - The pool.
+ * @param bscryptClientPool_stats *stats - Receives the stats.
+ */
+void bscryptClientPool_getStats(bscryptClientPool *pool, bscryptClientPool_stats *stats)
+{
+	*stats = pool->stats;
+}
+
+/**
+ * Generates a bscrypt hash on the least loaded daemon.
+ *
+ * @param bscryptClientPool *pool         - The pool.
+ * @param char               hash[BSCRYPTD_HASH_MAX_SIZE] - The hash.
+ * @param const void        *password     - The password.
+ * @param size_t             passwordSize - Size of the password.
+ * @param uint32_t           memoryKiB    - The size of the sboxes in KiB (m).
+ * @param uint32_t           iterations   - The number of iterations (t).
+ * @param uint32_t           parallelism  - The amount of parallelism (p).
+ * @return On success 0, otherwise non-zero.
+ */
+int bscryptClientPool_hash(bscryptClientPool *pool, char hash[BSCRYPTD_HASH_MAX_SIZE], const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+{
+	bscryptClientPool_request request = {BSCRYPTD_OP_HASH, NULL, password, passwordSize, memoryKiB, iterations, parallelism};
+	bscryptClient_response    response;
+
+	hash[0] = 0;
+	if (bscryptClientPool_run(pool, &request, &response))
+	{
+		return 1;
+	}
+	memcpy(hash, response.hash, BSCRYPTD_HASH_MAX_SIZE);
+	return 0;
+}
+
+/**
+ * Verifies a password against a bscrypt hash on the least loaded daemon.
+ *
+ * @param bscryptClientPool *pool         - The pool.
+ * @param const char        *hash         - The hash.
+ * @param const void        *password     - The password.
+ * @param size_t             passwordSize - Size of the password.
+ * @return On correct password, non-zero. Otherwise, 0.
+ */
+int bscryptClientPool_verify(bscryptClientPool *pool, const char *hash, const void *password, size_t passwordSize)
+{
+	bscryptClientPool_request request = {BSCRYPTD_OP_VERIFY, hash, password, passwordSize, 0, 0, 0};
+	bscryptClient_response    response;
+
+	if (bscryptClientPool_run(pool, &request, &response))
+	{
+		return 0;
+	}
+	return response.result;
+}
+
+/**
+ * Checks if the hash needs to be upgraded on the least loaded daemon.
+ *
+ * @param bscryptClientPool *pool        - The pool.
+ * @param const char        *hash        - The hash.
+ * @param uint32_t           memoryKiB   - The size of the sboxes in KiB (m).
+ * @param uint32_t           iterations  - The number of iterations (t).
+ * @param uint32_t           parallelism - The amount of parallelism (p).
+ * @return If upgrade needed or on error, non-zero. Otherwise, 0.
+ */
+int bscryptClientPool_needsRehash(bscryptClientPool *pool, const char *hash, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+{
+	bscryptClientPool_request request = {BSCRYPTD_OP_REHASH, hash, NULL, 0, memoryKiB, iterations, parallelism};
+	bscryptClient_response    response;
+
+	if (bscryptClientPool_run(pool, &request, &response))
+	{
+		return 1;
+	}
+	return response.result;
+}
+
+#endif
@@ -0,0 +1,87 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#pragma once
+
+// Client for bscryptd. This has a C interface so it can be used from C and
+// wrapped by other languages.
+//
+// Blocking:
+//   bscryptClient_hash(), bscryptClient_verify(), bscryptClient_needsRehash()
+//
+// Pipelined:
+//   Call bscryptClient_send*() any number of times with your own ids then
+//   bscryptClient_recv() once per request. Responses come back in the order
+//   they finish. Don't let too many go unread or the daemon stops reading
+//   your requests. Don't mix this with the blocking functions.
+//
+// Several daemons:
+//   bscryptClientPool_create() connects to a list of daemons. Each request
+//   goes to the daemon with the shortest queue (from the queue depth in its
+//   responses). If the first hasn't answered in time and still has requests
+//   waiting to start, it's hedged to a second daemon. Use one pool per thread.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bscryptd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct bscryptClient bscryptClient;
+
+typedef struct bscryptClient_response
+{
+	uint32_t id;
+	uint8_t  op;
+	uint8_t  status;
+	uint32_t waiting;
+	uint32_t queueDepth;
+	int      result;
+	char     hash[BSCRYPTD_HASH_MAX_SIZE];
+} bscryptClient_response;
+
+typedef struct bscryptClientPool bscryptClientPool;
+
+typedef struct bscryptClientPool_stats
+{
+	uint64_t requests;
+	uint64_t hedged;    // Sent to a second daemon
+	uint64_t hedgeWins; // The second daemon answered first
+	uint64_t failovers; // Resent after a daemon failed or was busy
+} bscryptClientPool_stats;
+
+bscryptClient *bscryptClient_connect(const char *path);
+void bscryptClient_close(bscryptClient *client);
+
+int bscryptClient_sendPing(bscryptClient *client, uint32_t id);
+int bscryptClient_sendHash(bscryptClient *client, uint32_t id, const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism);
+int bscryptClient_sendVerify(bscryptClient *client, uint32_t id, const char *hash, const void *password, size_t passwordSize);
+int bscryptClient_sendNeedsRehash(bscryptClient *client, uint32_t id, const char *hash, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism);
+int bscryptClient_recv(bscryptClient *client, bscryptClient_response *response);
+
+int bscryptClient_ping(bscryptClient *client, uint32_t *queueDepth);
+int bscryptClient_hash(bscryptClient *client, char hash[BSCRYPTD_HASH_MAX_SIZE], const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism);
+int bscryptClient_verify(bscryptClient *client, const char *hash, const void *password, size_t passwordSize);
+int bscryptClient_needsRehash(bscryptClient *client, const char *hash, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism);
+
+bscryptClientPool *bscryptClientPool_create(const char *const *paths, uint32_t numPaths, uint32_t hedgeAfterMs);
+void bscryptClientPool_destroy(bscryptClientPool *pool);
+void bscryptClientPool_getStats(bscryptClientPool *pool, bscryptClientPool_stats *stats);
+int  bscryptClientPool_hash(bscryptClientPool *pool, char hash[BSCRYPTD_HASH_MAX_SIZE], const void *password, size_t passwordSize, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism);
+int  bscryptClientPool_verify(bscryptClientPool *pool, const char *hash, const void *password, size_t passwordSize);
+int  bscryptClientPool_needsRehash(bscryptClientPool *pool, const char *hash, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism);
+
+#ifdef __cplusplus
+}
+#endif
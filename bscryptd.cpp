@@ -0,0 +1,1093 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+// bscryptd: one hashing scheduler per host. Services talk to it over a Unix
+// domain socket (see bscryptd.h) instead of each embedding bscrypt with its
+// own threads. All work runs on one bscrypt_ctx, so there is one worker pool
+// and one sbox cache. Requests wait in a FIFO until their memory fits in the
+// budget. Requests from the shared memory ring (-r, see bscryptring.h) are
+// taken by one thread and join the same FIFO.
+//
+// bscryptd [-s socketPath] [-m socketMode] [-w workers] [-b budgetMiB] [-M maxMemoryKiB]
+//          [-T maxIterations] [-P maxParallelism] [-q maxQueued]
+
+#include <stdio.h>
+
+#ifdef _WIN32
+
+int main()
+{
+	fprintf(stderr, "bscryptd needs Unix domain sockets\n");
+	return 1;
+}
+
+#else
+
+#include "bscryptd.h"
+#include "bscryptring.h"
+#include "bscrypt.h"
+#include "common.h"
+#include "threads.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Stop reading from a connection with this many requests in flight
+const uint32_t BSCRYPTD_CONN_MAX_OUTSTANDING = 1024;
+// Stop reading from a connection that isn't reading its responses
+const size_t   BSCRYPTD_CONN_MAX_OUT        = 1024 * 1024;
+
+struct bscryptd;
+struct bscryptd_conn;
+
+struct bscryptd_request
+{
+	bscrypt_async     job;
+	bscryptd         *daemon;
+	bscryptd_conn    *conn; // NULL for ring requests
+	bscryptRing_slot *slot; // Ring requests only
+	bscryptd_request *next;
+	uint32_t          id;
+	uint8_t           op;
+	uint32_t          memoryKiB;
+	uint32_t          iterations;
+	uint32_t          parallelism;
+	char              hash[BSCRYPT_HASH_MAX_SIZE];
+	uint8_t          *password;
+	size_t            passwordSize;
+};
+
+struct bscryptd_conn
+{
+	int            fd;
+	uint8_t       *in;
+	size_t         inSize;
+	uint8_t       *out;
+	size_t         outSize;
+	size_t         outCap;
+	uint32_t       outstanding;
+	bscryptd_conn *next;
+};
+
+struct bscryptd
+{
+	bscrypt_ctx       ctx;
+	int               listenFd;
+	int               notifyFds[2];
+	bscryptd_conn    *conns;
+	uint32_t          numConns;
+
+	// Waiting for memory
+	bscryptd_request *pendingHead;
+	bscryptd_request *pendingTail;
+	uint32_t          pending;
+	uint32_t          maxPending;
+
+	// Running on the workers
+	uint32_t          running;
+	uint32_t          maxRunning;
+	uint64_t          runningKiB;
+	uint64_t          budgetKiB;
+
+	// Finished by a worker or taken from the ring and waiting for the event loop
+	MUTEX             doneMutex;
+	bscryptd_request *done;
+	bscryptd_request *ringTaken;
+	bscryptRing      *ring;
+};
+
+static volatile sig_atomic_t bscryptd_stop = 0;
+
+static void bscryptd_onSignal(int sig)
+{
+	(void) sig;
+	bscryptd_stop = 1;
+}
+
+static void writeUint32Le(uint8_t *out, uint32_t num)
+{
+	out[0] = (uint8_t)  num;
+	out[1] = (uint8_t) (num >>  8);
+	out[2] = (uint8_t) (num >> 16);
+	out[3] = (uint8_t) (num >> 24);
+}
+
+static uint32_t readUint32Le(const uint8_t *in)
+{
+	return
+		 (uint32_t) in[0]        |
+		((uint32_t) in[1] <<  8) |
+		((uint32_t) in[2] << 16) |
+		((uint32_t) in[3] << 24);
+}
+
+static int bscryptd_setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+static void bscryptd_connClose(bscryptd *daemon, bscryptd_conn *conn)
+{
+	if (conn->fd != -1)
+	{
+		close(conn->fd);
+		conn->fd = -1;
+		daemon->numConns--;
+	}
+}
+
+static void bscryptd_connFlush(bscryptd *daemon, bscryptd_conn *conn)
+{
+	while (conn->fd != -1 && conn->outSize > 0)
+	{
+		ssize_t size = write(conn->fd, conn->out, conn->outSize);
+
+		if (size < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				bscryptd_connClose(daemon, conn);
+			}
+			break;
+		}
+		conn->outSize -= (size_t) size;
+		memmove(conn->out, conn->out + size, conn->outSize);
+	}
+}
+
+static void bscryptd_respond(bscryptd *daemon, bscryptd_conn *conn, uint32_t id, uint8_t op, uint8_t status, const void *payload, uint32_t payloadSize)
+{
+	uint8_t *header;
+	uint32_t waiting = daemon->pending < 0xffff ? daemon->pending : 0xffff;
+
+	if (conn->fd == -1)
+	{
+		return;
+	}
+
+	// Grow
+	if (conn->outSize + BSCRYPTD_HEADER_SIZE + payloadSize > conn->outCap)
+	{
+		size_t   cap = 2 * (conn->outSize + BSCRYPTD_HEADER_SIZE + payloadSize);
+		uint8_t *out = new uint8_t[cap];
+
+		memcpy(out, conn->out, conn->outSize);
+		delete [] conn->out;
+		conn->out    = out;
+		conn->outCap = cap;
+	}
+
+	header = conn->out + conn->outSize;
+	writeUint32Le(header, payloadSize);
+	writeUint32Le(header + 4, id);
+	header[8]  = op;
+	header[9]  = status;
+	header[10] = (uint8_t) (waiting     );
+	header[11] = (uint8_t) (waiting >> 8);
+	writeUint32Le(header + 12, daemon->pending + daemon->running);
+	memcpy(header + BSCRYPTD_HEADER_SIZE, payload, payloadSize);
+	conn->outSize += BSCRYPTD_HEADER_SIZE + payloadSize;
+
+	bscryptd_connFlush(daemon, conn);
+}
+
+static void bscryptd_requestFree(bscryptd_request *req)
+{
+	if (req->password != NULL)
+	{
+		secureClearMemory(req->password, req->passwordSize);
+		delete [] req->password;
+	}
+	secureClearMemory(req->hash, sizeof(req->hash));
+	if (req->conn != NULL)
+	{
+		req->conn->outstanding--;
+	}
+	delete req;
+}
+
+/**
+ * Answers a request that isn't running and frees it.
+ */
+static void bscryptd_fail(bscryptd *daemon, bscryptd_request *req, uint8_t status)
+{
+	if (req->slot != NULL)
+	{
+		req->slot->status = status;
+		req->slot->result = 0;
+		bscryptRing_complete(daemon->ring, &req->slot, 1);
+	}
+	else if (req->conn != NULL)
+	{
+		bscryptd_respond(daemon, req->conn, req->id, req->op, status, NULL, 0);
+	}
+	bscryptd_requestFree(req);
+}
+
+/**
+ * Called by a worker when a job is done. The event loop is woken by the 8
+ * bytes the library writes to notifyFds[1] afterward.
+ */
+static void bscryptd_jobDone(bscrypt_async *job)
+{
+	bscryptd_request *req    = (bscryptd_request*) job->user;
+	bscryptd         *daemon = req->daemon;
+
+	MUTEX_LOCK(daemon->doneMutex);
+	req->next    = daemon->done;
+	daemon->done = req;
+	MUTEX_UNLOCK(daemon->doneMutex);
+}
+
+static void bscryptd_finish(bscryptd *daemon, bscryptd_request *req)
+{
+	if (req->slot != NULL)
+	{
+		bscryptRing_slot *slot = req->slot;
+
+		slot->status = BSCRYPTD_STATUS_OK;
+		slot->result = 0;
+		if (req->op == BSCRYPTD_OP_HASH)
+		{
+			if (req->job.result == 0)
+			{
+				memcpy(slot->hash, req->job.hash, sizeof(slot->hash));
+			}
+			else
+			{
+				slot->status = BSCRYPTD_STATUS_FAILED;
+			}
+		}
+		else
+		{
+			slot->result = req->job.result != 0;
+		}
+		bscryptRing_complete(daemon->ring, &slot, 1);
+	}
+	else if (req->op == BSCRYPTD_OP_HASH)
+	{
+		if (req->job.result == 0)
+		{
+			bscryptd_respond(daemon, req->conn, req->id, req->op, BSCRYPTD_STATUS_OK, req->job.hash, (uint32_t) strlen(req->job.hash));
+		}
+		else
+		{
+			bscryptd_respond(daemon, req->conn, req->id, req->op, BSCRYPTD_STATUS_FAILED, NULL, 0);
+		}
+	}
+	else
+	{
+		uint8_t result = req->job.result != 0;
+
+		bscryptd_respond(daemon, req->conn, req->id, req->op, BSCRYPTD_STATUS_OK, &result, 1);
+	}
+	bscryptd_requestFree(req);
+}
+
+/**
+ * Starts pending requests while there are free workers and their memory fits
+ * in the budget. One request always runs so an oversized one can't stall.
+ */
+static void bscryptd_dispatch(bscryptd *daemon)
+{
+	while (daemon->pendingHead != NULL && daemon->running < daemon->maxRunning)
+	{
+		bscryptd_request *req = daemon->pendingHead;
+		int               ret;
+
+		if (daemon->running > 0 && daemon->runningKiB + req->memoryKiB > daemon->budgetKiB)
+		{
+			break;
+		}
+		daemon->pendingHead = req->next;
+		if (daemon->pendingHead == NULL)
+		{
+			daemon->pendingTail = NULL;
+		}
+		daemon->pending--;
+
+		bscrypt_asyncInit(&req->job, bscryptd_jobDone, req, daemon->notifyFds[1]);
+		if (req->op == BSCRYPTD_OP_HASH)
+		{
+			ret = bscrypt_ctxHashAsync(&daemon->ctx, &req->job, req->password, req->passwordSize, req->memoryKiB, req->iterations, req->parallelism);
+		}
+		else
+		{
+			ret = bscrypt_ctxVerifyAsync(&daemon->ctx, &req->job, req->hash, req->password, req->passwordSize);
+		}
+		if (ret)
+		{
+			bscryptd_fail(daemon, req, BSCRYPTD_STATUS_FAILED);
+			continue;
+		}
+		daemon->running++;
+		daemon->runningKiB += req->memoryKiB;
+	}
+}
+
+/**
+ * Queues a request or answers BSCRYPTD_STATUS_BUSY if the queue is full.
+ */
+static void bscryptd_enqueue(bscryptd *daemon, bscryptd_request *req)
+{
+	if (daemon->pending >= daemon->maxPending || bscryptd_stop)
+	{
+		bscryptd_fail(daemon, req, bscryptd_stop ? BSCRYPTD_STATUS_FAILED : BSCRYPTD_STATUS_BUSY);
+		return;
+	}
+	if (daemon->pendingTail == NULL)
+	{
+		daemon->pendingHead = req;
+	}
+	else
+	{
+		daemon->pendingTail->next = req;
+	}
+	daemon->pendingTail = req;
+	daemon->pending++;
+}
+
+static void bscryptd_drainDone(bscryptd *daemon)
+{
+	bscryptd_request *done;
+	bscryptd_request *taken;
+	bscryptd_request *ordered = NULL;
+	uint8_t           buffer[256];
+
+	while (read(daemon->notifyFds[0], buffer, sizeof(buffer)) > 0)
+	{
+	}
+
+	MUTEX_LOCK(daemon->doneMutex);
+	done              = daemon->done;
+	taken             = daemon->ringTaken;
+	daemon->done      = NULL;
+	daemon->ringTaken = NULL;
+	MUTEX_UNLOCK(daemon->doneMutex);
+
+	// Oldest first
+	while (done != NULL)
+	{
+		bscryptd_request *next = done->next;
+
+		done->next = ordered;
+		ordered    = done;
+		done       = next;
+	}
+	while (ordered != NULL)
+	{
+		bscryptd_request *next = ordered->next;
+
+		daemon->running--;
+		daemon->runningKiB -= ordered->memoryKiB;
+		bscryptd_finish(daemon, ordered);
+		ordered = next;
+	}
+
+	// Ring requests, oldest first
+	while (taken != NULL)
+	{
+		bscryptd_request *next = taken->next;
+
+		taken->next = ordered;
+		ordered     = taken;
+		taken       = next;
+	}
+	while (ordered != NULL)
+	{
+		bscryptd_request *next = ordered->next;
+
+		ordered->next = NULL;
+		bscryptd_enqueue(daemon, ordered);
+		bscryptd_dispatch(daemon);
+		ordered = next;
+	}
+	bscryptd_dispatch(daemon);
+}
+
+/**
+ * Handles one request.
+ *
+ * @return On success 0, otherwise non-zero and the connection should be closed.
+ */
+static int bscryptd_handle(bscryptd *daemon, bscryptd_conn *conn, const uint8_t *header, const uint8_t *payload, uint32_t payloadSize)
+{
+	bscrypt_params    params;
+	bscryptd_request *req;
+	uint32_t          id        = readUint32Le(header + 4);
+	uint8_t           op        = header[8];
+	const uint8_t    *password  = NULL;
+	size_t            passwordSize = 0;
+
+	if (op == BSCRYPTD_OP_PING)
+	{
+		bscryptd_respond(daemon, conn, id, op, BSCRYPTD_STATUS_OK, NULL, 0);
+		return 0;
+	}
+	if (op != BSCRYPTD_OP_HASH && op != BSCRYPTD_OP_VERIFY && op != BSCRYPTD_OP_REHASH)
+	{
+		bscryptd_respond(daemon, conn, id, op, BSCRYPTD_STATUS_BAD_REQUEST, NULL, 0);
+		return 0;
+	}
+
+	req = new bscryptd_request;
+	req->daemon       = daemon;
+	req->conn         = conn;
+	req->slot         = NULL;
+	req->next         = NULL;
+	req->id           = id;
+	req->op           = op;
+	req->memoryKiB    = 0;
+	req->iterations   = 0;
+	req->parallelism  = 0;
+	req->hash[0]      = 0;
+	req->password     = NULL;
+	req->passwordSize = 0;
+	conn->outstanding++;
+
+	if (op == BSCRYPTD_OP_VERIFY)
+	{
+		uint32_t hashSize;
+
+		if (payloadSize < 4 ||
+			(hashSize = readUint32Le(payload)) >= BSCRYPT_HASH_MAX_SIZE ||
+			hashSize > payloadSize - 4)
+		{
+			bscryptd_respond(daemon, conn, id, op, BSCRYPTD_STATUS_BAD_REQUEST, NULL, 0);
+			bscryptd_requestFree(req);
+			return 0;
+		}
+		memcpy(req->hash, payload + 4, hashSize);
+		req->hash[hashSize] = 0;
+		password     = payload + 4 + hashSize;
+		passwordSize = payloadSize - 4 - hashSize;
+
+		// Need m for the memory budget
+		if (bscrypt_parseHash(&params, req->hash))
+		{
+			bscryptd_respond(daemon, conn, id, op, BSCRYPTD_STATUS_BAD_REQUEST, NULL, 0);
+			bscryptd_requestFree(req);
+			return 0;
+		}
+		req->memoryKiB = params.memoryKiB;
+		secureClearMemory(&params, sizeof(params));
+	}
+	else
+	{
+		if (payloadSize < 12)
+		{
+			bscryptd_respond(daemon, conn, id, op, BSCRYPTD_STATUS_BAD_REQUEST, NULL, 0);
+			bscryptd_requestFree(req);
+			return 0;
+		}
+		req->memoryKiB   = readUint32Le(payload);
+		req->iterations  = readUint32Le(payload + 4);
+		req->parallelism = readUint32Le(payload + 8);
+
+		if (op == BSCRYPTD_OP_REHASH)
+		{
+			uint8_t result;
+
+			// Cheap so answer now
+			if (payloadSize - 12 >= BSCRYPT_HASH_MAX_SIZE)
+			{
+				bscryptd_respond(daemon, conn, id, op, BSCRYPTD_STATUS_BAD_REQUEST, NULL, 0);
+				bscryptd_requestFree(req);
+				return 0;
+			}
+			memcpy(req->hash, payload + 12, payloadSize - 12);
+			req->hash[payloadSize - 12] = 0;
+			result = bscrypt_needsRehash(req->hash, req->memoryKiB, req->iterations, req->parallelism) != 0;
+			bscryptd_respond(daemon, conn, id, op, BSCRYPTD_STATUS_OK, &result, 1);
+			bscryptd_requestFree(req);
+			return 0;
+		}
+		password     = payload + 12;
+		passwordSize = payloadSize - 12;
+		if (req->memoryKiB < MEMORY_KIB_MIN)
+		{
+			req->memoryKiB = MEMORY_KIB_MIN;
+		}
+	}
+
+	if (daemon->pending >= daemon->maxPending)
+	{
+		bscryptd_fail(daemon, req, BSCRYPTD_STATUS_BUSY);
+		return 0;
+	}
+
+	// Copy the password since the input buffer is reused
+	req->password     = new uint8_t[passwordSize + 1];
+	req->passwordSize = passwordSize;
+	memcpy(req->password, password, passwordSize);
+
+	bscryptd_enqueue(daemon, req);
+	bscryptd_dispatch(daemon);
+
+	return 0;
+}
+
+static void bscryptd_connRead(bscryptd *daemon, bscryptd_conn *conn)
+{
+	const size_t inCap = BSCRYPTD_HEADER_SIZE + BSCRYPTD_MAX_PAYLOAD;
+	size_t       used  = 0;
+	ssize_t      size;
+
+	do
+	{
+		size = read(conn->fd, conn->in + conn->inSize, inCap - conn->inSize);
+	} while (size < 0 && errno == EINTR);
+	if (size <= 0)
+	{
+		if (size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			bscryptd_connClose(daemon, conn);
+		}
+		return;
+	}
+	conn->inSize += (size_t) size;
+
+	// Handle every whole request
+	while (conn->fd != -1 && conn->inSize - used >= BSCRYPTD_HEADER_SIZE)
+	{
+		const uint8_t *header      = conn->in + used;
+		uint32_t       payloadSize = readUint32Le(header);
+
+		if (payloadSize > BSCRYPTD_MAX_PAYLOAD)
+		{
+			bscryptd_connClose(daemon, conn);
+			break;
+		}
+		if (conn->inSize - used < BSCRYPTD_HEADER_SIZE + payloadSize)
+		{
+			break;
+		}
+		if (bscryptd_handle(daemon, conn, header, header + BSCRYPTD_HEADER_SIZE, payloadSize))
+		{
+			bscryptd_connClose(daemon, conn);
+			break;
+		}
+		used += BSCRYPTD_HEADER_SIZE + payloadSize;
+	}
+
+	// Keep the partial request and wipe the rest
+	conn->inSize -= used;
+	memmove(conn->in, conn->in + used, conn->inSize);
+	secureClearMemory(conn->in + conn->inSize, used);
+}
+
+static void bscryptd_accept(bscryptd *daemon)
+{
+	while (1)
+	{
+		bscryptd_conn *conn;
+		int            fd = accept(daemon->listenFd, NULL, NULL);
+
+		if (fd == -1)
+		{
+			break;
+		}
+		if (bscryptd_setNonBlocking(fd))
+		{
+			close(fd);
+			continue;
+		}
+		conn = new bscryptd_conn;
+		conn->fd          = fd;
+		conn->in          = new uint8_t[BSCRYPTD_HEADER_SIZE + BSCRYPTD_MAX_PAYLOAD];
+		conn->inSize      = 0;
+		conn->out         = NULL;
+		conn->outSize     = 0;
+		conn->outCap      = 0;
+		conn->outstanding = 0;
+		conn->next        = daemon->conns;
+		daemon->conns     = conn;
+		daemon->numConns++;
+	}
+}
+
+/**
+ * Frees connections that are closed and have nothing in flight.
+ */
+static void bscryptd_reap(bscryptd *daemon)
+{
+	bscryptd_conn **link = &daemon->conns;
+
+	while (*link != NULL)
+	{
+		bscryptd_conn *conn = *link;
+
+		if (conn->fd == -1 && conn->outstanding == 0)
+		{
+			*link = conn->next;
+			secureClearMemory(conn->in, BSCRYPTD_HEADER_SIZE + BSCRYPTD_MAX_PAYLOAD);
+			delete [] conn->in;
+			delete [] conn->out;
+			delete conn;
+		}
+		else
+		{
+			link = &conn->next;
+		}
+	}
+}
+
+static int bscryptd_listen(const char *path, uint32_t mode)
+{
+	sockaddr_un addr;
+	mode_t      oldMask;
+	int         fd;
+	int         ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path is too long\n");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+	{
+		perror("socket");
+		return -1;
+	}
+	unlink(path);
+	// Create the socket with no access and then open it up to mode so there's
+	// no window where anyone else can connect
+	oldMask = umask(0777);
+	ret = bind(fd, (sockaddr*) &addr, sizeof(addr));
+	umask(oldMask);
+	if (ret == -1 ||
+		chmod(path, (mode_t) mode) == -1 ||
+		listen(fd, 128) == -1 ||
+		bscryptd_setNonBlocking(fd))
+	{
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int bscryptd_run(bscryptd *daemon)
+{
+	pollfd   *fds    = NULL;
+	uint32_t  fdsCap = 0;
+
+	while (!bscryptd_stop || daemon->running > 0)
+	{
+		bscryptd_conn *conn;
+		uint32_t       numFds = 0;
+
+		if (bscryptd_stop && daemon->listenFd != -1)
+		{
+			// Stop taking work and drop what hasn't started
+			close(daemon->listenFd);
+			daemon->listenFd = -1;
+			for (conn = daemon->conns; conn != NULL; conn = conn->next)
+			{
+				bscryptd_connClose(daemon, conn);
+			}
+			while (daemon->pendingHead != NULL)
+			{
+				bscryptd_request *req = daemon->pendingHead;
+
+				daemon->pendingHead = req->next;
+				bscryptd_fail(daemon, req, BSCRYPTD_STATUS_FAILED);
+			}
+			daemon->pendingTail = NULL;
+			daemon->pending     = 0;
+		}
+		bscryptd_reap(daemon);
+
+		if (fdsCap < daemon->numConns + 2)
+		{
+			delete [] fds;
+			fdsCap = 2 * (daemon->numConns + 2);
+			fds    = new pollfd[fdsCap];
+		}
+		fds[numFds].fd     = daemon->notifyFds[0];
+		fds[numFds].events = POLLIN;
+		numFds++;
+		if (daemon->listenFd != -1)
+		{
+			fds[numFds].fd     = daemon->listenFd;
+			fds[numFds].events = POLLIN;
+			numFds++;
+		}
+		for (conn = daemon->conns; conn != NULL; conn = conn->next)
+		{
+			if (conn->fd == -1)
+			{
+				continue;
+			}
+			fds[numFds].fd     = conn->fd;
+			fds[numFds].events = 0;
+			// Backpressure
+			if (conn->outstanding < BSCRYPTD_CONN_MAX_OUTSTANDING && conn->outSize < BSCRYPTD_CONN_MAX_OUT)
+			{
+				fds[numFds].events |= POLLIN;
+			}
+			if (conn->outSize > 0)
+			{
+				fds[numFds].events |= POLLOUT;
+			}
+			numFds++;
+		}
+
+		if (poll(fds, numFds, -1) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+
+		if (fds[0].revents)
+		{
+			bscryptd_drainDone(daemon);
+		}
+		if (daemon->listenFd != -1 && fds[1].revents)
+		{
+			bscryptd_accept(daemon);
+		}
+		// New connections are at the front of the list and weren't polled
+		for (uint32_t i = daemon->listenFd != -1 ? 2 : 1; i < numFds; i++)
+		{
+			if (fds[i].revents == 0)
+			{
+				continue;
+			}
+			for (conn = daemon->conns; conn != NULL && conn->fd != fds[i].fd; conn = conn->next)
+			{
+			}
+			if (conn == NULL)
+			{
+				continue;
+			}
+			if (fds[i].revents & POLLOUT)
+			{
+				bscryptd_connFlush(daemon, conn);
+			}
+			if (conn->fd != -1 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			{
+				bscryptd_connRead(daemon, conn);
+			}
+		}
+	}
+
+	delete [] fds;
+	return 0;
+}
+
+/**
+ * Copies a ring request out of shared memory (the application can still write
+ * to it) and wipes the slot's password. Cheap requests are answered here.
+ *
+ * @return A request for the FIFO or NULL if it was answered.
+ */
+static bscryptd_request *bscryptd_ringRequest(bscryptd *daemon, bscryptRing_slot *slot)
+{
+	bscrypt_params    params;
+	bscryptd_request *req;
+	uint32_t          passwordSize = slot->passwordSize;
+	uint8_t           op           = slot->op;
+
+	if ((op != BSCRYPTD_OP_HASH && op != BSCRYPTD_OP_VERIFY) || passwordSize > BSCRYPTRING_MAX_PASSWORD)
+	{
+		// Ping, needs rehash, and bad requests
+		bscryptRing_process(slot, &daemon->ctx);
+		bscryptRing_complete(daemon->ring, &slot, 1);
+		return NULL;
+	}
+
+	req = new bscryptd_request;
+	req->daemon       = daemon;
+	req->conn         = NULL;
+	req->slot         = slot;
+	req->next         = NULL;
+	req->id           = 0;
+	req->op           = op;
+	req->memoryKiB    = slot->memoryKiB;
+	req->iterations   = slot->iterations;
+	req->parallelism  = slot->parallelism;
+	req->password     = new uint8_t[passwordSize + 1];
+	req->passwordSize = passwordSize;
+	memcpy(req->password, slot->password, passwordSize);
+	secureClearMemory(slot->password, passwordSize);
+
+	if (op == BSCRYPTD_OP_VERIFY)
+	{
+		memcpy(req->hash, slot->hash, sizeof(req->hash));
+		// Need m for the memory budget
+		if (memchr(req->hash, 0, sizeof(req->hash)) == NULL || bscrypt_parseHash(&params, req->hash))
+		{
+			bscryptd_fail(daemon, req, BSCRYPTD_STATUS_BAD_REQUEST);
+			return NULL;
+		}
+		req->memoryKiB = params.memoryKiB;
+		secureClearMemory(&params, sizeof(params));
+	}
+	else
+	{
+		req->hash[0] = 0;
+		if (req->memoryKiB < MEMORY_KIB_MIN)
+		{
+			req->memoryKiB = MEMORY_KIB_MIN;
+		}
+	}
+	return req;
+}
+
+/**
+ * Takes requests from the shared memory ring and hands them to the event loop
+ * so they share the workers, budget, and queue with socket requests. Stops
+ * once main() calls bscryptRing_interrupt().
+ */
+static void *bscryptd_ringThread(void *arg)
+{
+	bscryptd         *daemon = (bscryptd*) arg;
+	bscryptRing_slot *slots[64];
+	uint32_t          count;
+
+	while ((count = bscryptRing_take(daemon->ring, slots, 64, -1)) > 0)
+	{
+		bscryptd_request *reqs[64];
+		uint32_t          numReqs = 0;
+		uint64_t          one     = 1;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			reqs[numReqs] = bscryptd_ringRequest(daemon, slots[i]);
+			if (reqs[numReqs] != NULL)
+			{
+				numReqs++;
+			}
+		}
+		if (numReqs == 0)
+		{
+			continue;
+		}
+
+		// Newest first like the done list
+		MUTEX_LOCK(daemon->doneMutex);
+		for (uint32_t i = 0; i < numReqs; i++)
+		{
+			reqs[i]->next     = daemon->ringTaken;
+			daemon->ringTaken = reqs[i];
+		}
+		MUTEX_UNLOCK(daemon->doneMutex);
+		while (write(daemon->notifyFds[1], &one, sizeof(one)) == -1 && errno == EINTR)
+		{
+		}
+	}
+	return NULL;
+}
+
+static int bscryptd_parseUint(const char *str, uint32_t &num, int base = 10)
+{
+	char          *end;
+	unsigned long  value;
+
+	errno = 0;
+	value = strtoul(str, &end, base);
+	if (errno != 0 || end == str || *end != 0 || value > UINT32_MAX)
+	{
+		return 1;
+	}
+	num = (uint32_t) value;
+	return 0;
+}
+
+static void bscryptd_usage()
+{
+	fprintf(stderr,
+		"bscryptd [-s socketPath] [-m socketMode] [-r ringName] [-w workers] [-b budgetMiB]\n"
+		"         [-M maxMemoryKiB] [-T maxIterations] [-P maxParallelism] [-q maxQueued]\n"
+		"  -s  Unix socket path (default " BSCRYPTD_DEFAULT_PATH ")\n"
+		"  -m  Socket permissions in octal (default 600, only this user may connect)\n"
+		"  -r  Also serve a shared memory ring (bscryptring.h) with this name. These\n"
+		"      requests share the workers and are counted against -b and -q\n"
+		"  -w  Worker threads (default one per core)\n"
+		"  -b  Memory budget for running requests in MiB (default 1024)\n"
+		"  -M  Largest m a request may use in KiB (default 1048576)\n"
+		"  -T  Largest t a request may use (default 1024)\n"
+		"  -P  Largest p a request may use (default 16)\n"
+		"  -q  Requests that may wait for memory or a worker (default 65536)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	bscryptd    daemon;
+	THREAD      ringThread;
+	int         ringStarted    = 0;
+	const char *ringName       = NULL;
+	const char *path           = BSCRYPTD_DEFAULT_PATH;
+	uint32_t    workers        = 0;
+	uint32_t    budgetMiB      = 1024;
+	uint32_t    maxMemoryKiB   = 1048576;
+	uint32_t    maxIterations  = 1024;
+	uint32_t    maxParallelism = 16;
+	uint32_t    socketMode     = 0600;
+	uint32_t    maxQueued      = 65536;
+
+	for (int i = 1; i < argc; i++)
+	{
+		uint32_t *num = NULL;
+
+		if (i + 1 >= argc)
+		{
+			bscryptd_usage();
+			return 1;
+		}
+		if      (strcmp(argv[i], "-s") == 0) { path     = argv[++i]; continue; }
+		else if (strcmp(argv[i], "-r") == 0) { ringName = argv[++i]; continue; }
+		else if (strcmp(argv[i], "-m") == 0)
+		{
+			if (bscryptd_parseUint(argv[++i], socketMode, 8) || socketMode > 0777)
+			{
+				bscryptd_usage();
+				return 1;
+			}
+			continue;
+		}
+		else if (strcmp(argv[i], "-w") == 0) { num = &workers;        }
+		else if (strcmp(argv[i], "-b") == 0) { num = &budgetMiB;      }
+		else if (strcmp(argv[i], "-M") == 0) { num = &maxMemoryKiB;   }
+		else if (strcmp(argv[i], "-T") == 0) { num = &maxIterations;  }
+		else if (strcmp(argv[i], "-P") == 0) { num = &maxParallelism; }
+		else if (strcmp(argv[i], "-q") == 0) { num = &maxQueued;      }
+		if (num == NULL || bscryptd_parseUint(argv[++i], *num))
+		{
+			bscryptd_usage();
+			return 1;
+		}
+	}
+
+	if (bscrypt_ctxInit(&daemon.ctx, workers))
+	{
+		fprintf(stderr, "Failed to start workers\n");
+		return 1;
+	}
+	// Each request gets one thread so the pool's workers are the only limit
+	daemon.ctx.maxThreads     = 1;
+	daemon.ctx.maxMemoryKiB   = maxMemoryKiB;
+	daemon.ctx.maxIterations  = maxIterations;
+	daemon.ctx.maxParallelism = maxParallelism;
+	daemon.ctx.wipeSboxes     = 0;
+
+	daemon.conns       = NULL;
+	daemon.numConns    = 0;
+	daemon.pendingHead = NULL;
+	daemon.pendingTail = NULL;
+	daemon.pending     = 0;
+	daemon.maxPending  = maxQueued;
+	daemon.running     = 0;
+	daemon.maxRunning  = daemon.ctx.pool.numThreads;
+	daemon.runningKiB  = 0;
+	daemon.budgetKiB   = (uint64_t) budgetMiB * 1024;
+	daemon.done        = NULL;
+	daemon.ringTaken   = NULL;
+	daemon.ring        = NULL;
+	MUTEX_CREATE(daemon.doneMutex);
+
+	if (pipe(daemon.notifyFds) == -1 ||
+		bscryptd_setNonBlocking(daemon.notifyFds[0]) ||
+		bscryptd_setNonBlocking(daemon.notifyFds[1]))
+	{
+		perror("pipe");
+		return 1;
+	}
+	daemon.listenFd = bscryptd_listen(path, socketMode);
+	if (daemon.listenFd == -1)
+	{
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT,  bscryptd_onSignal);
+	signal(SIGTERM, bscryptd_onSignal);
+	fprintf(stderr, "bscryptd: listening on %s with %u workers\n", path, daemon.maxRunning);
+
+	if (ringName != NULL)
+	{
+		daemon.ring = bscryptRing_create(ringName, BSCRYPTRING_DEFAULT_SLOTS);
+		if (daemon.ring == NULL || THREAD_CREATE(ringThread, bscryptd_ringThread, &daemon))
+		{
+			fprintf(stderr, "Failed to create ring %s\n", ringName);
+			bscryptd_stop = 1;
+		}
+		else
+		{
+			ringStarted = 1;
+			fprintf(stderr, "bscryptd: serving ring %s\n", ringName);
+		}
+	}
+
+	bscryptd_run(&daemon);
+
+	// Clean up
+	if (daemon.ring != NULL)
+	{
+		bscryptRing_interrupt(daemon.ring);
+		if (ringStarted)
+		{
+			THREAD_WAIT(ringThread);
+		}
+		// Taken after the event loop stopped
+		while (daemon.ringTaken != NULL)
+		{
+			bscryptd_request *req = daemon.ringTaken;
+
+			daemon.ringTaken = req->next;
+			bscryptd_fail(&daemon, req, BSCRYPTD_STATUS_FAILED);
+		}
+		bscryptRing_close(daemon.ring);
+		bscryptRing_unlink(ringName);
+	}
+	if (daemon.listenFd != -1)
+	{
+		close(daemon.listenFd);
+	}
+	bscryptd_reap(&daemon);
+	unlink(path);
+	close(daemon.notifyFds[0]);
+	close(daemon.notifyFds[1]);
+	MUTEX_DELETE(daemon.doneMutex);
+	bscrypt_ctxDestroy(&daemon.ctx);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#pragma once
+
+// Wire protocol for bscryptd, the per-host hashing daemon. This header is C
+// compatible so it can be shared with clients in other languages.
+//
+// Everything is little endian. Each message is a 16 byte header and then
+// "size" bytes of payload. Clients can send any number of requests without
+// waiting (pipelining). Responses come back in the order they finish, so match
+// them up with "id".
+//
+// Header
+// Offset Size
+//      0    4 Payload size (at most BSCRYPTD_MAX_PAYLOAD)
+//      4    4 Id (picked by the client and echoed back)
+//      8    1 Op (BSCRYPTD_OP_*)
+//      9    1 Status (BSCRYPTD_STATUS_*, 0 in requests)
+//     10    2 Waiting (queued requests that haven't started, at most 65535, 0 in requests)
+//     12    4 Queue depth (requests the daemon has accepted but not answered, 0 in requests)
+//
+// Payloads
+// Op                    Request                          Response (on BSCRYPTD_STATUS_OK)
+// BSCRYPTD_OP_PING      Nothing                          Nothing
+// BSCRYPTD_OP_HASH      m, t, p (4 bytes each), password Hash (no NUL)
+// BSCRYPTD_OP_VERIFY    Hash size (4 bytes), hash,       1 byte: 1 on correct password, otherwise 0
+//                       password
+// BSCRYPTD_OP_REHASH    m, t, p (4 bytes each), hash     1 byte: 1 if bscrypt_needsRehash(), otherwise 0
+//
+// On any other status the response has no payload.
+
+#define BSCRYPTD_DEFAULT_PATH   "/tmp/bscryptd.sock"
+
+enum
+{
+	BSCRYPTD_HEADER_SIZE   = 16,
+	BSCRYPTD_MAX_PAYLOAD   = 8192,
+	BSCRYPTD_HASH_MAX_SIZE = 112 // BSCRYPT_HASH_MAX_SIZE
+};
+
+enum
+{
+	BSCRYPTD_OP_PING   = 0,
+	BSCRYPTD_OP_HASH   = 1,
+	BSCRYPTD_OP_VERIFY = 2,
+	BSCRYPTD_OP_REHASH = 3
+};
+
+enum
+{
+	BSCRYPTD_STATUS_OK          = 0,
+	BSCRYPTD_STATUS_BAD_REQUEST = 1,
+	BSCRYPTD_STATUS_BUSY        = 2,
+	BSCRYPTD_STATUS_FAILED      = 3
+};
@@ -0,0 +1,713 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include "bscryptring.h"
+#include "bscrypt.h"
+#include "common.h"
+#include <string.h>
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+	#include <linux/futex.h>
+	#include <sys/syscall.h>
+	#include <time.h>
+#endif
+
+const uint32_t BSCRYPTRING_MAGIC   = 0x67726e62; // "bnrg"
+const uint32_t BSCRYPTRING_VERSION = 2;
+
+// Bounded multi-producer multi-consumer queue of slot indexes (Dmitry
+// Vyukov's). Each cell has a sequence number that says whose turn it is, so
+// producers and consumers only contend on head or tail. The cells follow this
+// header in shared memory.
+struct bscryptRing_queue
+{
+	uint64_t head;
+	uint8_t  pad0[56];
+	uint64_t tail;
+	uint8_t  pad1[56];
+	uint32_t futex;   // Bumped after every push
+	uint32_t waiters; // Number of threads sleeping on futex
+	uint8_t  pad2[56];
+};
+
+struct bscryptRing_cell
+{
+	uint64_t seq;
+	uint64_t value;
+};
+
+struct bscryptRing_shared
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t numSlots;
+	uint32_t slotSize;
+	uint32_t channelOwner[BSCRYPTRING_MAX_CHANNELS];      // pid of the process using it or 0
+	uint32_t channelGeneration[BSCRYPTRING_MAX_CHANNELS]; // Bumped each time it's claimed
+};
+
+struct bscryptRing
+{
+	uint8_t            *mem;
+	size_t              memSize;
+	bscryptRing_shared *shared;
+	bscryptRing_queue  *freeQueue;
+	bscryptRing_queue  *submitQueue;
+	bscryptRing_queue  *channels[BSCRYPTRING_MAX_CHANNELS];
+	bscryptRing_slot   *slots;
+	uint32_t            numSlots;
+	uint32_t            channel;
+	uint32_t            generation;
+	int                 engine;
+	int                 interrupted;
+};
+
+static size_t bscryptRing_align(size_t size)
+{
+	return (size + 63) & ~(size_t) 63;
+}
+
+static size_t bscryptRing_queueSize(uint32_t numSlots)
+{
+	return bscryptRing_align(sizeof(bscryptRing_queue) + (size_t) numSlots * sizeof(bscryptRing_cell));
+}
+
+static size_t bscryptRing_memSize(uint32_t numSlots)
+{
+	return
+		bscryptRing_align(sizeof(bscryptRing_shared)) +
+		(2 + BSCRYPTRING_MAX_CHANNELS) * bscryptRing_queueSize(numSlots) +
+		(size_t) numSlots * sizeof(bscryptRing_slot);
+}
+
+static bscryptRing_cell *bscryptRing_cells(bscryptRing_queue *queue)
+{
+	return (bscryptRing_cell*) (queue + 1);
+}
+
+static void bscryptRing_queueInit(bscryptRing_queue *queue, uint32_t numSlots, int full)
+{
+	bscryptRing_cell *cells = bscryptRing_cells(queue);
+
+	memset(queue, 0, sizeof(bscryptRing_queue));
+	for (uint32_t i = 0; i < numSlots; i++)
+	{
+		cells[i].seq   = i;
+		cells[i].value = 0;
+	}
+	if (full)
+	{
+		for (uint32_t i = 0; i < numSlots; i++)
+		{
+			cells[i].seq   = i + 1;
+			cells[i].value = i;
+		}
+		queue->tail = numSlots;
+	}
+}
+
+/**
+ * @return On success 0, otherwise the queue is full.
+ */
+static int bscryptRing_push(bscryptRing_queue *queue, uint32_t mask, uint64_t value)
+{
+	bscryptRing_cell *cells = bscryptRing_cells(queue);
+	bscryptRing_cell *cell;
+	uint64_t          pos   = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+	while (1)
+	{
+		int64_t dif;
+
+		cell = cells + (pos & mask);
+		dif  = (int64_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (dif < 0)
+		{
+			return 1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->value = value;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * @return On success 0, otherwise the queue is empty.
+ */
+static int bscryptRing_pop(bscryptRing_queue *queue, uint32_t mask, uint64_t &value)
+{
+	bscryptRing_cell *cells = bscryptRing_cells(queue);
+	bscryptRing_cell *cell;
+	uint64_t          pos   = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+	while (1)
+	{
+		int64_t dif;
+
+		cell = cells + (pos & mask);
+		dif  = (int64_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (dif < 0)
+		{
+			return 1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+		}
+	}
+	value = cell->value;
+	__atomic_store_n(&cell->seq, pos + (uint64_t) mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * @param uint64_t timeoutUs - UINT64_MAX to wait until woken.
+ */
+static void bscryptRing_futexWait(uint32_t *addr, uint32_t value, uint64_t timeoutUs)
+{
+#ifdef __linux__
+	timespec timeout;
+
+	timeout.tv_sec  = (time_t) (timeoutUs / 1000000);
+	timeout.tv_nsec = (long) (timeoutUs % 1000000 * 1000);
+	// Not FUTEX_WAIT_PRIVATE since other processes wake us
+	syscall(SYS_futex, addr, FUTEX_WAIT, value, timeoutUs == UINT64_MAX ? NULL : &timeout, NULL, 0);
+#else
+	// No cross process futex so poll
+	(void) addr;
+	(void) value;
+	usleep((useconds_t) (timeoutUs < 1000 ? timeoutUs : 1000));
+#endif
+}
+
+static void bscryptRing_futexWake(uint32_t *addr, uint32_t count)
+{
+#ifdef __linux__
+	syscall(SYS_futex, addr, FUTEX_WAKE, count > 0x7fffffff ? 0x7fffffff : count, NULL, NULL, 0);
+#else
+	(void) addr;
+	(void) count;
+#endif
+}
+
+/**
+ * Wakes up to count waiters after pushing. This is only a syscall when
+ * someone is sleeping.
+ */
+static void bscryptRing_notify(bscryptRing_queue *queue, uint32_t count)
+{
+	__atomic_add_fetch(&queue->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->waiters, __ATOMIC_SEQ_CST) != 0)
+	{
+		bscryptRing_futexWake(&queue->futex, count);
+	}
+}
+
+/**
+ * Pops up to maxCount slot indexes. Waits for the first one or
+ * bscryptRing_interrupt().
+ *
+ * @param int timeoutMs       - Less than 0 to wait forever, 0 to not wait.
+ * @param int checkGeneration - Release slots submitted by an earlier owner of this process's channel.
+ * @return Number of indexes popped.
+ */
+static uint32_t bscryptRing_popWait(bscryptRing *ring, bscryptRing_queue *queue, bscryptRing_slot **slots, uint32_t maxCount, int timeoutMs, int checkGeneration)
+{
+	uint32_t mask     = ring->numSlots - 1;
+	uint64_t deadline = 0;
+	uint32_t count    = 0;
+
+	if (timeoutMs > 0)
+	{
+		deadline = getTimeUs() + (uint64_t) timeoutMs * 1000;
+	}
+	while (maxCount > 0)
+	{
+		uint32_t futex = __atomic_load_n(&queue->futex, __ATOMIC_SEQ_CST);
+		uint64_t value;
+		uint64_t timeoutUs;
+
+		while (count < maxCount && bscryptRing_pop(queue, mask, value) == 0)
+		{
+			// Drop anything corrupt
+			if (value < ring->numSlots)
+			{
+				bscryptRing_slot *slot = ring->slots + value;
+
+				if (checkGeneration && slot->generation != ring->generation)
+				{
+					// Its process died and we got the channel
+					bscryptRing_release(ring, slot);
+					continue;
+				}
+				slots[count++] = slot;
+			}
+		}
+		if (count > 0 || timeoutMs == 0 || __atomic_load_n(&ring->interrupted, __ATOMIC_ACQUIRE))
+		{
+			break;
+		}
+
+		timeoutUs = UINT64_MAX;
+		if (timeoutMs > 0)
+		{
+			uint64_t now = getTimeUs();
+
+			if (now >= deadline)
+			{
+				break;
+			}
+			timeoutUs = deadline - now;
+		}
+		// A push after reading futex changes it so this returns right away
+		__atomic_add_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+		bscryptRing_futexWait(&queue->futex, futex, timeoutUs);
+		__atomic_sub_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+	return count;
+}
+
+static bscryptRing *bscryptRing_map(int fd, uint32_t numSlots, int engine)
+{
+	bscryptRing *ring;
+	uint8_t     *mem;
+	size_t       memSize   = bscryptRing_memSize(numSlots);
+	size_t       queueSize = bscryptRing_queueSize(numSlots);
+
+	mem = (uint8_t*) mmap(NULL, memSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	ring = new bscryptRing;
+	ring->mem         = mem;
+	ring->memSize     = memSize;
+	ring->shared      = (bscryptRing_shared*) mem;
+	mem += bscryptRing_align(sizeof(bscryptRing_shared));
+	ring->freeQueue   = (bscryptRing_queue*) mem;
+	mem += queueSize;
+	ring->submitQueue = (bscryptRing_queue*) mem;
+	mem += queueSize;
+	for (uint32_t i = 0; i < BSCRYPTRING_MAX_CHANNELS; i++)
+	{
+		ring->channels[i] = (bscryptRing_queue*) mem;
+		mem += queueSize;
+	}
+	ring->slots       = (bscryptRing_slot*) mem;
+	ring->numSlots    = numSlots;
+	ring->channel     = 0;
+	ring->generation  = 0;
+	ring->engine      = engine;
+	ring->interrupted = 0;
+	return ring;
+}
+
+/**
+ * Creates the shared memory for a ring. Replaces any old ring with the same name.
+ *
+ * @param const char *name     - Shared memory name ("/something") or NULL for BSCRYPTRING_DEFAULT_NAME.
+ * @param uint32_t    numSlots - Max requests in flight, power of 2 up to BSCRYPTRING_MAX_SLOTS.
+ * @return On success a ring, otherwise NULL.
+ */
+bscryptRing *bscryptRing_create(const char *name, uint32_t numSlots)
+{
+	bscryptRing        *ring;
+	bscryptRing_shared *shared;
+	int                 fd;
+
+	if (name == NULL)
+	{
+		name = BSCRYPTRING_DEFAULT_NAME;
+	}
+	if (numSlots == 0 || numSlots > BSCRYPTRING_MAX_SLOTS || (numSlots & (numSlots - 1)) != 0)
+	{
+		return NULL;
+	}
+
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+	{
+		return NULL;
+	}
+	if (ftruncate(fd, (off_t) bscryptRing_memSize(numSlots)) == -1)
+	{
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	ring = bscryptRing_map(fd, numSlots, 1);
+	close(fd);
+	if (ring == NULL)
+	{
+		shm_unlink(name);
+		return NULL;
+	}
+
+	bscryptRing_queueInit(ring->freeQueue, numSlots, 1);
+	bscryptRing_queueInit(ring->submitQueue, numSlots, 0);
+	for (uint32_t i = 0; i < BSCRYPTRING_MAX_CHANNELS; i++)
+	{
+		bscryptRing_queueInit(ring->channels[i], numSlots, 0);
+	}
+	memset(ring->slots, 0, (size_t) numSlots * sizeof(bscryptRing_slot));
+
+	// Publish last so bscryptRing_open() doesn't see a half made ring
+	shared = ring->shared;
+	memset(shared->channelOwner, 0, sizeof(shared->channelOwner));
+	memset(shared->channelGeneration, 0, sizeof(shared->channelGeneration));
+	shared->numSlots = numSlots;
+	shared->slotSize = sizeof(bscryptRing_slot);
+	shared->version  = BSCRYPTRING_VERSION;
+	__atomic_store_n(&shared->magic, BSCRYPTRING_MAGIC, __ATOMIC_RELEASE);
+	return ring;
+}
+
+/**
+ * Claims a free completion queue or one whose process is gone.
+ *
+ * @return On success 0, otherwise non-zero.
+ */
+static int bscryptRing_claimChannel(bscryptRing *ring)
+{
+	uint32_t pid = (uint32_t) getpid();
+
+	for (ring->channel = 0; ring->channel < BSCRYPTRING_MAX_CHANNELS; ring->channel++)
+	{
+		uint32_t owner = 0;
+
+		if (__atomic_compare_exchange_n(ring->shared->channelOwner + ring->channel, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+	if (ring->channel >= BSCRYPTRING_MAX_CHANNELS)
+	{
+		// Take one back from a process that died without closing (EPERM means it's alive)
+		for (ring->channel = 0; ring->channel < BSCRYPTRING_MAX_CHANNELS; ring->channel++)
+		{
+			uint32_t owner = __atomic_load_n(ring->shared->channelOwner + ring->channel, __ATOMIC_ACQUIRE);
+
+			if (owner != 0 && kill((pid_t) owner, 0) == -1 && errno == ESRCH &&
+				__atomic_compare_exchange_n(ring->shared->channelOwner + ring->channel, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		if (ring->channel >= BSCRYPTRING_MAX_CHANNELS)
+		{
+			return 1;
+		}
+	}
+	// Anything the last owner left in the queue or has in flight is released by bscryptRing_harvest()
+	ring->generation = __atomic_add_fetch(ring->shared->channelGeneration + ring->channel, 1, __ATOMIC_ACQ_REL);
+	return 0;
+}
+
+/**
+ * Opens a ring made by the engine and claims a completion queue. Queues held
+ * by processes that died without bscryptRing_close() are taken back.
+ *
+ * @param const char *name - Shared memory name or NULL for BSCRYPTRING_DEFAULT_NAME.
+ * @return On success a ring, otherwise NULL.
+ */
+bscryptRing *bscryptRing_open(const char *name)
+{
+	bscryptRing        *ring;
+	bscryptRing_shared  shared;
+	int                 fd;
+	ssize_t             size;
+
+	if (name == NULL)
+	{
+		name = BSCRYPTRING_DEFAULT_NAME;
+	}
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd == -1)
+	{
+		return NULL;
+	}
+	size = pread(fd, &shared, sizeof(shared), 0);
+	if (size != (ssize_t) sizeof(shared) ||
+		shared.magic    != BSCRYPTRING_MAGIC ||
+		shared.version  != BSCRYPTRING_VERSION ||
+		shared.slotSize != sizeof(bscryptRing_slot) ||
+		shared.numSlots == 0 || shared.numSlots > BSCRYPTRING_MAX_SLOTS ||
+		(shared.numSlots & (shared.numSlots - 1)) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	ring = bscryptRing_map(fd, shared.numSlots, 0);
+	close(fd);
+	if (ring == NULL)
+	{
+		return NULL;
+	}
+
+	if (bscryptRing_claimChannel(ring))
+	{
+		munmap(ring->mem, ring->memSize);
+		delete ring;
+		return NULL;
+	}
+	return ring;
+}
+
+/**
+ * Unmaps the ring. Applications give back their completion queue so don't
+ * call this with requests in flight.
+ *
+ * @param bscryptRing *ring - The ring.
+ */
+void bscryptRing_close(bscryptRing *ring)
+{
+	if (ring != NULL)
+	{
+		if (!ring->engine)
+		{
+			__atomic_store_n(ring->shared->channelOwner + ring->channel, 0, __ATOMIC_RELEASE);
+		}
+		munmap(ring->mem, ring->memSize);
+		delete ring;
+	}
+}
+
+/**
+ * Removes the shared memory name. Processes that have it mapped keep working.
+ *
+ * @param const char *name - Shared memory name or NULL for BSCRYPTRING_DEFAULT_NAME.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscryptRing_unlink(const char *name)
+{
+	return shm_unlink(name == NULL ? BSCRYPTRING_DEFAULT_NAME : name) != 0;
+}
+
+/**
+ * Gets a free slot to fill in.
+ *
+ * @param bscryptRing *ring      - The ring.
+ * @param int          timeoutMs - Less than 0 to wait forever, 0 to not wait.
+ * @return On success a slot, otherwise NULL.
+ */
+bscryptRing_slot *bscryptRing_acquire(bscryptRing *ring, int timeoutMs)
+{
+	bscryptRing_slot *slot = NULL;
+
+	bscryptRing_popWait(ring, ring->freeQueue, &slot, 1, timeoutMs, 0);
+	return slot;
+}
+
+/**
+ * Returns a slot after reading its response.
+ *
+ * @param bscryptRing      *ring - The ring.
+ * @param bscryptRing_slot *slot - The slot.
+ */
+void bscryptRing_release(bscryptRing *ring, bscryptRing_slot *slot)
+{
+	uint32_t index = (uint32_t) (slot - ring->slots);
+
+	secureClearMemory(slot->password, sizeof(slot->password));
+	secureClearMemory(slot->hash, sizeof(slot->hash));
+	slot->passwordSize = 0;
+	if (bscryptRing_push(ring->freeQueue, ring->numSlots - 1, index) == 0)
+	{
+		bscryptRing_notify(ring->freeQueue, 1);
+	}
+}
+
+/**
+ * Queues filled in slots for the engine. Wakes the engine at most once.
+ *
+ * @param bscryptRing             *ring  - The ring.
+ * @param bscryptRing_slot *const *slots - The slots.
+ * @param uint32_t                 count - Number of slots.
+ */
+void bscryptRing_submit(bscryptRing *ring, bscryptRing_slot *const *slots, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		bscryptRing_slot *slot = slots[i];
+
+		slot->channel    = (uint16_t) ring->channel;
+		slot->generation = ring->generation;
+		slot->status     = BSCRYPTD_STATUS_FAILED;
+		slot->result     = 0;
+		// Can't be full since there are only numSlots slots
+		bscryptRing_push(ring->submitQueue, ring->numSlots - 1, (uint32_t) (slot - ring->slots));
+	}
+	if (count > 0)
+	{
+		bscryptRing_notify(ring->submitQueue, count);
+	}
+}
+
+/**
+ * Gets finished slots that this process submitted.
+ *
+ * @param bscryptRing       *ring      - The ring.
+ * @param bscryptRing_slot **slots     - Receives the slots.
+ * @param uint32_t           maxCount  - Size of slots.
+ * @param int                timeoutMs - Less than 0 to wait forever, 0 to not wait.
+ * @return Number of slots.
+ */
+uint32_t bscryptRing_harvest(bscryptRing *ring, bscryptRing_slot **slots, uint32_t maxCount, int timeoutMs)
+{
+	return bscryptRing_popWait(ring, ring->channels[ring->channel], slots, maxCount, timeoutMs, 1);
+}
+
+/**
+ * Engine: gets submitted slots.
+ *
+ * @param bscryptRing       *ring      - The ring.
+ * @param bscryptRing_slot **slots     - Receives the slots.
+ * @param uint32_t           maxCount  - Size of slots.
+ * @param int                timeoutMs - Less than 0 to wait forever, 0 to not wait.
+ * @return Number of slots. Waiting forever only returns 0 after bscryptRing_interrupt().
+ */
+uint32_t bscryptRing_take(bscryptRing *ring, bscryptRing_slot **slots, uint32_t maxCount, int timeoutMs)
+{
+	return bscryptRing_popWait(ring, ring->submitQueue, slots, maxCount, timeoutMs, 0);
+}
+
+/**
+ * Engine: makes bscryptRing_take() return 0 right away, now and from then on,
+ * on every thread. Use this to stop threads waiting forever for requests.
+ *
+ * @param bscryptRing *ring - The ring.
+ */
+void bscryptRing_interrupt(bscryptRing *ring)
+{
+	__atomic_store_n(&ring->interrupted, 1, __ATOMIC_RELEASE);
+	bscryptRing_notify(ring->submitQueue, 0x7fffffff);
+}
+
+/**
+ * Engine: runs the request in a slot on the calling thread and wipes the
+ * password. The slot is in memory the application can write to so everything
+ * is checked.
+ *
+ * @param bscryptRing_slot *slot - The slot.
+ * @param bscrypt_ctx      *ctx  - Context to run on.
+ */
+void bscryptRing_process(bscryptRing_slot *slot, bscrypt_ctx *ctx)
+{
+	uint32_t passwordSize = slot->passwordSize;
+	uint8_t  op           = slot->op;
+
+	slot->status = BSCRYPTD_STATUS_BAD_REQUEST;
+	slot->result = 0;
+	if (passwordSize > BSCRYPTRING_MAX_PASSWORD)
+	{
+		passwordSize = 0;
+		op           = 0xff;
+	}
+
+	if (op == BSCRYPTD_OP_PING)
+	{
+		slot->status = BSCRYPTD_STATUS_OK;
+	}
+	else if (op == BSCRYPTD_OP_HASH)
+	{
+		char hash[BSCRYPT_HASH_MAX_SIZE];
+
+		if (bscrypt_ctxHash(ctx, hash, slot->password, passwordSize, slot->memoryKiB, slot->iterations, slot->parallelism) == 0)
+		{
+			memcpy(slot->hash, hash, sizeof(hash));
+			slot->status = BSCRYPTD_STATUS_OK;
+		}
+		else
+		{
+			slot->status = BSCRYPTD_STATUS_FAILED;
+		}
+	}
+	else if (op == BSCRYPTD_OP_VERIFY || op == BSCRYPTD_OP_REHASH)
+	{
+		char hash[BSCRYPT_HASH_MAX_SIZE];
+
+		memcpy(hash, slot->hash, sizeof(hash));
+		if (memchr(hash, 0, sizeof(hash)) != NULL)
+		{
+			if (op == BSCRYPTD_OP_VERIFY)
+			{
+				slot->result = bscrypt_ctxVerify(ctx, hash, slot->password, passwordSize) != 0;
+			}
+			else
+			{
+				slot->result = bscrypt_needsRehash(hash, slot->memoryKiB, slot->iterations, slot->parallelism) != 0;
+			}
+			slot->status = BSCRYPTD_STATUS_OK;
+		}
+	}
+	secureClearMemory(slot->password, passwordSize);
+}
+
+/**
+ * Engine: hands finished slots back to the processes that submitted them.
+ *
+ * @param bscryptRing             *ring  - The ring.
+ * @param bscryptRing_slot *const *slots - The slots.
+ * @param uint32_t                 count - Number of slots.
+ */
+void bscryptRing_complete(bscryptRing *ring, bscryptRing_slot *const *slots, uint32_t count)
+{
+	uint64_t woken = 0;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t channel = slots[i]->channel;
+
+		if (channel < BSCRYPTRING_MAX_CHANNELS &&
+			bscryptRing_push(ring->channels[channel], ring->numSlots - 1, (uint32_t) (slots[i] - ring->slots)) == 0)
+		{
+			woken |= (uint64_t) 1 << channel;
+		}
+	}
+	for (uint32_t channel = 0; woken != 0; channel++, woken >>= 1)
+	{
+		if (woken & 1)
+		{
+			bscryptRing_notify(ring->channels[channel], 0x7fffffff);
+		}
+	}
+}
+
+#endif
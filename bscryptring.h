@@ -0,0 +1,108 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#pragma once
+
+// Shared memory transport between processes on the same host and a hashing
+// engine (bscryptd -r). This skips the socket: requests are written straight
+// into a slot in shared memory and only the slot's index moves through the
+// lock free queues. Waiting uses futexes so an idle side costs nothing and a
+// busy side makes no syscalls.
+//
+// Application:
+//   ring = bscryptRing_open(name);
+//   slot = bscryptRing_acquire(ring, timeoutMs);
+//   Fill in slot->op, id, password, ...
+//   bscryptRing_submit(ring, slots, count);
+//   count = bscryptRing_harvest(ring, slots, max, timeoutMs);
+//   Read slot->status, result, hash
+//   bscryptRing_release(ring, slot);
+//
+// Engine:
+//   ring = bscryptRing_create(name, numSlots);
+//   count = bscryptRing_take(ring, slots, max, timeoutMs);
+//   bscryptRing_process(slot, ctx);
+//   bscryptRing_complete(ring, slots, count);
+//   bscryptRing_interrupt(ring); // To stop threads waiting in bscryptRing_take()
+//
+// Each process that opens the ring gets its own completion queue, so
+// harvesting only returns that process's slots. A process that dies without
+// closing the ring has its queue taken back by the next open once all are in
+// use. Its submitted slots are freed as they finish, but slots it acquired
+// and never submitted are lost until the ring is recreated. Owners are
+// tracked by pid, so every process must share a pid namespace. Ops and
+// statuses are the same as bscryptd (BSCRYPTD_OP_*, BSCRYPTD_STATUS_*).
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bscryptd.h"
+
+#define BSCRYPTRING_DEFAULT_NAME "/bscryptd"
+
+enum
+{
+	BSCRYPTRING_DEFAULT_SLOTS = 1024,
+	BSCRYPTRING_MAX_SLOTS     = 65536,
+	BSCRYPTRING_MAX_CHANNELS  = 64,
+	BSCRYPTRING_MAX_PASSWORD  = 1024
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bscrypt_ctx;
+
+typedef struct bscryptRing bscryptRing;
+
+typedef struct bscryptRing_slot
+{
+	// Set by the application
+	uint64_t id;
+	uint8_t  op;
+	uint8_t  reserved[3];
+	uint32_t memoryKiB;   // Hash and needs rehash
+	uint32_t iterations;  // Hash and needs rehash
+	uint32_t parallelism; // Hash and needs rehash
+	uint32_t passwordSize;
+	uint8_t  password[BSCRYPTRING_MAX_PASSWORD];
+
+	// Input for verify and needs rehash, output for hash
+	char     hash[BSCRYPTD_HASH_MAX_SIZE];
+
+	// Set by the engine
+	uint8_t  status;
+	uint8_t  result;      // Verify and needs rehash
+
+	// Internal
+	uint16_t channel;
+	uint32_t generation;
+} bscryptRing_slot;
+
+bscryptRing *bscryptRing_create(const char *name, uint32_t numSlots);
+bscryptRing *bscryptRing_open(const char *name);
+void bscryptRing_close(bscryptRing *ring);
+int  bscryptRing_unlink(const char *name);
+
+bscryptRing_slot *bscryptRing_acquire(bscryptRing *ring, int timeoutMs);
+void     bscryptRing_release(bscryptRing *ring, bscryptRing_slot *slot);
+void     bscryptRing_submit(bscryptRing *ring, bscryptRing_slot *const *slots, uint32_t count);
+uint32_t bscryptRing_harvest(bscryptRing *ring, bscryptRing_slot **slots, uint32_t maxCount, int timeoutMs);
+
+uint32_t bscryptRing_take(bscryptRing *ring, bscryptRing_slot **slots, uint32_t maxCount, int timeoutMs);
+void     bscryptRing_process(bscryptRing_slot *slot, struct bscrypt_ctx *ctx);
+void     bscryptRing_complete(bscryptRing *ring, bscryptRing_slot *const *slots, uint32_t count);
+void     bscryptRing_interrupt(bscryptRing *ring);
+
+#ifdef __cplusplus
+}
+#endif
@@ -23,7 +23,9 @@
 	#include <sys/stat.h>
 	#include <fcntl.h>
 	#include <unistd.h>
+	#include <time.h>
 #endif
+#include <stdio.h>
 #include <string.h>
 
 /**
@@ -70,6 +72,28 @@ void secureClearMemory(void *mem, size_t size)
 	}
 }
 
+/**
+ * Gets a monotonic time in microseconds. Only useful for differences and deadlines.
+ *
+ * @return Microseconds since an arbitrary point.
+ */
+uint64_t getTimeUs()
+{
+#ifdef _WIN32
+	LARGE_INTEGER t;
+	LARGE_INTEGER f;
+
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&f);
+	return (uint64_t) (t.QuadPart / f.QuadPart) * 1000000 + (uint64_t) (t.QuadPart % f.QuadPart) * 1000000 / f.QuadPart;
+#else
+	timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000 + (uint64_t) t.tv_nsec / 1000;
+#endif
+}
+
 /**
  * Gets instruction sets supported by the CPU.
  *
@@ -160,3 +184,122 @@ uint32_t getInstructionSets(uint32_t mask)
 	return 0;
 #endif
 }
+
+/**
+ * Gets the CPU's model name like "AMD Ryzen 9 5950X 16-Core Processor". Tabs
+ * and new lines are replaced with spaces so it can be used as a key in a text
+ * file.
+ *
+ * @param char  *model - Receives the model name.
+ * @param size_t size  - Size of model.
+ * @return On success 0, otherwise non-zero and model is "unknown".
+ */
+int getCpuModel(char *model, size_t size)
+{
+	char   name[256];
+	size_t nameSize = 0;
+
+	if (size == 0)
+	{
+		return 1;
+	}
+
+#ifdef ARC_x86
+	uint32_t regs[12];
+	uint32_t maxLeaf;
+
+#ifdef _MSC_VER
+	int cpuInfo[4];
+
+	__cpuid(cpuInfo, 0x80000000);
+	maxLeaf = (uint32_t) cpuInfo[0];
+	if (maxLeaf >= 0x80000004)
+	{
+		for (uint32_t i = 0; i < 3; i++)
+		{
+			__cpuid(cpuInfo, 0x80000002 + i);
+			memcpy(regs + 4 * i, cpuInfo, 16);
+		}
+	}
+#else
+	asm(
+		"cpuid"
+		: "=a"(maxLeaf) // output
+		: "a"(0x80000000), "c"(0) // input
+		: "ebx", "edx"); // used
+	if (maxLeaf >= 0x80000004)
+	{
+		for (uint32_t i = 0; i < 3; i++)
+		{
+			asm(
+				"cpuid"
+				: "=a"(regs[4 * i]), "=b"(regs[4 * i + 1]), "=c"(regs[4 * i + 2]), "=d"(regs[4 * i + 3]) // output
+				: "a"(0x80000002 + i), "c"(0)); // input
+		}
+	}
+#endif
+	if (maxLeaf >= 0x80000004)
+	{
+		// Registers are in little endian order
+		memcpy(name, regs, 48);
+		name[48] = 0;
+		nameSize = strlen(name);
+	}
+#elif !defined(_WIN32)
+	// Not x86 so try Linux's /proc/cpuinfo
+	FILE *file = fopen("/proc/cpuinfo", "r");
+
+	if (file != NULL)
+	{
+		char line[256];
+
+		while (fgets(line, sizeof(line), file) != NULL)
+		{
+			if (strncmp(line, "model name", 10) == 0 || strncmp(line, "Hardware", 8) == 0 || strncmp(line, "cpu model", 9) == 0)
+			{
+				const char *value = strchr(line, ':');
+
+				if (value != NULL)
+				{
+					value++;
+					nameSize = strlen(value);
+					memcpy(name, value, nameSize + 1);
+					break;
+				}
+			}
+		}
+		fclose(file);
+	}
+#endif
+
+	// Trim and clean up
+	size_t start = 0;
+
+	while (start < nameSize && (name[start] == ' ' || name[start] == '\t'))
+	{
+		start++;
+	}
+	while (nameSize > start && (name[nameSize - 1] == ' ' || name[nameSize - 1] == '\t' || name[nameSize - 1] == '\n' || name[nameSize - 1] == '\r'))
+	{
+		nameSize--;
+	}
+	if (nameSize == start)
+	{
+		strncpy(model, "unknown", size - 1);
+		model[size - 1] = 0;
+		return 1;
+	}
+	nameSize -= start;
+	if (nameSize > size - 1)
+	{
+		nameSize = size - 1;
+	}
+	for (size_t i = 0; i < nameSize; i++)
+	{
+		char c = name[start + i];
+
+		model[i] = (c == '\t' || c == '\n' || c == '\r') ? ' ' : c;
+	}
+	model[nameSize] = 0;
+	return 0;
+}
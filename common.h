@@ -12,6 +12,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include "architecture.h"
 
@@ -69,4 +70,6 @@ enum instructionSets
 
 int constTimeCmpEq(const void *a, const void *b, size_t size);
 void secureClearMemory(void *mem, size_t size);
+uint64_t getTimeUs();
 uint32_t getInstructionSets(uint32_t mask = 0xffffffff);
+int getCpuModel(char *model, size_t size);
@@ -0,0 +1,221 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#pragma once
+
+// C++20 coroutine wrappers for bscrypt_hashAsync() and bscrypt_verifyAsync().
+//
+// int ok = co_await bscrypt::verifyAsync(hash, password, passwordSize, executor);
+//
+// The coroutine is suspended while the lanes run on the library's workers. No
+// thread is blocked. The coroutine is resumed by calling executor(handle) on
+// the worker thread that finished the job. So an executor should just queue
+// the handle on whatever thread you want to resume on (ie your event loop) and
+// return. bscrypt::inlineExecutor resumes right on the worker, which is fine
+// for short continuations but holds up that worker.
+
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+
+#include <coroutine>
+#include <string.h>
+#include "bscrypt.h"
+
+namespace bscrypt
+{
+	struct inlineExecutor
+	{
+		void operator()(std::coroutine_handle<> handle) const
+		{
+			handle.resume();
+		}
+	};
+
+	template <typename Executor>
+	class asyncAwaitable
+	{
+	public:
+		asyncAwaitable(Executor executor) : m_executor(executor)
+		{
+		}
+
+		asyncAwaitable(const asyncAwaitable&) = delete;
+		asyncAwaitable &operator=(const asyncAwaitable&) = delete;
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		int await_resume() noexcept
+		{
+			if (m_hashOut != NULL)
+			{
+				memcpy(m_hashOut, m_job.hash, BSCRYPT_HASH_MAX_SIZE);
+			}
+			return m_job.result;
+		}
+
+	protected:
+		static void resume(bscrypt_async *job)
+		{
+			asyncAwaitable         *self     = (asyncAwaitable*) job->user;
+			Executor                executor = self->m_executor;
+			std::coroutine_handle<> handle   = self->m_handle;
+
+			// This may destroy *self
+			executor(handle);
+		}
+
+		Executor                m_executor;
+		std::coroutine_handle<> m_handle;
+		bscrypt_async           m_job;
+		char                   *m_hashOut = NULL;
+	};
+
+	template <typename Executor>
+	class verifyAwaitable : public asyncAwaitable<Executor>
+	{
+	public:
+		verifyAwaitable(
+			const char *hash,
+			const void *password, size_t passwordSize,
+			Executor    executor, uint32_t maxThreads, int wipeSboxes,
+			DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel) :
+			asyncAwaitable<Executor>(executor),
+			m_hash(hash), m_password(password), m_passwordSize(passwordSize), m_maxThreads(maxThreads), m_wipeSboxes(wipeSboxes),
+			m_encryptFunc(encryptFunc), m_encryptHashParams(encryptHashParams), m_cancel(cancel)
+		{
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			this->m_handle = handle;
+			bscrypt_asyncInit(&this->m_job, asyncAwaitable<Executor>::resume, this);
+			if (bscrypt_verifyAsync(&this->m_job, m_hash, m_password, m_passwordSize, m_maxThreads, m_wipeSboxes, m_encryptFunc, m_encryptHashParams, m_cancel))
+			{
+				// Workers couldn't start so fail without suspending
+				this->m_job.result = 0;
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		const char                     *m_hash;
+		const void                     *m_password;
+		size_t                          m_passwordSize;
+		uint32_t                        m_maxThreads;
+		int                             m_wipeSboxes;
+		DETERMINISTIC_ENCRYPT_HASH_FUNC m_encryptFunc;
+		void                           *m_encryptHashParams;
+		bscrypt_cancelToken            *m_cancel;
+	};
+
+	template <typename Executor>
+	class hashAwaitable : public asyncAwaitable<Executor>
+	{
+	public:
+		hashAwaitable(
+			char        hash[BSCRYPT_HASH_MAX_SIZE],
+			const void *password, size_t passwordSize,
+			uint32_t    memoryKiB, uint32_t iterations, uint32_t parallelism,
+			Executor    executor, uint32_t maxThreads, int wipeSboxes,
+			DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel) :
+			asyncAwaitable<Executor>(executor),
+			m_password(password), m_passwordSize(passwordSize), m_memoryKiB(memoryKiB), m_iterations(iterations), m_parallelism(parallelism),
+			m_maxThreads(maxThreads), m_wipeSboxes(wipeSboxes), m_encryptFunc(encryptFunc), m_encryptHashParams(encryptHashParams), m_cancel(cancel)
+		{
+			this->m_hashOut = hash;
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			this->m_handle = handle;
+			bscrypt_asyncInit(&this->m_job, asyncAwaitable<Executor>::resume, this);
+			if (bscrypt_hashAsync(&this->m_job, m_password, m_passwordSize, m_memoryKiB, m_iterations, m_parallelism, m_maxThreads, m_wipeSboxes, m_encryptFunc, m_encryptHashParams, m_cancel))
+			{
+				// Workers couldn't start so fail without suspending
+				this->m_job.result = 1;
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		const void                     *m_password;
+		size_t                          m_passwordSize;
+		uint32_t                        m_memoryKiB;
+		uint32_t                        m_iterations;
+		uint32_t                        m_parallelism;
+		uint32_t                        m_maxThreads;
+		int                             m_wipeSboxes;
+		DETERMINISTIC_ENCRYPT_HASH_FUNC m_encryptFunc;
+		void                           *m_encryptHashParams;
+		bscrypt_cancelToken            *m_cancel;
+	};
+
+	/**
+	 * Verifies a password against a bscrypt hash on the library's workers.
+	 * co_await gives what bscrypt_verify() returns.
+	 *
+	 * @param const char *hash         - The hash. Must stay valid until resumed.
+	 * @param const void *password     - The password. Must stay valid until resumed.
+	 * @param size_t      passwordSize - Size of the password.
+	 * @param Executor    executor     - Called with the coroutine handle to resume it.
+	 * @param uint32_t    maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+	 * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
+	 * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+	 * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+	 * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+	 * @return An awaitable.
+	 */
+	template <typename Executor = inlineExecutor>
+	verifyAwaitable<Executor> verifyAsync(
+		const char *hash,
+		const void *password, size_t passwordSize,
+		Executor    executor = Executor(), uint32_t maxThreads = 1, int wipeSboxes = 0,
+		DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL, bscrypt_cancelToken *cancel = NULL)
+	{
+		return verifyAwaitable<Executor>(hash, password, passwordSize, executor, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+	}
+
+	/**
+	 * Generates a bscrypt hash on the library's workers. co_await gives what
+	 * bscrypt_hash() returns and the hash is written when resumed.
+	 *
+	 * @param char        hash[BSCRYPT_HASH_MAX_SIZE] - The hash. Written when resumed.
+	 * @param const void *password     - The password. Must stay valid until resumed.
+	 * @param size_t      passwordSize - Size of the password.
+	 * @param uint32_t    memoryKiB    - The size of the sboxes in KiB (m).
+	 * @param uint32_t    iterations   - The number of iterations (t).
+	 * @param uint32_t    parallelism  - The amount of parallelism (p).
+	 * @param Executor    executor     - Called with the coroutine handle to resume it.
+	 * @param uint32_t    maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+	 * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
+	 * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+	 * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+	 * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+	 * @return An awaitable.
+	 */
+	template <typename Executor = inlineExecutor>
+	hashAwaitable<Executor> hashAsync(
+		char        hash[BSCRYPT_HASH_MAX_SIZE],
+		const void *password, size_t passwordSize,
+		uint32_t    memoryKiB, uint32_t iterations, uint32_t parallelism,
+		Executor    executor = Executor(), uint32_t maxThreads = 1, int wipeSboxes = 0,
+		DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL, bscrypt_cancelToken *cancel = NULL)
+	{
+		return hashAwaitable<Executor>(hash, password, passwordSize, memoryKiB, iterations, parallelism, executor, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+	}
+}
+
+#endif
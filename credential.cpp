@@ -0,0 +1,578 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include "credential.h"
+#include "blake2b.h"
+#include "common.h"
+#include "csprng.h"
+#include "threads.h"
+#include <string.h>
+
+const size_t CREDENTIAL_TAG_SIZE = 32;
+
+struct credential_key
+{
+	uint8_t key[32];
+	int     ok;
+};
+
+static credential_key credential_createKey()
+{
+	credential_key key;
+
+	key.ok = getRandom(key.key, sizeof(key.key)) == 0;
+	return key;
+}
+
+static const credential_key *credential_getKey()
+{
+	// Thread safe in C++11
+	static const credential_key key = credential_createKey();
+
+	return &key;
+}
+
+/**
+ * Calculates a tag for a verify request.
+ * tag = BLAKE2b(key || len(hash) || hash || encryptFunc || encryptHashParams || password)
+ *
+ * @param uint8_t     tag[CREDENTIAL_TAG_SIZE] - Receives the tag.
+ * @param const char *hash                     - The hash.
+ * @param const void *password                 - The password.
+ * @param size_t      passwordSize             - Size of the password.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @return On success 0, otherwise non-zero.
+ */
+static int credential_tag(uint8_t tag[CREDENTIAL_TAG_SIZE], const char *hash, const void *password, size_t passwordSize, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams)
+{
+	const credential_key *key      = credential_getKey();
+	blake2b_ctx           ctx;
+	uint64_t              hashSize = strlen(hash);
+
+	if (!key->ok)
+	{
+		return 1;
+	}
+
+	// BLAKE2b doesn't have length extension so prefixing the key is a MAC.
+	// The hash length keeps (hash, password) from sliding into each other.
+	blake2b_init(&ctx, CREDENTIAL_TAG_SIZE);
+	blake2b_update(&ctx, key->key, sizeof(key->key));
+	blake2b_update(&ctx, &hashSize, sizeof(hashSize));
+	blake2b_update(&ctx, hash, (size_t) hashSize);
+	blake2b_update(&ctx, &encryptFunc, sizeof(encryptFunc));
+	blake2b_update(&ctx, &encryptHashParams, sizeof(encryptHashParams));
+	blake2b_update(&ctx, password, passwordSize);
+	blake2b_finish(&ctx, tag);
+	secureClearMemory(&ctx, sizeof(ctx));
+
+	return 0;
+}
+
+/**
+ * Calculates a tag for a hash so entries can be found by hash alone.
+ * tag = BLAKE2b(key || len(hash) || hash)
+ *
+ * @param uint8_t     tag[CREDENTIAL_TAG_SIZE] - Receives the tag.
+ * @param const char *hash                     - The hash.
+ * @return On success 0, otherwise non-zero.
+ */
+static int credential_hashTag(uint8_t tag[CREDENTIAL_TAG_SIZE], const char *hash)
+{
+	const credential_key *key      = credential_getKey();
+	blake2b_ctx           ctx;
+	uint64_t              hashSize = strlen(hash);
+
+	if (!key->ok)
+	{
+		return 1;
+	}
+
+	blake2b_init(&ctx, CREDENTIAL_TAG_SIZE);
+	blake2b_update(&ctx, key->key, sizeof(key->key));
+	blake2b_update(&ctx, &hashSize, sizeof(hashSize));
+	blake2b_update(&ctx, hash, (size_t) hashSize);
+	blake2b_finish(&ctx, tag);
+	secureClearMemory(&ctx, sizeof(ctx));
+
+	return 0;
+}
+
+
+// ********************
+// *** Singleflight ***
+// ********************
+
+// Lives on the stack of the thread running bscrypt_verify()
+struct credential_flight
+{
+	uint8_t            tag[CREDENTIAL_TAG_SIZE];
+	int                result;
+	int                done;
+	uint32_t           waiters;
+	credential_flight *next;
+};
+
+struct credential_flights
+{
+	MUTEX              mutex;
+	COND               cond;
+	credential_flight *head;
+	uint64_t           computed;
+	uint64_t           coalesced;
+};
+
+static credential_flights *credential_createFlights()
+{
+	credential_flights *flights = new credential_flights;
+
+	MUTEX_CREATE(flights->mutex);
+	COND_CREATE(flights->cond);
+	flights->head      = NULL;
+	flights->computed  = 0;
+	flights->coalesced = 0;
+	return flights;
+}
+
+static credential_flights *credential_getFlights()
+{
+	// Thread safe in C++11
+	static credential_flights *flights = credential_createFlights();
+
+	return flights;
+}
+
+/**
+ * Verifies a password against a bscrypt hash. Concurrent calls with the same
+ * hash, password, and encryption get coalesced so only one bscrypt_verify()
+ * runs and the rest wait for its result. Good for retry storms. Calls that
+ * come in after the first one finishes run again.
+ *
+ * @param const char *hash         - The hash.
+ * @param const void *password     - The password.
+ * @param size_t      passwordSize - Size of the password.
+ * @param uint32_t    maxThreads   - The maximum number of threads.
+ * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @return On correct password, non-zero. Otherwise, 0.
+ */
+int bscrypt_verifyCoalesced(const char *hash, const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams)
+{
+	credential_flights *flights = credential_getFlights();
+	credential_flight   flight;
+	int                 ret;
+
+	if (credential_tag(flight.tag, hash, password, passwordSize, encryptFunc, encryptHashParams))
+	{
+		return bscrypt_verify(hash, password, passwordSize, maxThreads, wipeSboxes, encryptFunc, encryptHashParams);
+	}
+
+	MUTEX_LOCK(flights->mutex);
+	for (credential_flight *cur = flights->head; cur != NULL; cur = cur->next)
+	{
+		if (constTimeCmpEq(cur->tag, flight.tag, CREDENTIAL_TAG_SIZE))
+		{
+			// Wait for the first one
+			flights->coalesced++;
+			cur->waiters++;
+			while (!cur->done)
+			{
+				COND_WAIT(flights->cond, flights->mutex);
+			}
+			ret = cur->result;
+			cur->waiters--;
+			if (cur->waiters == 0)
+			{
+				COND_SIGNAL_ALL(flights->cond);
+			}
+			MUTEX_UNLOCK(flights->mutex);
+
+			secureClearMemory(flight.tag, sizeof(flight.tag));
+			return ret;
+		}
+	}
+	flight.result  = 0;
+	flight.done    = 0;
+	flight.waiters = 0;
+	flight.next    = flights->head;
+	flights->head  = &flight;
+	flights->computed++;
+	MUTEX_UNLOCK(flights->mutex);
+
+	ret = bscrypt_verify(hash, password, passwordSize, maxThreads, wipeSboxes, encryptFunc, encryptHashParams);
+
+	MUTEX_LOCK(flights->mutex);
+	// Remove so new calls run again
+	for (credential_flight **cur = &flights->head; *cur != NULL; cur = &(*cur)->next)
+	{
+		if (*cur == &flight)
+		{
+			*cur = flight.next;
+			break;
+		}
+	}
+	flight.result = ret;
+	flight.done   = 1;
+	COND_SIGNAL_ALL(flights->cond);
+
+	// Waiters read from our stack
+	while (flight.waiters != 0)
+	{
+		COND_WAIT(flights->cond, flights->mutex);
+	}
+	MUTEX_UNLOCK(flights->mutex);
+
+	secureClearMemory(flight.tag, sizeof(flight.tag));
+	return ret;
+}
+
+/**
+ * Gets the counts for bscrypt_verifyCoalesced().
+ *
+ * @param bscrypt_coalesceStats *stats - Receives the counts.
+ */
+void bscrypt_getCoalesceStats(bscrypt_coalesceStats *stats)
+{
+	credential_flights *flights = credential_getFlights();
+
+	MUTEX_LOCK(flights->mutex);
+	stats->computed  = flights->computed;
+	stats->coalesced = flights->coalesced;
+	MUTEX_UNLOCK(flights->mutex);
+}
+
+
+// *************
+// *** Cache ***
+// *************
+
+struct credential_cacheEntry
+{
+	uint8_t                tag[CREDENTIAL_TAG_SIZE];
+	uint8_t                hashTag[CREDENTIAL_TAG_SIZE];
+	uint64_t               expiresUs;
+	credential_cacheEntry *chainNext;
+	credential_cacheEntry *lruPrev;
+	credential_cacheEntry *lruNext;
+};
+
+struct credential_cache
+{
+	MUTEX                         mutex;
+	credential_cacheEntry        *entries;
+	credential_cacheEntry       **buckets;
+	credential_cacheEntry        *freeList;
+	credential_cacheEntry        *lruHead; // Most recently used
+	credential_cacheEntry        *lruTail; // Least recently used
+	size_t                        bucketMask;
+	uint32_t                      maxEntries;
+	uint64_t                      ttlUs;
+	bscrypt_credentialCacheStats  stats;
+};
+
+static credential_cache *credential_createCache()
+{
+	credential_cache *cache = new credential_cache;
+
+	MUTEX_CREATE(cache->mutex);
+	cache->entries    = NULL;
+	cache->buckets    = NULL;
+	cache->freeList   = NULL;
+	cache->lruHead    = NULL;
+	cache->lruTail    = NULL;
+	cache->bucketMask = 0;
+	cache->maxEntries = 0;
+	cache->ttlUs      = 0;
+	memset(&cache->stats, 0, sizeof(cache->stats));
+	return cache;
+}
+
+static credential_cache *credential_getCache()
+{
+	// Thread safe in C++11
+	static credential_cache *cache = credential_createCache();
+
+	return cache;
+}
+
+static credential_cacheEntry **credential_cacheBucket(credential_cache *cache, const uint8_t tag[CREDENTIAL_TAG_SIZE])
+{
+	size_t index;
+
+	// Tags are MACs so any bytes are uniform
+	memcpy(&index, tag, sizeof(index));
+	return cache->buckets + (index & cache->bucketMask);
+}
+
+static void credential_cacheLruRemove(credential_cache *cache, credential_cacheEntry *entry)
+{
+	if (entry->lruPrev == NULL) { cache->lruHead = entry->lruNext; } else { entry->lruPrev->lruNext = entry->lruNext; }
+	if (entry->lruNext == NULL) { cache->lruTail = entry->lruPrev; } else { entry->lruNext->lruPrev = entry->lruPrev; }
+}
+
+static void credential_cacheLruPush(credential_cache *cache, credential_cacheEntry *entry)
+{
+	entry->lruPrev = NULL;
+	entry->lruNext = cache->lruHead;
+	if (cache->lruHead == NULL)
+	{
+		cache->lruTail = entry;
+	}
+	else
+	{
+		cache->lruHead->lruPrev = entry;
+	}
+	cache->lruHead = entry;
+}
+
+static void credential_cacheRemove(credential_cache *cache, credential_cacheEntry *entry)
+{
+	for (credential_cacheEntry **cur = credential_cacheBucket(cache, entry->tag); *cur != NULL; cur = &(*cur)->chainNext)
+	{
+		if (*cur == entry)
+		{
+			*cur = entry->chainNext;
+			break;
+		}
+	}
+	credential_cacheLruRemove(cache, entry);
+	secureClearMemory(entry, sizeof(*entry));
+	entry->chainNext = cache->freeList;
+	cache->freeList  = entry;
+	cache->stats.entries--;
+}
+
+static credential_cacheEntry *credential_cacheFind(credential_cache *cache, const uint8_t tag[CREDENTIAL_TAG_SIZE])
+{
+	for (credential_cacheEntry *cur = *credential_cacheBucket(cache, tag); cur != NULL; cur = cur->chainNext)
+	{
+		if (constTimeCmpEq(cur->tag, tag, CREDENTIAL_TAG_SIZE))
+		{
+			return cur;
+		}
+	}
+	return NULL;
+}
+
+static void credential_cacheFree(credential_cache *cache)
+{
+	if (cache->entries != NULL)
+	{
+		secureClearMemory(cache->entries, sizeof(credential_cacheEntry) * cache->maxEntries);
+		delete [] cache->entries;
+		delete [] cache->buckets;
+	}
+	cache->entries       = NULL;
+	cache->buckets       = NULL;
+	cache->freeList      = NULL;
+	cache->lruHead       = NULL;
+	cache->lruTail       = NULL;
+	cache->bucketMask    = 0;
+	cache->maxEntries    = 0;
+	cache->stats.entries = 0;
+}
+
+/**
+ * Sets up the verified credential cache used by bscrypt_verifyCached(). Only
+ * correct passwords are cached and only as a tag, so a hit means "this hash
+ * and password verified within the TTL". When a user's hash changes, the old
+ * entries stop matching. Call bscrypt_credentialCacheInvalidate() with the old
+ * hash to drop them right away (ie on password change). Calling this again
+ * empties the cache.
+ *
+ * @param uint32_t maxEntries - Maximum number of entries or 0 to turn off the cache.
+ * @param uint32_t ttlMs      - How long an entry is good for in milliseconds.
+ */
+void bscrypt_credentialCacheInit(uint32_t maxEntries, uint32_t ttlMs)
+{
+	credential_cache *cache = credential_getCache();
+
+	MUTEX_LOCK(cache->mutex);
+	credential_cacheFree(cache);
+	if (maxEntries != 0 && ttlMs != 0)
+	{
+		size_t buckets = 1;
+
+		while (buckets < maxEntries)
+		{
+			buckets *= 2;
+		}
+		cache->entries    = new credential_cacheEntry[maxEntries];
+		cache->buckets    = new credential_cacheEntry*[buckets];
+		cache->bucketMask = buckets - 1;
+		cache->maxEntries = maxEntries;
+		cache->ttlUs      = (uint64_t) ttlMs * 1000;
+		memset(cache->buckets, 0, sizeof(credential_cacheEntry*) * buckets);
+		for (uint32_t i = 0; i < maxEntries; i++)
+		{
+			cache->entries[i].chainNext = cache->freeList;
+			cache->freeList = cache->entries + i;
+		}
+	}
+	MUTEX_UNLOCK(cache->mutex);
+}
+
+/**
+ * Verifies a password against a bscrypt hash with the verified credential
+ * cache in front. A hit returns without running bscrypt. A miss runs
+ * bscrypt_verifyCoalesced() and caches a correct password.
+ *
+ * @param const char *hash         - The hash.
+ * @param const void *password     - The password.
+ * @param size_t      passwordSize - Size of the password.
+ * @param uint32_t    maxThreads   - The maximum number of threads.
+ * @param int         wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @return On correct password, non-zero. Otherwise, 0.
+ */
+int bscrypt_verifyCached(const char *hash, const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams)
+{
+	credential_cache       *cache = credential_getCache();
+	credential_cacheEntry  *entry;
+	credential_cacheEntry **bucket;
+	uint8_t                 tag[CREDENTIAL_TAG_SIZE];
+	uint8_t                 hashTag[CREDENTIAL_TAG_SIZE];
+	uint64_t                now;
+	int                     ret;
+
+	if (credential_tag(tag, hash, password, passwordSize, encryptFunc, encryptHashParams) ||
+		credential_hashTag(hashTag, hash))
+	{
+		return bscrypt_verify(hash, password, passwordSize, maxThreads, wipeSboxes, encryptFunc, encryptHashParams);
+	}
+
+	// Lookup
+	MUTEX_LOCK(cache->mutex);
+	if (cache->entries != NULL)
+	{
+		now   = getTimeUs();
+		entry = credential_cacheFind(cache, tag);
+		if (entry != NULL)
+		{
+			if (now < entry->expiresUs)
+			{
+				cache->stats.hits++;
+				credential_cacheLruRemove(cache, entry);
+				credential_cacheLruPush(cache, entry);
+				MUTEX_UNLOCK(cache->mutex);
+
+				secureClearMemory(tag, sizeof(tag));
+				return 1;
+			}
+			cache->stats.expired++;
+			credential_cacheRemove(cache, entry);
+		}
+		cache->stats.misses++;
+	}
+	MUTEX_UNLOCK(cache->mutex);
+
+	ret = bscrypt_verifyCoalesced(hash, password, passwordSize, maxThreads, wipeSboxes, encryptFunc, encryptHashParams);
+
+	// Insert
+	MUTEX_LOCK(cache->mutex);
+	if (ret && cache->entries != NULL && credential_cacheFind(cache, tag) == NULL)
+	{
+		if (cache->freeList == NULL)
+		{
+			// Full: drop the least recently used
+			entry = cache->lruTail;
+			if (getTimeUs() >= entry->expiresUs)
+			{
+				cache->stats.expired++;
+			}
+			else
+			{
+				cache->stats.evicted++;
+			}
+			credential_cacheRemove(cache, entry);
+		}
+		entry = cache->freeList;
+		cache->freeList = entry->chainNext;
+
+		memcpy(entry->tag,     tag,     sizeof(tag));
+		memcpy(entry->hashTag, hashTag, sizeof(hashTag));
+		entry->expiresUs = getTimeUs() + cache->ttlUs;
+		bucket = credential_cacheBucket(cache, tag);
+		entry->chainNext = *bucket;
+		*bucket = entry;
+		credential_cacheLruPush(cache, entry);
+		cache->stats.inserts++;
+		cache->stats.entries++;
+	}
+	MUTEX_UNLOCK(cache->mutex);
+
+	secureClearMemory(tag, sizeof(tag));
+	return ret;
+}
+
+/**
+ * Removes all cached entries for a hash. Call this when a user's hash changes.
+ *
+ * @param const char *hash - The old hash.
+ */
+void bscrypt_credentialCacheInvalidate(const char *hash)
+{
+	credential_cache *cache = credential_getCache();
+	uint8_t           hashTag[CREDENTIAL_TAG_SIZE];
+
+	if (credential_hashTag(hashTag, hash))
+	{
+		return;
+	}
+
+	MUTEX_LOCK(cache->mutex);
+	for (credential_cacheEntry *cur = cache->lruHead; cur != NULL;)
+	{
+		credential_cacheEntry *next = cur->lruNext;
+
+		if (constTimeCmpEq(cur->hashTag, hashTag, CREDENTIAL_TAG_SIZE))
+		{
+			cache->stats.invalidated++;
+			credential_cacheRemove(cache, cur);
+		}
+		cur = next;
+	}
+	MUTEX_UNLOCK(cache->mutex);
+}
+
+/**
+ * Removes all cached entries.
+ */
+void bscrypt_credentialCacheClear()
+{
+	credential_cache *cache = credential_getCache();
+
+	MUTEX_LOCK(cache->mutex);
+	while (cache->lruHead != NULL)
+	{
+		cache->stats.invalidated++;
+		credential_cacheRemove(cache, cache->lruHead);
+	}
+	MUTEX_UNLOCK(cache->mutex);
+}
+
+/**
+ * Gets the counts for bscrypt_verifyCached().
+ *
+ * @param bscrypt_credentialCacheStats *stats - Receives the counts.
+ */
+void bscrypt_getCredentialCacheStats(bscrypt_credentialCacheStats *stats)
+{
+	credential_cache *cache = credential_getCache();
+
+	MUTEX_LOCK(cache->mutex);
+	*stats = cache->stats;
+	MUTEX_UNLOCK(cache->mutex);
+}
@@ -0,0 +1,52 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "bscrypt.h"
+
+// Opt-in layers in front of bscrypt_verify(). Requests are matched by a tag
+// which is a keyed BLAKE2b of (hash, password, encryptFunc, encryptHashParams)
+// under a random per-process key. Passwords are never kept.
+
+struct bscrypt_coalesceStats
+{
+	uint64_t computed;  // Verifies that ran bscrypt_verify()
+	uint64_t coalesced; // Verifies that waited on an identical in-flight verify
+};
+
+int bscrypt_verifyCoalesced(
+	const char *hash,
+	const void *password, size_t passwordSize,
+	uint32_t    maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL);
+void bscrypt_getCoalesceStats(bscrypt_coalesceStats *stats);
+
+struct bscrypt_credentialCacheStats
+{
+	uint64_t hits;        // Verifies answered from the cache
+	uint64_t misses;      // Verifies that ran bscrypt
+	uint64_t inserts;     // Correct passwords added
+	uint64_t expired;     // Entries dropped for being past the TTL
+	uint64_t evicted;     // Entries dropped to make room
+	uint64_t invalidated; // Entries dropped by invalidate or clear
+	uint64_t entries;     // Entries now
+};
+
+void bscrypt_credentialCacheInit(uint32_t maxEntries, uint32_t ttlMs);
+int  bscrypt_verifyCached(
+	const char *hash,
+	const void *password, size_t passwordSize,
+	uint32_t    maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL);
+void bscrypt_credentialCacheInvalidate(const char *hash);
+void bscrypt_credentialCacheClear();
+void bscrypt_getCredentialCacheStats(bscrypt_credentialCacheStats *stats);
@@ -15,13 +15,60 @@
 #else
 	#include <sys/types.h>
 	#include <sys/stat.h>
+	#include <errno.h>
 	#include <fcntl.h>
+	#include <pthread.h>
 	#include <unistd.h>
+	#ifdef __linux__
+		#include <sys/syscall.h>
+	#endif
 #endif
 //#include <stdio.h>
 //#include <stdlib.h>
-//#include <string.h>
+#include <limits.h>
+#include <string.h>
 #include "csprng.h"
+#include "blake2b.h"
+#include "common.h"
+
+#ifndef _WIN32
+/**
+ * Fills buffer with random from /dev/urandom.
+ *
+ * @param buffer - Buffer to receive the random data.
+ * @param size   - Size of buffer.
+ * @return Zero on success, otherwise non-zero
+ */
+int getRandomUrandom(void *buffer, size_t size)
+{
+	int fin = open("/dev/urandom", O_RDONLY);
+
+	if (fin == -1)
+	{
+		return 1;
+	}
+
+	while (size > 0)
+	{
+		ssize_t curSize = (ssize_t) size;
+
+		if (size > (size_t) SSIZE_MAX)
+		{
+			curSize = SSIZE_MAX;
+		}
+		if (read(fin, buffer, curSize) != (ssize_t) curSize)
+		{
+			close(fin);
+			return 1;
+		}
+		size -= (size_t) curSize;
+		buffer = ((uint8_t*) buffer) + curSize;
+	}
+	close(fin);
+
+	return 0;
+}
+#endif
 
 /**
  * Fills buffer with random using a CSPRNG.
@@ -60,31 +107,193 @@ int getRandom(void *buffer, size_t size)
 			buffer = ((uint8_t*) buffer) + curSize;
 		}
 #else
-		int fin = open("/dev/urandom", O_RDONLY);
-
-		if (fin == -1)
-		{
-			return 1;
-		}
-
+	#ifdef SYS_getrandom
+		// getrandom(2): one syscall, no file descriptor, and works without /dev
 		while (size > 0)
 		{
-			ssize_t curSize = (ssize_t) size;
+			size_t curSize = size;
 
-			if (size > (size_t) SSIZE_MAX)
+			// Reads up to 256 bytes can't be interrupted
+			if (curSize > 256)
 			{
-				curSize = SSIZE_MAX;
+				curSize = 256;
 			}
-			if (read(fin, buffer, curSize) != (ssize_t) curSize)
+			long ret = syscall(SYS_getrandom, buffer, curSize, 0);
+			if (ret < 0)
 			{
-				close(fin);
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				if (errno == ENOSYS)
+				{
+					// Kernel older than 3.17
+					return getRandomUrandom(buffer, size);
+				}
 				return 1;
 			}
-			size -= (size_t) curSize;
-			buffer = ((uint8_t*) buffer) + curSize;
+			size -= (size_t) ret;
+			buffer = ((uint8_t*) buffer) + ret;
+		}
+	#else
+		return getRandomUrandom(buffer, size);
+	#endif
+#endif
+	}
+
+	return 0;
+}
+
+
+// ***********************
+// *** Buffered CSPRNG ***
+// ***********************
+
+// Fast key erasure: each refill makes one block for the next key and the rest
+// for output. So a state compromise can't recover earlier output.
+const size_t   CSPRNG_KEY_SIZE           = 64;
+const size_t   CSPRNG_BUFFER_SIZE        = 256;
+const uint64_t CSPRNG_RESEED_BYTES       = 1024 * 1024;
+const uint64_t CSPRNG_RESEED_INTERVAL_US = 60 * 1000000;
+
+static volatile uint32_t csprng_forkGeneration = 0;
+
+#ifndef _WIN32
+static void csprng_atforkChild()
+{
+	csprng_forkGeneration = csprng_forkGeneration + 1;
+}
+
+static int csprng_registerAtfork()
+{
+	return pthread_atfork(NULL, NULL, csprng_atforkChild);
+}
+#endif
+
+struct csprng_state
+{
+	uint8_t  key[CSPRNG_KEY_SIZE];
+	uint8_t  buffer[CSPRNG_BUFFER_SIZE];
+	uint64_t counter;
+	uint64_t bytesSinceReseed;
+	uint64_t reseedTimeUs;
+	size_t   available;
+	uint32_t forkGeneration;
+	int      seeded;
+
+	~csprng_state()
+	{
+		secureClearMemory(this, sizeof(*this));
+	}
+};
+
+static int csprng_reseed(csprng_state *state)
+{
+	uint8_t     seed[CSPRNG_KEY_SIZE];
+	blake2b_ctx ctx;
+
+	if (getRandom(seed, sizeof(seed)))
+	{
+		return 1;
+	}
+
+	// key = H(key || seed)
+	blake2b_init(&ctx, CSPRNG_KEY_SIZE);
+	blake2b_update(&ctx, state->key, sizeof(state->key));
+	blake2b_update(&ctx, seed, sizeof(seed));
+	blake2b_finish(&ctx, state->key);
+	secureClearMemory(&ctx, sizeof(ctx));
+	secureClearMemory(seed, sizeof(seed));
+
+	// Drop anything made with the old key
+	secureClearMemory(state->buffer, sizeof(state->buffer));
+	state->available        = 0;
+	state->bytesSinceReseed = 0;
+	state->reseedTimeUs     = getTimeUs();
+	state->forkGeneration   = csprng_forkGeneration;
+	state->seeded           = 1;
+
+	return 0;
+}
+
+static void csprng_refill(csprng_state *state)
+{
+	blake2b_ctx ctx;
+
+	// block = H(key || counter)
+	for (size_t i = 0; i <= CSPRNG_BUFFER_SIZE; i += CSPRNG_KEY_SIZE)
+	{
+		uint8_t *out = state->buffer + i;
+
+		if (i == CSPRNG_BUFFER_SIZE)
+		{
+			out = state->key;
 		}
-		close(fin);
+		blake2b_init(&ctx, CSPRNG_KEY_SIZE);
+		blake2b_update(&ctx, state->key, sizeof(state->key));
+		blake2b_update(&ctx, &state->counter, sizeof(state->counter));
+		blake2b_finish(&ctx, out);
+		state->counter++;
+	}
+	secureClearMemory(&ctx, sizeof(ctx));
+	state->available = CSPRNG_BUFFER_SIZE;
+}
+
+/**
+ * Fills buffer with random from a per thread buffered CSPRNG. Much faster than
+ * getRandom() for small requests like salts. It's seeded from getRandom() and
+ * is reseeded after a fork, every 1 MiB, and every minute.
+ *
+ * @param buffer - Buffer to receive the random data.
+ * @param size   - Size of buffer.
+ * @return Zero on success, otherwise non-zero
+ */
+int getRandomBuffered(void *buffer, size_t size)
+{
+	static thread_local csprng_state state;
+#ifndef _WIN32
+	// Thread safe in C++11
+	static const int atforkRet = csprng_registerAtfork();
+
+	if (atforkRet != 0)
+	{
+		// Can't tell when we're in a child
+		return getRandom(buffer, size);
+	}
 #endif
+
+	if (!state.seeded ||
+		state.forkGeneration != csprng_forkGeneration ||
+		state.bytesSinceReseed >= CSPRNG_RESEED_BYTES ||
+		getTimeUs() - state.reseedTimeUs >= CSPRNG_RESEED_INTERVAL_US)
+	{
+		if (csprng_reseed(&state))
+		{
+			return 1;
+		}
+	}
+
+	state.bytesSinceReseed += size;
+	while (size > 0)
+	{
+		size_t curSize = size;
+
+		if (state.available == 0)
+		{
+			csprng_refill(&state);
+		}
+		if (curSize > state.available)
+		{
+			curSize = state.available;
+		}
+
+		// Take from the end and wipe what was used
+		uint8_t *src = state.buffer + state.available - curSize;
+		memcpy(buffer, src, curSize);
+		secureClearMemory(src, curSize);
+		state.available -= curSize;
+		size            -= curSize;
+		buffer = ((uint8_t*) buffer) + curSize;
 	}
 
 	return 0;
@@ -15,3 +15,7 @@
 #include <stdint.h>
 
 int getRandom(void *buffer, size_t size);
+int getRandomBuffered(void *buffer, size_t size);
+#ifndef _WIN32
+int getRandomUrandom(void *buffer, size_t size);
+#endif
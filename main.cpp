@@ -1,12 +1,1139 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "common.h"
+#include "base64.h"
 #include "bscrypt.h"
+#include "csprng.h"
+#include "record.h"
+#include "threads.h"
+#ifdef _WIN32
+	#include <io.h>
+	#define read _read
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
 
-int main()
+// Starting size of the read buffer for pipes. It grows for longer lines.
+const size_t CLI_READ_SIZE     = 1024 * 1024;
+const size_t CLI_DEFAULT_BATCH = 1024;
+
+// Lines from a file or pipe. Regular files are mapped, everything else is read
+// in chunks. Lines returned by cliInput_batch() are valid until the next call.
+struct cliInput
+{
+	int      fd;
+	uint8_t *map;
+	size_t   mapSize;
+	uint8_t *data;
+	size_t   pos;
+	size_t   size;
+	size_t   cap;
+	int      eof;
+};
+
+// Writes output on its own thread so hashing doesn't wait on it. There's one
+// batch being written and one being made, so a slow reader slows hashing
+// rather than using more memory.
+struct cliWriter
+{
+	FILE       *file;
+	MUTEX       mutex;
+	COND        cond;
+	THREAD      thread;
+	const char *pending;
+	size_t      pendingSize;
+	int         done;
+	int         error;
+};
+
+// Count of stored hashes with one (m, t, p)
+struct censusBucket
+{
+	uint32_t memoryKiB;
+	uint32_t iterations;
+	uint32_t parallelism;
+	uint64_t count;
+	double   verifyMs;
+	int      measured;
+	int      overLimit;
+	int      needsRehash;
+};
+
+// Open addressing table of buckets. One per chunk then merged.
+struct censusTable
+{
+	censusBucket *buckets;
+	size_t        cap;
+	size_t        used;
+	uint64_t      invalid;
+};
+
+struct censusScan
+{
+	const uint8_t *data;
+	size_t         size;
+	size_t         chunkSize;
+	int            binary;
+	censusTable   *tables;
+};
+
+static void benchSalts(const char *name, int (*func)(void*, size_t))
+{
+	TIMER_TYPE s, e;
+	uint8_t    salt[16];
+	uint32_t   count = 100000;
+
+	TIMER_FUNC(s);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (func(salt, sizeof(salt)))
+		{
+			printf("%s: failed\n", name);
+			return;
+		}
+	}
+	TIMER_FUNC(e);
+
+	printf("%s: %.0f salts/s\n", name, count / TIMER_DIFF(s, e));
+}
+
+static void benchBase64(const char *name)
+{
+	TIMER_TYPE s, e;
+	uint8_t    digest[24] = {0};
+	char       encoded[33];
+	uint32_t   count = 1000000;
+	int        err   = 0;
+
+	// Hash sized: 24 bytes <-> 32 characters
+	TIMER_FUNC(s);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		digest[0] = (uint8_t) i;
+		base64Encode(encoded, digest, sizeof(digest));
+	}
+	TIMER_FUNC(e);
+	printf("base64Encode (%s): %.0f digests/s\n", name, count / TIMER_DIFF(s, e));
+
+	TIMER_FUNC(s);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		encoded[0] = (char) ('A' + i % 26);
+		err |= base64Decode(digest, encoded, 32);
+	}
+	TIMER_FUNC(e);
+	printf("base64Decode (%s): %.0f digests/s%s\n", name, count / TIMER_DIFF(s, e), err ? " (failed)" : "");
+}
+
+
+/**
+ * @param const char *path - The file or NULL for stdin.
+ * @return On success 0, otherwise non-zero.
+ */
+static int cliInput_open(cliInput *input, const char *path)
+{
+	input->fd      = 0;
+	input->map     = NULL;
+	input->mapSize = 0;
+	input->data    = NULL;
+	input->pos     = 0;
+	input->size    = 0;
+	input->cap     = 0;
+	input->eof     = 0;
+
+	if (path != NULL)
+	{
+		FILE *file = fopen(path, "rb");
+
+		if (file == NULL)
+		{
+			perror(path);
+			return 1;
+		}
+		input->fd = dup(fileno(file));
+		fclose(file);
+		if (input->fd == -1)
+		{
+			perror(path);
+			return 1;
+		}
+	}
+
+#ifndef _WIN32
+	struct stat st;
+
+	if (fstat(input->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, input->fd, 0);
+
+		if (map != MAP_FAILED)
+		{
+			madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+			input->map     = (uint8_t*) map;
+			input->mapSize = (size_t) st.st_size;
+			input->data    = input->map;
+			input->size    = input->mapSize;
+			input->eof     = 1;
+			return 0;
+		}
+	}
+#endif
+
+	input->cap  = CLI_READ_SIZE;
+	input->data = new uint8_t[input->cap];
+	return 0;
+}
+
+static void cliInput_close(cliInput *input)
+{
+#ifndef _WIN32
+	if (input->map != NULL)
+	{
+		munmap(input->map, input->mapSize);
+	}
+#endif
+	if (input->map == NULL)
+	{
+		secureClearMemory(input->data, input->cap);
+		delete [] input->data;
+	}
+	if (input->fd != 0)
+	{
+		close(input->fd);
+	}
+}
+
+/**
+ * Reads more into the buffer. Lines already returned must be done with.
+ *
+ * @param int grow - Grow the buffer if it's full.
+ * @return On success 0, otherwise non-zero.
+ */
+static int cliInput_fill(cliInput *input, int grow)
+{
+	size_t oldSize = input->size;
+
+	if (input->eof)
+	{
+		return 0;
+	}
+
+	// Move the partial line to the front
+	input->size -= input->pos;
+	memmove(input->data, input->data + input->pos, input->size);
+	secureClearMemory(input->data + input->size, oldSize - input->size);
+	input->pos = 0;
+
+	if (grow && input->size == input->cap)
+	{
+		uint8_t *data = new uint8_t[2 * input->cap];
+
+		memcpy(data, input->data, input->size);
+		secureClearMemory(input->data, input->cap);
+		delete [] input->data;
+		input->data = data;
+		input->cap *= 2;
+	}
+
+	while (input->size < input->cap)
+	{
+		int ret = (int) read(input->fd, input->data + input->size, (unsigned) (input->cap - input->size > 0x40000000 ? 0x40000000 : input->cap - input->size));
+
+		if (ret < 0)
+		{
+			perror("read");
+			return 1;
+		}
+		if (ret == 0)
+		{
+			input->eof = 1;
+			break;
+		}
+		input->size += (size_t) ret;
+		// Don't wait for a full buffer if there's a line to work on
+		if (memchr(input->data + input->size - ret, '\n', (size_t) ret) != NULL)
+		{
+			break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Gets up to maxLines lines without their line endings.
+ *
+ * @return Number of lines or (size_t) -1 on error. 0 is the end.
+ */
+static size_t cliInput_batch(cliInput *input, const uint8_t **lines, size_t *lineSizes, size_t maxLines)
+{
+	size_t count = 0;
+
+	if (cliInput_fill(input, 0))
+	{
+		return (size_t) -1;
+	}
+	while (count < maxLines)
+	{
+		const uint8_t *line      = input->data + input->pos;
+		size_t         remaining = input->size - input->pos;
+		const uint8_t *end;
+		size_t         lineSize;
+
+		if (remaining == 0 && input->eof)
+		{
+			break;
+		}
+		end = (const uint8_t*) memchr(line, '\n', remaining);
+		if (end == NULL && !input->eof)
+		{
+			if (count > 0)
+			{
+				break;
+			}
+			// Need more for even one line
+			if (cliInput_fill(input, 1))
+			{
+				return (size_t) -1;
+			}
+			continue;
+		}
+
+		lineSize = end == NULL ? remaining : (size_t) (end - line);
+		input->pos += lineSize + (end != NULL);
+		if (lineSize > 0 && line[lineSize - 1] == '\r')
+		{
+			lineSize--;
+		}
+		lines[count]     = line;
+		lineSizes[count] = lineSize;
+		count++;
+	}
+	return count;
+}
+
+static void *cliWriter_thread(void *arg)
+{
+	cliWriter *writer = (cliWriter*) arg;
+
+	MUTEX_LOCK(writer->mutex);
+	while (1)
+	{
+		while (writer->pending == NULL && !writer->done)
+		{
+			COND_WAIT(writer->cond, writer->mutex);
+		}
+		if (writer->pending == NULL)
+		{
+			break;
+		}
+		MUTEX_UNLOCK(writer->mutex);
+		if (fwrite(writer->pending, 1, writer->pendingSize, writer->file) != writer->pendingSize ||
+			fflush(writer->file) != 0)
+		{
+			writer->error = 1;
+		}
+		MUTEX_LOCK(writer->mutex);
+		// Done with the buffer only now
+		writer->pending = NULL;
+		COND_SIGNAL_ALL(writer->cond);
+	}
+	MUTEX_UNLOCK(writer->mutex);
+	return NULL;
+}
+
+static int cliWriter_start(cliWriter *writer, FILE *file)
+{
+	writer->file        = file;
+	writer->pending     = NULL;
+	writer->pendingSize = 0;
+	writer->done        = 0;
+	writer->error       = 0;
+	MUTEX_CREATE(writer->mutex);
+	COND_CREATE(writer->cond);
+	if (THREAD_CREATE(writer->thread, cliWriter_thread, writer))
+	{
+		COND_DELETE(writer->cond);
+		MUTEX_DELETE(writer->mutex);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Hands a buffer to the writer. Waits for the previous buffer to be written,
+ * so that one can be reused after this returns.
+ */
+static void cliWriter_put(cliWriter *writer, const char *data, size_t size)
+{
+	MUTEX_LOCK(writer->mutex);
+	while (writer->pending != NULL)
+	{
+		COND_WAIT(writer->cond, writer->mutex);
+	}
+	writer->pending     = data;
+	writer->pendingSize = size;
+	COND_SIGNAL_ALL(writer->cond);
+	MUTEX_UNLOCK(writer->mutex);
+}
+
+/**
+ * @return On success 0, otherwise non-zero.
+ */
+static int cliWriter_finish(cliWriter *writer)
+{
+	MUTEX_LOCK(writer->mutex);
+	writer->done = 1;
+	COND_SIGNAL_ALL(writer->cond);
+	MUTEX_UNLOCK(writer->mutex);
+	THREAD_WAIT(writer->thread);
+	COND_DELETE(writer->cond);
+	MUTEX_DELETE(writer->mutex);
+	return writer->error;
+}
+
+static void cliUsage()
+{
+	fprintf(stderr,
+		"bscrypt hash [-m memoryKiB] [-t iterations] [-p parallelism] [-j workers] [-b batch] [file]\n"
+		"  Reads one password per line. Writes one hash per line or \"error\".\n"
+		"bscrypt verify [-j workers] [-b batch] [file]\n"
+		"  Reads \"hash password\" per line (split at the first space or tab).\n"
+		"  Writes 1 for a correct password, 0 for wrong, or \"error\".\n"
+		"bscrypt census [-m memoryKiB] [-t iterations] [-p parallelism] [-r loginsPerSecond] [-n measure] [-x maxFactor] [-j workers] [-B] [file]\n"
+		"  Reads a dump of hashes (anything with \"$bscrypt$...\" on each line, or\n"
+		"  64 byte records with -B). Prints a histogram of settings, which ones\n"
+		"  bscrypt_needsRehash() would upgrade to -m -t -p, and cost estimates.\n"
+		"  -r is the login rate (default 100) and -n is how many of the most common\n"
+		"  settings to time (default 32). Settings with more than -x times the\n"
+		"  work (m*t*p) or memory of -m -t -p aren't timed (default 16).\n"
+		"bscrypt calibrate [-T targetMs] [-m memoryKiB] [-p parallelism] [-j maxThreads] [-f profile]\n"
+		"  Prints the smallest t that takes at least -T ms (default 100) on this\n"
+		"  machine and meets the security floor. With -f, results are cached in a\n"
+		"  tuning profile keyed by CPU model. -j 0 (default) is all cores.\n"
+		"bscrypt bench\n"
+		"  Times salt generation, base64, and a table of settings.\n"
+		"\n"
+		"  file  Read from this instead of stdin. Output is in input order.\n"
+		"  -m    Default 256\n"
+		"  -t    Default 80\n"
+		"  -p    Default 1\n"
+		"  -j    Worker threads (default one per core)\n"
+		"  -b    Records per batch (default 1024)\n"
+		"Records/s goes to stderr at the end.\n");
+}
+
+static int cliParseUint(const char *str, uint32_t &num)
+{
+	char          *end;
+	unsigned long  value = strtoul(str, &end, 10);
+
+	if (end == str || *end != 0 || value > UINT32_MAX)
+	{
+		return 1;
+	}
+	num = (uint32_t) value;
+	return 0;
+}
+
+/**
+ * Hashes or verifies every line of the input with all cores. Batches go
+ * through bscrypt_ctxHashBatch() or bscrypt_ctxVerifyBatch() while the last
+ * batch's output is being written.
+ */
+static int cmdBulk(int verify, int argc, char *argv[])
+{
+	bscrypt_ctx      ctx;
+	cliInput         input;
+	cliWriter        writer;
+	TIMER_TYPE       s, e;
+	const char      *path        = NULL;
+	uint32_t         memoryKiB   = 256;
+	uint32_t         iterations  = 80;
+	uint32_t         parallelism = 1;
+	uint32_t         workers     = 0;
+	uint32_t         batchSize   = CLI_DEFAULT_BATCH;
+	const uint8_t  **lines;
+	size_t          *lineSizes;
+	const void     **passwords;
+	size_t          *passwordSizes;
+	char           (*hashes)[BSCRYPT_HASH_MAX_SIZE];
+	const char     **hashPtrs;
+	int             *results;
+	uint8_t         *valid;
+	char            *out[2];
+	size_t           outCap;
+	uint64_t         records = 0;
+	uint64_t         failed  = 0;
+	int              ret     = 0;
+
+	for (int i = 0; i < argc; i++)
+	{
+		uint32_t *num = NULL;
+
+		if (argv[i][0] != '-' || argv[i][1] == 0)
+		{
+			if (path != NULL || i + 1 != argc)
+			{
+				cliUsage();
+				return 1;
+			}
+			path = argv[i];
+			continue;
+		}
+		if      (strcmp(argv[i], "-m") == 0 && !verify) { num = &memoryKiB;   }
+		else if (strcmp(argv[i], "-t") == 0 && !verify) { num = &iterations;  }
+		else if (strcmp(argv[i], "-p") == 0 && !verify) { num = &parallelism; }
+		else if (strcmp(argv[i], "-j") == 0)            { num = &workers;     }
+		else if (strcmp(argv[i], "-b") == 0)            { num = &batchSize;   }
+		if (num == NULL || i + 1 >= argc || cliParseUint(argv[++i], *num) || (num == &batchSize && batchSize == 0))
+		{
+			cliUsage();
+			return 1;
+		}
+	}
+	if (path != NULL && strcmp(path, "-") == 0)
+	{
+		path = NULL;
+	}
+
+	if (cliInput_open(&input, path))
+	{
+		return 1;
+	}
+	if (bscrypt_ctxInit(&ctx, workers))
+	{
+		fprintf(stderr, "Warning: failed to start workers\n");
+	}
+	if (cliWriter_start(&writer, stdout))
+	{
+		fprintf(stderr, "Failed to start writer\n");
+		bscrypt_ctxDestroy(&ctx);
+		cliInput_close(&input);
+		return 1;
+	}
+
+	lines         = new const uint8_t*[batchSize];
+	lineSizes     = new size_t[batchSize];
+	passwords     = new const void*[batchSize];
+	passwordSizes = new size_t[batchSize];
+	hashes        = new char[batchSize][BSCRYPT_HASH_MAX_SIZE];
+	hashPtrs      = new const char*[batchSize];
+	results       = new int[batchSize];
+	valid         = new uint8_t[batchSize];
+	outCap        = (size_t) batchSize * BSCRYPT_HASH_MAX_SIZE;
+	out[0]        = new char[outCap];
+	out[1]        = new char[outCap];
+
+	TIMER_FUNC(s);
+	for (uint32_t which = 0; ; which ^= 1)
+	{
+		size_t count   = cliInput_batch(&input, lines, lineSizes, batchSize);
+		size_t outSize = 0;
+
+		if (count == (size_t) -1)
+		{
+			ret = 1;
+			break;
+		}
+		if (count == 0)
+		{
+			break;
+		}
+
+		if (verify)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				const uint8_t  *sep = (const uint8_t*) memchr(lines[i], ' ', lineSizes[i]);
+				const uint8_t  *tab = (const uint8_t*) memchr(lines[i], '\t', lineSizes[i]);
+				bscrypt_params  params;
+				size_t          hashSize;
+
+				if (sep == NULL || (tab != NULL && tab < sep))
+				{
+					sep = tab;
+				}
+				hashSize = sep == NULL ? 0 : (size_t) (sep - lines[i]);
+				if (hashSize >= BSCRYPT_HASH_MAX_SIZE)
+				{
+					hashSize = 0;
+				}
+				memcpy(hashes[i], lines[i], hashSize);
+				hashes[i][hashSize] = 0;
+				hashPtrs[i]      = hashes[i];
+				passwords[i]     = hashSize == 0 ? lines[i] : sep + 1;
+				passwordSizes[i] = hashSize == 0 ? 0 : lineSizes[i] - hashSize - 1;
+				// The batch skips bad hashes but doesn't say which were bad
+				valid[i] = hashSize != 0 && bscrypt_parseHash(&params, hashes[i]) == 0;
+				secureClearMemory(&params, sizeof(params));
+			}
+			bscrypt_ctxVerifyBatch(&ctx, hashPtrs, passwords, passwordSizes, count, results);
+			for (size_t i = 0; i < count; i++)
+			{
+				const char *str = "error\n";
+
+				if (valid[i])
+				{
+					str = results[i] ? "1\n" : "0\n";
+				}
+				else
+				{
+					failed++;
+				}
+				memcpy(out[which] + outSize, str, strlen(str));
+				outSize += strlen(str);
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				passwords[i]     = lines[i];
+				passwordSizes[i] = lineSizes[i];
+			}
+			bscrypt_ctxHashBatch(&ctx, hashes, passwords, passwordSizes, count, results, memoryKiB, iterations, parallelism);
+			for (size_t i = 0; i < count; i++)
+			{
+				const char *str = results[i] == 0 ? hashes[i] : "error";
+				size_t      len = strlen(str);
+
+				if (results[i] != 0)
+				{
+					failed++;
+				}
+				memcpy(out[which] + outSize, str, len);
+				out[which][outSize + len] = '\n';
+				outSize += len + 1;
+			}
+		}
+		records += count;
+
+		// Blocks until the other buffer is written
+		cliWriter_put(&writer, out[which], outSize);
+	}
+	if (cliWriter_finish(&writer))
+	{
+		fprintf(stderr, "Failed to write output\n");
+		ret = 1;
+	}
+	TIMER_FUNC(e);
+
+	fprintf(stderr, "%llu records (%llu failed) in %.3f s: %.1f records/s\n",
+		(unsigned long long) records, (unsigned long long) failed, TIMER_DIFF(s, e), records / TIMER_DIFF(s, e));
+
+	secureClearMemory(passwordSizes, batchSize * sizeof(size_t));
+	delete [] lines;
+	delete [] lineSizes;
+	delete [] passwords;
+	delete [] passwordSizes;
+	delete [] hashes;
+	delete [] hashPtrs;
+	delete [] results;
+	delete [] valid;
+	delete [] out[0];
+	delete [] out[1];
+	bscrypt_ctxDestroy(&ctx);
+	cliInput_close(&input);
+	return ret;
+}
+
+static void censusTable_init(censusTable *table, size_t cap)
+{
+	table->buckets = new censusBucket[cap];
+	table->cap     = cap;
+	table->used    = 0;
+	table->invalid = 0;
+	memset(table->buckets, 0, cap * sizeof(censusBucket));
+}
+
+static void censusTable_add(censusTable *table, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, uint64_t count)
+{
+	size_t        mask = table->cap - 1;
+	size_t        i    = (memoryKiB * 0x9e3779b1u ^ iterations * 0x85ebca77u ^ parallelism * 0xc2b2ae3du) & mask;
+	censusBucket *bucket;
+
+	while (1)
+	{
+		bucket = table->buckets + i;
+		if (bucket->count == 0)
+		{
+			break;
+		}
+		if (bucket->memoryKiB == memoryKiB && bucket->iterations == iterations && bucket->parallelism == parallelism)
+		{
+			bucket->count += count;
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+
+	bucket->memoryKiB   = memoryKiB;
+	bucket->iterations  = iterations;
+	bucket->parallelism = parallelism;
+	bucket->count       = count;
+	table->used++;
+	if (2 * table->used > table->cap)
+	{
+		censusTable old = *table;
+
+		censusTable_init(table, 2 * old.cap);
+		table->invalid = old.invalid;
+		for (size_t j = 0; j < old.cap; j++)
+		{
+			if (old.buckets[j].count != 0)
+			{
+				censusTable_add(table, old.buckets[j].memoryKiB, old.buckets[j].iterations, old.buckets[j].parallelism, old.buckets[j].count);
+			}
+		}
+		delete [] old.buckets;
+	}
+}
+
+/**
+ * Counts settings in one chunk. Text lines belong to the chunk they start in.
+ * A line can be just the hash or have other fields around it (like
+ * "user:hash password") as long as the hash is followed by white space.
+ */
+static void censusScanChunk(void *arg, size_t chunk)
+{
+	censusScan    *scan  = (censusScan*) arg;
+	censusTable   *table = scan->tables + chunk;
+	size_t         start = chunk * scan->chunkSize;
+	size_t         end   = start + scan->chunkSize;
+	bscrypt_params params;
+
+	if (end > scan->size)
+	{
+		end = scan->size;
+	}
+
+	if (scan->binary)
+	{
+		for (size_t i = start; i + BSCRYPT_RECORD_SIZE <= end; i += BSCRYPT_RECORD_SIZE)
+		{
+			if (bscrypt_recordToParams(&params, scan->data + i) == 0)
+			{
+				censusTable_add(table, params.memoryKiB, params.iterations, params.parallelism, 1);
+			}
+			else
+			{
+				table->invalid++;
+			}
+		}
+		return;
+	}
+
+	if (start > 0 && scan->data[start - 1] != '\n')
+	{
+		const uint8_t *next = (const uint8_t*) memchr(scan->data + start, '\n', end - start);
+
+		start = next == NULL ? end : (size_t) (next - scan->data) + 1;
+	}
+	while (start < end)
+	{
+		const uint8_t *line    = scan->data + start;
+		const uint8_t *lineEnd = (const uint8_t*) memchr(line, '\n', scan->size - start);
+		const uint8_t *hash    = line;
+		size_t         lineSize;
+		size_t         hashSize;
+		char           hashStr[BSCRYPT_HASH_MAX_SIZE];
+
+		lineSize = lineEnd == NULL ? scan->size - start : (size_t) (lineEnd - line);
+		start   += lineSize + 1;
+
+		// Find "$bscrypt$"
+		while ((hash = (const uint8_t*) memchr(hash, '$', lineSize - (size_t) (hash - line))) != NULL)
+		{
+			if (lineSize - (size_t) (hash - line) >= 9 && memcmp(hash, "$bscrypt$", 9) == 0)
+			{
+				break;
+			}
+			hash++;
+		}
+		if (hash == NULL)
+		{
+			// Skip blank lines
+			for (hashSize = 0; hashSize < lineSize && (line[hashSize] == ' ' || line[hashSize] == '\t' || line[hashSize] == '\r'); hashSize++)
+			{
+			}
+			if (hashSize < lineSize)
+			{
+				table->invalid++;
+			}
+			continue;
+		}
+
+		for (hashSize = 0; hash + hashSize < line + lineSize && hash[hashSize] != ' ' && hash[hashSize] != '\t' && hash[hashSize] != '\r'; hashSize++)
+		{
+		}
+		if (hashSize >= BSCRYPT_HASH_MAX_SIZE)
+		{
+			table->invalid++;
+			continue;
+		}
+		memcpy(hashStr, hash, hashSize);
+		hashStr[hashSize] = 0;
+		if (bscrypt_parseHash(&params, hashStr) == 0)
+		{
+			censusTable_add(table, params.memoryKiB, params.iterations, params.parallelism, 1);
+		}
+		else
+		{
+			table->invalid++;
+		}
+	}
+}
+
+static int censusBucketCmp(const void *a, const void *b)
+{
+	const censusBucket *x = (const censusBucket*) a;
+	const censusBucket *y = (const censusBucket*) b;
+
+	if (x->count != y->count)
+	{
+		return x->count < y->count ? 1 : -1;
+	}
+	if (x->memoryKiB != y->memoryKiB)
+	{
+		return x->memoryKiB < y->memoryKiB ? -1 : 1;
+	}
+	if (x->iterations != y->iterations)
+	{
+		return x->iterations < y->iterations ? -1 : 1;
+	}
+	return x->parallelism < y->parallelism ? -1 : (x->parallelism > y->parallelism);
+}
+
+/**
+ * Times a verify with these settings on one thread. Runs for about 0.2 s.
+ *
+ * @return Milliseconds per verify or a negative number on error.
+ */
+static double censusMeasure(bscrypt_ctx *ctx, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism, char hash[BSCRYPT_HASH_MAX_SIZE])
+{
+	TIMER_TYPE s, e;
+	double     seconds;
+	uint32_t   count = 0;
+
+	if (bscrypt_ctxHash(ctx, hash, "password", sizeof("password") - 1, memoryKiB, iterations, parallelism))
+	{
+		return -1.0;
+	}
+	TIMER_FUNC(s);
+	do
+	{
+		bscrypt_ctxVerify(ctx, hash, "password", sizeof("password") - 1);
+		count++;
+		TIMER_FUNC(e);
+		seconds = TIMER_DIFF(s, e);
+	} while (seconds < 0.2 && count < 1000);
+	return seconds / count * 1000;
+}
+
+/**
+ * Histogram of the settings in a dump of hashes, which ones
+ * bscrypt_needsRehash() would upgrade, and what verifying and rehashing them
+ * costs on this machine.
+ */
+static int cmdCensus(int argc, char *argv[])
+{
+	bscrypt_ctx   ctx;
+	cliInput      input;
+	censusScan    scan;
+	censusTable   total;
+	censusBucket *buckets;
+	TIMER_TYPE    s, e;
+	char          hash[BSCRYPT_HASH_MAX_SIZE];
+	const char   *path         = NULL;
+	uint32_t      memoryKiB    = 256;
+	uint32_t      iterations   = 80;
+	uint32_t      parallelism  = 1;
+	uint32_t      loginRate    = 100;
+	uint32_t      maxMeasured  = 32;
+	uint32_t      maxFactor    = 16;
+	uint32_t      workers      = 0;
+	int           binary       = 0;
+	size_t        numChunks;
+	size_t        numBuckets   = 0;
+	uint64_t      numHashes    = 0;
+	uint64_t      numRehash    = 0;
+	uint64_t      numOverLimit = 0;
+	size_t        numOverLimitSettings = 0;
+	double        nowCoreMs    = 0;
+	double        measuredShare = 0;
+	double        targetMs;
+
+	for (int i = 0; i < argc; i++)
+	{
+		uint32_t *num = NULL;
+
+		if (argv[i][0] != '-' || argv[i][1] == 0)
+		{
+			if (path != NULL || i + 1 != argc)
+			{
+				cliUsage();
+				return 1;
+			}
+			path = argv[i];
+			continue;
+		}
+		if (strcmp(argv[i], "-B") == 0)
+		{
+			binary = 1;
+			continue;
+		}
+		if      (strcmp(argv[i], "-m") == 0) { num = &memoryKiB;   }
+		else if (strcmp(argv[i], "-t") == 0) { num = &iterations;  }
+		else if (strcmp(argv[i], "-p") == 0) { num = &parallelism; }
+		else if (strcmp(argv[i], "-r") == 0) { num = &loginRate;   }
+		else if (strcmp(argv[i], "-n") == 0) { num = &maxMeasured; }
+		else if (strcmp(argv[i], "-x") == 0) { num = &maxFactor;   }
+		else if (strcmp(argv[i], "-j") == 0) { num = &workers;     }
+		if (num == NULL || i + 1 >= argc || cliParseUint(argv[++i], *num))
+		{
+			cliUsage();
+			return 1;
+		}
+	}
+	if (path != NULL && strcmp(path, "-") == 0)
+	{
+		path = NULL;
+	}
+
+	if (cliInput_open(&input, path))
+	{
+		return 1;
+	}
+	// Pipes are read in full
+	while (!input.eof)
+	{
+		if (cliInput_fill(&input, 1))
+		{
+			cliInput_close(&input);
+			return 1;
+		}
+	}
+	if (bscrypt_ctxInit(&ctx, workers))
+	{
+		fprintf(stderr, "Warning: failed to start workers\n");
+	}
+
+	// Scan
+	TIMER_FUNC(s);
+	scan.data      = input.data;
+	scan.size      = input.size;
+	scan.binary    = binary;
+	scan.chunkSize = 4 * 1024 * 1024;
+	numChunks      = (scan.size + scan.chunkSize - 1) / scan.chunkSize;
+	scan.tables    = new censusTable[numChunks + 1];
+	for (size_t i = 0; i < numChunks; i++)
+	{
+		censusTable_init(scan.tables + i, 16);
+	}
+	bscrypt_ctxParallelFor(&ctx, numChunks, 1, censusScanChunk, &scan);
+
+	censusTable_init(&total, 16);
+	if (binary && scan.size % BSCRYPT_RECORD_SIZE != 0)
+	{
+		total.invalid++;
+	}
+	for (size_t i = 0; i < numChunks; i++)
+	{
+		for (size_t j = 0; j < scan.tables[i].cap; j++)
+		{
+			censusBucket *bucket = scan.tables[i].buckets + j;
+
+			if (bucket->count != 0)
+			{
+				censusTable_add(&total, bucket->memoryKiB, bucket->iterations, bucket->parallelism, bucket->count);
+			}
+		}
+		total.invalid += scan.tables[i].invalid;
+		delete [] scan.tables[i].buckets;
+	}
+	delete [] scan.tables;
+	TIMER_FUNC(e);
+
+	// Sort by count
+	buckets = new censusBucket[total.used + 1];
+	for (size_t j = 0; j < total.cap; j++)
+	{
+		if (total.buckets[j].count != 0)
+		{
+			buckets[numBuckets] = total.buckets[j];
+			numHashes += buckets[numBuckets].count;
+			numBuckets++;
+		}
+	}
+	qsort(buckets, numBuckets, sizeof(censusBucket), censusBucketCmp);
+	fprintf(stderr, "Scanned %llu hashes (%llu unparseable) in %.3f s\n",
+		(unsigned long long) numHashes, (unsigned long long) total.invalid, TIMER_DIFF(s, e));
+
+	// Measure one thread per verify like a server with p=1 requests
+	ctx.maxThreads = 1;
+	targetMs = censusMeasure(&ctx, memoryKiB, iterations, parallelism, hash);
+	// The dump's settings are untrusted so don't time anything far over the target
+	double maxWork = (double) memoryKiB * iterations * parallelism * maxFactor;
+	ctx.maxMemoryKiB = (uint64_t) memoryKiB * maxFactor < MEMORY_KIB_MAX ? memoryKiB * maxFactor : MEMORY_KIB_MAX;
+	for (size_t i = 0; i < numBuckets; i++)
+	{
+		censusBucket  *bucket = buckets + i;
+		bscrypt_params params;
+
+		bucket->overLimit =
+			bucket->memoryKiB > ctx.maxMemoryKiB ||
+			(double) bucket->memoryKiB * bucket->iterations * bucket->parallelism > maxWork;
+		if (bucket->overLimit)
+		{
+			numOverLimit += bucket->count;
+			numOverLimitSettings++;
+		}
+		else if (i < maxMeasured)
+		{
+			bucket->verifyMs = censusMeasure(&ctx, bucket->memoryKiB, bucket->iterations, bucket->parallelism, hash);
+			bucket->measured = bucket->verifyMs >= 0;
+		}
+		if (bucket->measured)
+		{
+			nowCoreMs     += bucket->verifyMs * bucket->count / numHashes;
+			measuredShare += (double) bucket->count / numHashes;
+		}
+
+		// Only the settings matter to bscrypt_needsRehash()
+		memset(&params, 0, sizeof(params));
+		params.memoryKiB   = bucket->memoryKiB;
+		params.iterations  = bucket->iterations;
+		params.parallelism = bucket->parallelism;
+		params.digestSize  = 32;
+		bucket->needsRehash = bscrypt_formatHash(hash, &params) != 0 || bscrypt_needsRehash(hash, memoryKiB, iterations, parallelism) != 0;
+		if (bucket->needsRehash)
+		{
+			numRehash += bucket->count;
+		}
+	}
+
+	// Report
+	printf("%-32s %12s %8s %10s %s\n", "Settings", "Count", "Share", "Verify ms", "Rehash");
+	for (size_t i = 0; i < numBuckets; i++)
+	{
+		char settings[64];
+		char verifyMs[32];
+
+		snprintf(settings, sizeof(settings), "m=%u,t=%u,p=%u", buckets[i].memoryKiB, buckets[i].iterations, buckets[i].parallelism);
+		if (buckets[i].measured)
+		{
+			snprintf(verifyMs, sizeof(verifyMs), "%.3f", buckets[i].verifyMs);
+		}
+		else if (buckets[i].overLimit)
+		{
+			snprintf(verifyMs, sizeof(verifyMs), "over -x");
+		}
+		else
+		{
+			snprintf(verifyMs, sizeof(verifyMs), "-");
+		}
+		printf("%-32s %12llu %7.2f%% %10s %s\n", settings, (unsigned long long) buckets[i].count,
+			100.0 * buckets[i].count / numHashes, verifyMs, buckets[i].needsRehash ? "yes" : "no");
+	}
+	printf("\n");
+	printf("Target m=%u,t=%u,p=%u: %.3f ms per verify or hash\n", memoryKiB, iterations, parallelism, targetMs);
+	printf("Needs rehash: %llu of %llu (%.2f%%)\n", (unsigned long long) numRehash, (unsigned long long) numHashes,
+		numHashes == 0 ? 0.0 : 100.0 * numRehash / numHashes);
+	if (numOverLimitSettings > 0)
+	{
+		printf("Not timed for being over %ux the target's work or memory: %llu settings, %llu hashes (%.2f%%)\n", maxFactor,
+			(unsigned long long) numOverLimitSettings, (unsigned long long) numOverLimit, 100.0 * numOverLimit / numHashes);
+	}
+	if (numHashes > 0 && targetMs >= 0)
+	{
+		if (measuredShare < 1.0)
+		{
+			printf("(Costs below only cover the %.2f%% of hashes that were measured, see -n and -x)\n", 100.0 * measuredShare);
+		}
+		printf("At %u logins/s spread like this store:\n", loginRate);
+		if (measuredShare > 0)
+		{
+			printf("  Cores for verifies now:          %.2f\n", nowCoreMs / measuredShare * loginRate / 1000);
+		}
+		printf("  Cores for verifies after rehash: %.2f\n", targetMs * loginRate / 1000);
+		printf("Rehash wave: %.2f core-hours of extra hashing on top of the logins' verifies\n", targetMs * numRehash / 1000 / 3600);
+	}
+
+	delete [] buckets;
+	delete [] total.buckets;
+	bscrypt_ctxDestroy(&ctx);
+	cliInput_close(&input);
+	return 0;
+}
+
+static int cmdCalibrate(int argc, char *argv[])
+{
+	const char *profilePath = NULL;
+	uint32_t    targetMs    = 100;
+	uint32_t    memoryKiB   = 256;
+	uint32_t    parallelism = 1;
+	uint32_t    maxThreads  = BSCRYPT_THREADS_AUTO;
+	uint32_t    iterations;
+	TIMER_TYPE  s, e;
+	char        hash[BSCRYPT_HASH_MAX_SIZE];
+
+	for (int i = 0; i < argc; i++)
+	{
+		uint32_t *num = NULL;
+
+		if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+		{
+			profilePath = argv[++i];
+			continue;
+		}
+		if      (strcmp(argv[i], "-T") == 0) { num = &targetMs;    }
+		else if (strcmp(argv[i], "-m") == 0) { num = &memoryKiB;   }
+		else if (strcmp(argv[i], "-p") == 0) { num = &parallelism; }
+		else if (strcmp(argv[i], "-j") == 0) { num = &maxThreads;  }
+		if (num == NULL || i + 1 >= argc || cliParseUint(argv[++i], *num))
+		{
+			cliUsage();
+			return 1;
+		}
+	}
+
+	TIMER_FUNC(s);
+	if (bscrypt_calibrate(&iterations, targetMs, memoryKiB, parallelism, maxThreads, profilePath))
+	{
+		fprintf(stderr, "Calibration failed\n");
+		return 1;
+	}
+	TIMER_FUNC(e);
+	fprintf(stderr, "Calibrated in %.3f s\n", TIMER_DIFF(s, e));
+
+	bscrypt_hash(hash, "password", sizeof("password") - 1, memoryKiB, iterations, parallelism, maxThreads, 0);
+	TIMER_FUNC(s);
+	bscrypt_verify(hash, "password", sizeof("password") - 1, maxThreads, 0);
+	TIMER_FUNC(e);
+	printf("m=%u, t=%u, p=%u: %f ms (floor t=%u)\n", memoryKiB, iterations, parallelism, TIMER_DIFF(s, e) * 1000, bscrypt_minIterations(memoryKiB, parallelism));
+	return 0;
+}
+
+static int cmdBench()
 {
 	TIMER_TYPE s, e;
 	char hash[BSCRYPT_HASH_MAX_SIZE];
 
+	// Salt generation
+#ifndef _WIN32
+	benchSalts("/dev/urandom", getRandomUrandom);
+#endif
+	benchSalts("getRandom", getRandom);
+	benchSalts("getRandomBuffered", getRandomBuffered);
+
+	// Base64 (masking off AVX2 sticks so do it last)
+	benchBase64("default");
+	getInstructionSets(~(uint32_t) IS_AVX2);
+	benchBase64("scalar");
+
 	// Settings to match Pufferfish2
 	// m=4, t=13
 	// m=5, t=12
@@ -90,3 +1217,29 @@ int main()
 
 	return 0;
 }
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 2 && strcmp(argv[1], "hash") == 0)
+	{
+		return cmdBulk(0, argc - 2, argv + 2);
+	}
+	if (argc >= 2 && strcmp(argv[1], "verify") == 0)
+	{
+		return cmdBulk(1, argc - 2, argv + 2);
+	}
+	if (argc >= 2 && strcmp(argv[1], "census") == 0)
+	{
+		return cmdCensus(argc - 2, argv + 2);
+	}
+	if (argc >= 2 && strcmp(argv[1], "calibrate") == 0)
+	{
+		return cmdCalibrate(argc - 2, argv + 2);
+	}
+	if (argc == 2 && strcmp(argv[1], "bench") == 0)
+	{
+		return cmdBench();
+	}
+	cliUsage();
+	return 1;
+}
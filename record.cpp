@@ -0,0 +1,234 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include "record.h"
+#include "common.h"
+#include <string.h>
+
+static void writeUint32Le(uint8_t *out, uint32_t num)
+{
+	out[0] = (uint8_t)  num;
+	out[1] = (uint8_t) (num >>  8);
+	out[2] = (uint8_t) (num >> 16);
+	out[3] = (uint8_t) (num >> 24);
+}
+
+static uint32_t readUint32Le(const uint8_t *in)
+{
+	return
+		 (uint32_t) in[0]        |
+		((uint32_t) in[1] <<  8) |
+		((uint32_t) in[2] << 16) |
+		((uint32_t) in[3] << 24);
+}
+
+/**
+ * Converts a parsed hash to a binary record.
+ *
+ * @param uint8_t               record[BSCRYPT_RECORD_SIZE] - Receives the record.
+ * @param const bscrypt_params *params                      - The parsed hash.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_paramsToRecord(uint8_t record[BSCRYPT_RECORD_SIZE], const bscrypt_params *params)
+{
+	memset(record, 0, BSCRYPT_RECORD_SIZE);
+	if (params->digestSize == 0 || params->digestSize > BSCRYPT_ENCRYPTED_HASH_MAX_SIZE)
+	{
+		return 1;
+	}
+
+	record[0] = BSCRYPT_RECORD_VERSION;
+	record[1] = (uint8_t) params->digestSize;
+	writeUint32Le(record +  4, params->memoryKiB);
+	writeUint32Le(record +  8, params->iterations);
+	writeUint32Le(record + 12, params->parallelism);
+	memcpy(record + 16, params->salt, 16);
+	memcpy(record + 32, params->digest, params->digestSize);
+
+	return 0;
+}
+
+/**
+ * Converts a binary record to a parsed hash. Only records that
+ * bscrypt_paramsToRecord() could have made are accepted.
+ *
+ * @param bscrypt_params *params                      - Receives the parsed hash.
+ * @param const uint8_t   record[BSCRYPT_RECORD_SIZE] - The record.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_recordToParams(bscrypt_params *params, const uint8_t record[BSCRYPT_RECORD_SIZE])
+{
+	uint32_t digestSize = record[1];
+
+	if (record[0] != BSCRYPT_RECORD_VERSION ||
+		digestSize == 0 || digestSize > BSCRYPT_ENCRYPTED_HASH_MAX_SIZE ||
+		record[2] != 0 || record[3] != 0)
+	{
+		return 1;
+	}
+	for (size_t i = 32 + digestSize; i < BSCRYPT_RECORD_SIZE; i++)
+	{
+		if (record[i] != 0)
+		{
+			return 1;
+		}
+	}
+
+	params->memoryKiB   = readUint32Le(record +  4);
+	params->iterations  = readUint32Le(record +  8);
+	params->parallelism = readUint32Le(record + 12);
+	params->digestSize  = digestSize;
+	memcpy(params->salt, record + 16, 16);
+	memset(params->digest, 0, sizeof(params->digest));
+	memcpy(params->digest, record + 32, digestSize);
+
+	if (params->memoryKiB   < MEMORY_KIB_MIN ||
+		params->memoryKiB   > MEMORY_KIB_MAX ||
+		params->iterations  < ITERATIONS_MIN ||
+		params->parallelism < 1)
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Converts a hash string to a binary record.
+ *
+ * @param uint8_t     record[BSCRYPT_RECORD_SIZE] - Receives the record.
+ * @param const char *hash                        - The hash.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_hashToRecord(uint8_t record[BSCRYPT_RECORD_SIZE], const char *hash)
+{
+	bscrypt_params params;
+	int            ret = 1;
+
+	memset(record, 0, BSCRYPT_RECORD_SIZE);
+	if (bscrypt_parseHash(&params, hash) == 0)
+	{
+		ret = bscrypt_paramsToRecord(record, &params);
+	}
+	secureClearMemory(&params, sizeof(params));
+
+	return ret;
+}
+
+/**
+ * Converts a binary record to a hash string.
+ *
+ * @param char          hash[BSCRYPT_HASH_MAX_SIZE]   - Receives the hash.
+ * @param const uint8_t record[BSCRYPT_RECORD_SIZE] - The record.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_recordToHash(char hash[BSCRYPT_HASH_MAX_SIZE], const uint8_t record[BSCRYPT_RECORD_SIZE])
+{
+	bscrypt_params params;
+	int            ret = 1;
+
+	hash[0] = 0;
+	if (bscrypt_recordToParams(&params, record) == 0)
+	{
+		ret = bscrypt_formatHash(hash, &params);
+	}
+	secureClearMemory(&params, sizeof(params));
+
+	return ret;
+}
+
+/**
+ * Converts hash strings to binary records. Records that fail are zeroed.
+ *
+ * @param uint8_t           *records - Receives count * BSCRYPT_RECORD_SIZE bytes of records.
+ * @param const char *const *hashes  - The hashes.
+ * @param size_t             count   - Number of hashes.
+ * @param int               *results - Optional. Receives 0 for each success, otherwise non-zero.
+ * @return Number of hashes that failed.
+ */
+size_t bscrypt_hashesToRecords(uint8_t *records, const char *const *hashes, size_t count, int *results)
+{
+	size_t failed = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		int ret = bscrypt_hashToRecord(records + i * BSCRYPT_RECORD_SIZE, hashes[i]);
+
+		if (ret)
+		{
+			failed++;
+		}
+		if (results != NULL)
+		{
+			results[i] = ret;
+		}
+	}
+
+	return failed;
+}
+
+/**
+ * Converts binary records to hash strings. Hashes that fail are empty.
+ *
+ * @param char          (*hashes)[BSCRYPT_HASH_MAX_SIZE] - Receives the hashes.
+ * @param const uint8_t  *records                        - count * BSCRYPT_RECORD_SIZE bytes of records.
+ * @param size_t          count                          - Number of records.
+ * @param int            *results                        - Optional. Receives 0 for each success, otherwise non-zero.
+ * @return Number of records that failed.
+ */
+size_t bscrypt_recordsToHashes(char (*hashes)[BSCRYPT_HASH_MAX_SIZE], const uint8_t *records, size_t count, int *results)
+{
+	size_t failed = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		int ret = bscrypt_recordToHash(hashes[i], records + i * BSCRYPT_RECORD_SIZE);
+
+		if (ret)
+		{
+			failed++;
+		}
+		if (results != NULL)
+		{
+			results[i] = ret;
+		}
+	}
+
+	return failed;
+}
+
+/**
+ * Verifies a password against a binary record.
+ *
+ * @param const uint8_t record[BSCRYPT_RECORD_SIZE] - The record.
+ * @param const void   *password     - The password.
+ * @param size_t        passwordSize - Size of the password.
+ * @param uint32_t      maxThreads   - The maximum number of threads or BSCRYPT_THREADS_AUTO.
+ * @param int           wipeSboxes   - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the hash.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_cancelToken             *cancel            - Optional cancellation token.
+ * @return On correct password, non-zero. Otherwise, 0.
+ */
+int bscrypt_verifyRecord(const uint8_t record[BSCRYPT_RECORD_SIZE], const void *password, size_t passwordSize, uint32_t maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_cancelToken *cancel)
+{
+	bscrypt_params params;
+	int            ret = 0;
+
+	if (bscrypt_recordToParams(&params, record) == 0)
+	{
+		ret = bscrypt_verifyParams(&params, password, passwordSize, maxThreads, wipeSboxes, encryptFunc, encryptHashParams, cancel);
+	}
+	secureClearMemory(&params, sizeof(params));
+
+	return ret;
+}
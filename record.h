@@ -0,0 +1,44 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "bscrypt.h"
+
+// Fixed width binary form of a bscrypt hash for storing next to user records.
+// Converts losslessly to and from the "$bscrypt$..." string.
+//
+// Offset Size
+//      0    1 Version (BSCRYPT_RECORD_VERSION)
+//      1    1 Digest size (1 to 32)
+//      2    2 Reserved (0)
+//      4    4 m (little endian)
+//      8    4 t (little endian)
+//     12    4 p (little endian)
+//     16   16 Salt
+//     32   32 Digest (zero padded)
+
+const size_t  BSCRYPT_RECORD_SIZE    = 64;
+const uint8_t BSCRYPT_RECORD_VERSION = 1;
+
+int bscrypt_paramsToRecord(uint8_t record[BSCRYPT_RECORD_SIZE], const bscrypt_params *params);
+int bscrypt_recordToParams(bscrypt_params *params, const uint8_t record[BSCRYPT_RECORD_SIZE]);
+int bscrypt_hashToRecord(uint8_t record[BSCRYPT_RECORD_SIZE], const char *hash);
+int bscrypt_recordToHash(char hash[BSCRYPT_HASH_MAX_SIZE], const uint8_t record[BSCRYPT_RECORD_SIZE]);
+size_t bscrypt_hashesToRecords(uint8_t *records, const char *const *hashes, size_t count, int *results = NULL);
+size_t bscrypt_recordsToHashes(char (*hashes)[BSCRYPT_HASH_MAX_SIZE], const uint8_t *records, size_t count, int *results = NULL);
+int bscrypt_verifyRecord(
+	const uint8_t record[BSCRYPT_RECORD_SIZE],
+	const void   *password, size_t passwordSize,
+	uint32_t      maxThreads, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL,
+	bscrypt_cancelToken *cancel = NULL);
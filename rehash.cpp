@@ -0,0 +1,427 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include "rehash.h"
+#include "common.h"
+#include <string.h>
+#ifndef _WIN32
+	#include <sys/mman.h>
+#endif
+
+struct bscrypt_rehashEntry
+{
+	bscrypt_rehashEntry *next;
+	void                *user;
+	uint64_t             deadlineUs;
+	size_t               passwordSize;
+	char                 hash[BSCRYPT_HASH_MAX_SIZE];
+	uint8_t              password[BSCRYPT_REHASH_MAX_PASSWORD];
+};
+
+/**
+ * Allocates memory for passwords. It's locked so it isn't swapped out and, where
+ * supported, left out of core dumps and not copied on fork.
+ *
+ * @param size_t  size   - Size of the memory.
+ * @param int    &locked - Receives whether the memory is locked.
+ * @return On success the memory, otherwise NULL.
+ */
+static void *rehash_alloc(size_t size, int &locked)
+{
+	void *mem;
+
+	locked = 0;
+#ifdef _WIN32
+	mem = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (mem != NULL)
+	{
+		locked = VirtualLock(mem, size) != 0;
+	}
+#else
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		return NULL;
+	}
+	locked = mlock(mem, size) == 0;
+	#ifdef MADV_DONTDUMP
+		madvise(mem, size, MADV_DONTDUMP);
+	#endif
+	#ifdef MADV_WIPEONFORK
+		madvise(mem, size, MADV_WIPEONFORK);
+	#endif
+#endif
+	return mem;
+}
+
+static void rehash_free(void *mem, size_t size, int locked)
+{
+	secureClearMemory(mem, size);
+#ifdef _WIN32
+	if (locked)
+	{
+		VirtualUnlock(mem, size);
+	}
+	VirtualFree(mem, 0, MEM_RELEASE);
+#else
+	if (locked)
+	{
+		munlock(mem, size);
+	}
+	munmap(mem, size);
+#endif
+}
+
+static void rehash_sleepMs(uint32_t ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	usleep((useconds_t) ms * 1000);
+#endif
+}
+
+/**
+ * Checks if logins have every core. The queue waits so it only uses idle cores.
+ *
+ * @param bscrypt_ctx *ctx   - The context logins run on.
+ * @param uint32_t     cores - The number of cores.
+ * @return If busy, non-zero. Otherwise, 0.
+ */
+static int rehash_busy(bscrypt_ctx *ctx, uint32_t cores)
+{
+	bscrypt_ctxStats stats;
+
+	bscrypt_ctxGetStats(ctx, &stats);
+	return stats.autoThreads.activeThreads >= cores;
+}
+
+static void rehash_lowerPriority(THREAD thread)
+{
+#if !defined(_WIN32) && defined(SCHED_IDLE)
+	sched_param param;
+
+	param.sched_priority = 0;
+	if (pthread_setschedparam(thread, SCHED_IDLE, &param) == 0)
+	{
+		return;
+	}
+#endif
+	threadPriorityDecrease(thread);
+}
+
+static void *rehash_thread(void *arg)
+{
+	bscrypt_rehashQueue *queue = (bscrypt_rehashQueue*) arg;
+	bscrypt_ctx         *ctx   = bscrypt_getDefaultCtx();
+	int                  cores = getNumCores();
+	char                 newHash[BSCRYPT_HASH_MAX_SIZE];
+
+	if (cores < 1)
+	{
+		cores = 1;
+	}
+
+	MUTEX_LOCK(queue->mutex);
+	while (1)
+	{
+		bscrypt_rehashEntry *entry;
+		uint64_t             now;
+		int                  ret = 1;
+
+		while (!queue->stop && queue->head == NULL)
+		{
+			COND_WAIT(queue->cond, queue->mutex);
+		}
+		if (queue->stop)
+		{
+			break;
+		}
+		entry = queue->head;
+		queue->head = entry->next;
+		if (queue->head == NULL)
+		{
+			queue->tail = NULL;
+		}
+		queue->stats.pending--;
+
+		// The hash is canceled at the deadline or by bscrypt_rehashQueueDestroy()
+		now = getTimeUs();
+		if (now < entry->deadlineUs)
+		{
+			uint64_t leftMs = (entry->deadlineUs - now + 999) / 1000;
+
+			bscrypt_cancelTokenInit(&queue->cancel, leftMs < UINT32_MAX ? (uint32_t) leftMs : UINT32_MAX);
+			MUTEX_UNLOCK(queue->mutex);
+
+			while (!bscrypt_cancelTokenIsCanceled(&queue->cancel) && getTimeUs() < entry->deadlineUs && rehash_busy(ctx, (uint32_t) cores))
+			{
+				rehash_sleepMs(BSCRYPT_REHASH_BACKOFF_MS);
+			}
+			if (!bscrypt_cancelTokenIsCanceled(&queue->cancel) && getTimeUs() < entry->deadlineUs)
+			{
+				ret = bscrypt_hash(
+					newHash, entry->password, entry->passwordSize,
+					queue->policy.memoryKiB, queue->policy.iterations, queue->policy.parallelism,
+					1, queue->wipeSboxes, queue->encryptFunc, queue->encryptHashParams, &queue->cancel);
+			}
+			secureClearMemory(entry->password, entry->passwordSize);
+			if (ret == 0 && queue->callback != NULL)
+			{
+				queue->callback(queue->user, entry->user, entry->hash, newHash);
+			}
+			secureClearMemory(newHash, sizeof(newHash));
+			MUTEX_LOCK(queue->mutex);
+		}
+		if (ret == 0)
+		{
+			queue->stats.rehashed++;
+		}
+		else if (getTimeUs() >= entry->deadlineUs)
+		{
+			queue->stats.expired++;
+		}
+		else
+		{
+			queue->stats.failed++;
+		}
+
+		secureClearMemory(entry, sizeof(*entry));
+		entry->next = queue->freeList;
+		queue->freeList = entry;
+	}
+	MUTEX_UNLOCK(queue->mutex);
+
+	return NULL;
+}
+
+/**
+ * Sets up a rehash policy with the target settings. Hashes with less work or
+ * memory than the target are upgraded. Hashes with more are kept.
+ *
+ * @param bscrypt_rehashPolicy *policy      - The policy.
+ * @param uint32_t              memoryKiB   - The size of the sboxes in KiB (m) for new hashes.
+ * @param uint32_t              iterations  - The number of iterations (t) for new hashes.
+ * @param uint32_t              parallelism - The amount of parallelism (p) for new hashes.
+ */
+void bscrypt_rehashPolicyInit(bscrypt_rehashPolicy *policy, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism)
+{
+	policy->memoryKiB        = memoryKiB;
+	policy->iterations       = iterations;
+	policy->parallelism      = parallelism;
+	policy->minWorkPercent   = 100;
+	policy->minMemoryPercent = 100;
+	policy->maxWorkPercent   = 0;
+}
+
+/**
+ * Checks a hash against a policy. Unlike bscrypt_needsRehash() this compares
+ * cost, so m=256,t=80,p=1 and m=256,t=40,p=2 are the same. Hashes under the
+ * security floor (bscrypt_minIterations()) are always weak.
+ *
+ * @param const bscrypt_rehashPolicy *policy - The policy.
+ * @param const char                 *hash   - The hash.
+ * @return BSCRYPT_REHASH_NONE (0) to keep the hash. Otherwise, the reason to rehash (BSCRYPT_REHASH_*).
+ */
+int bscrypt_rehashCheck(const bscrypt_rehashPolicy *policy, const char *hash)
+{
+	bscrypt_params params;
+	double         work;
+	double         targetWork;
+
+	if (bscrypt_parseHash(&params, hash))
+	{
+		return BSCRYPT_REHASH_INVALID;
+	}
+
+	work       = (double) params.memoryKiB * params.iterations * params.parallelism;
+	targetWork = (double) policy->memoryKiB * policy->iterations * policy->parallelism;
+	if (params.iterations < bscrypt_minIterations(params.memoryKiB, params.parallelism) ||
+		work * 100 < targetWork * policy->minWorkPercent ||
+		(double) params.memoryKiB * 100 < (double) policy->memoryKiB * policy->minMemoryPercent)
+	{
+		return BSCRYPT_REHASH_WEAK;
+	}
+	if (policy->maxWorkPercent != 0 && work * 100 > targetWork * policy->maxWorkPercent)
+	{
+		return BSCRYPT_REHASH_COSTLY;
+	}
+
+	return BSCRYPT_REHASH_NONE;
+}
+
+/**
+ * Starts a background rehash queue. Slots for maxPending passwords are
+ * allocated now and locked in memory if allowed (see stats.locked).
+ *
+ * @param bscrypt_rehashQueue        *queue      - The queue.
+ * @param const bscrypt_rehashPolicy *policy     - The policy. New hashes use its settings.
+ * @param BSCRYPT_REHASH_FUNC         callback   - Called with each new hash.
+ * @param void                       *user       - Passed to the callback.
+ * @param uint32_t                    maxPending - Most passwords waiting at once.
+ * @param uint32_t                    ttlMs      - Passwords not rehashed in this time are wiped and dropped.
+ * @param int                         wipeSboxes - Whether to wipe the sboxes afterward.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - A callback function to encrypt the new hashes.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_rehashQueueInit(bscrypt_rehashQueue *queue, const bscrypt_rehashPolicy *policy, BSCRYPT_REHASH_FUNC callback, void *user, uint32_t maxPending, uint32_t ttlMs, int wipeSboxes, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams)
+{
+	if (maxPending == 0)
+	{
+		maxPending = 1;
+	}
+
+	queue->policy            = *policy;
+	queue->callback          = callback;
+	queue->user              = user;
+	queue->ttlMs             = ttlMs;
+	queue->wipeSboxes        = wipeSboxes;
+	queue->encryptFunc       = encryptFunc;
+	queue->encryptHashParams = encryptHashParams;
+	queue->entriesSize       = sizeof(bscrypt_rehashEntry) * maxPending;
+	queue->freeList          = NULL;
+	queue->head              = NULL;
+	queue->tail              = NULL;
+	queue->stop              = 0;
+	memset(&queue->stats, 0, sizeof(queue->stats));
+
+	queue->entries = (bscrypt_rehashEntry*) rehash_alloc(queue->entriesSize, queue->stats.locked);
+	if (queue->entries == NULL)
+	{
+		return 1;
+	}
+	for (uint32_t i = maxPending; i > 0; i--)
+	{
+		queue->entries[i - 1].next = queue->freeList;
+		queue->freeList = queue->entries + i - 1;
+	}
+
+	MUTEX_CREATE(queue->mutex);
+	COND_CREATE(queue->cond);
+	bscrypt_cancelTokenInit(&queue->cancel);
+	if (THREAD_CREATE(queue->thread, rehash_thread, queue))
+	{
+		COND_DELETE(queue->cond);
+		MUTEX_DELETE(queue->mutex);
+		rehash_free(queue->entries, queue->entriesSize, queue->stats.locked);
+		queue->entries = NULL;
+		return 1;
+	}
+	rehash_lowerPriority(queue->thread);
+
+	return 0;
+}
+
+/**
+ * Stops a rehash queue. A rehash in progress is canceled and waiting passwords
+ * are wiped without being rehashed.
+ *
+ * @param bscrypt_rehashQueue *queue - The queue.
+ */
+void bscrypt_rehashQueueDestroy(bscrypt_rehashQueue *queue)
+{
+	if (queue->entries == NULL)
+	{
+		return;
+	}
+
+	MUTEX_LOCK(queue->mutex);
+	queue->stop = 1;
+	bscrypt_cancelTokenCancel(&queue->cancel);
+	COND_SIGNAL_ALL(queue->cond);
+	MUTEX_UNLOCK(queue->mutex);
+	THREAD_WAIT(queue->thread);
+
+	COND_DELETE(queue->cond);
+	MUTEX_DELETE(queue->mutex);
+	rehash_free(queue->entries, queue->entriesSize, queue->stats.locked);
+	queue->entries  = NULL;
+	queue->freeList = NULL;
+	queue->head     = NULL;
+	queue->tail     = NULL;
+}
+
+/**
+ * Queues a rehash if the policy wants one. Call this only after the password
+ * was verified against the hash. The password is copied so the caller can wipe
+ * theirs right away.
+ *
+ * @param bscrypt_rehashQueue *queue        - The queue.
+ * @param const char          *hash         - The verified hash.
+ * @param const void          *password     - The verified password.
+ * @param size_t               passwordSize - Size of the password.
+ * @param void                *entryUser    - Passed to the callback with the new hash.
+ * @return 0 if queued or not needed. Otherwise, non-zero (invalid hash, full queue, or password over BSCRYPT_REHASH_MAX_PASSWORD).
+ */
+int bscrypt_rehashQueueSubmit(bscrypt_rehashQueue *queue, const char *hash, const void *password, size_t passwordSize, void *entryUser)
+{
+	bscrypt_rehashEntry *entry;
+	size_t               hashSize;
+	int                  check;
+
+	check = bscrypt_rehashCheck(&queue->policy, hash);
+	if (check == BSCRYPT_REHASH_NONE)
+	{
+		return 0;
+	}
+	hashSize = strlen(hash);
+	if (check == BSCRYPT_REHASH_INVALID || hashSize >= BSCRYPT_HASH_MAX_SIZE)
+	{
+		return 1;
+	}
+
+	MUTEX_LOCK(queue->mutex);
+	queue->stats.submitted++;
+	entry = queue->freeList;
+	if (queue->stop || entry == NULL || passwordSize > BSCRYPT_REHASH_MAX_PASSWORD)
+	{
+		queue->stats.dropped++;
+		MUTEX_UNLOCK(queue->mutex);
+		return 1;
+	}
+	queue->freeList = entry->next;
+
+	entry->next         = NULL;
+	entry->user         = entryUser;
+	entry->deadlineUs   = getTimeUs() + (uint64_t) queue->ttlMs * 1000;
+	entry->passwordSize = passwordSize;
+	memcpy(entry->hash, hash, hashSize + 1);
+	memcpy(entry->password, password, passwordSize);
+	if (queue->tail == NULL)
+	{
+		queue->head = entry;
+	}
+	else
+	{
+		queue->tail->next = entry;
+	}
+	queue->tail = entry;
+	queue->stats.pending++;
+	COND_SIGNAL(queue->cond);
+	MUTEX_UNLOCK(queue->mutex);
+
+	return 0;
+}
+
+/**
+ * Gets a rehash queue's stats.
+ *
+ * @param bscrypt_rehashQueue *queue - The queue.
+ * @param bscrypt_rehashStats *stats - Receives the stats.
+ */
+void bscrypt_getRehashStats(bscrypt_rehashQueue *queue, bscrypt_rehashStats *stats)
+{
+	MUTEX_LOCK(queue->mutex);
+	*stats = queue->stats;
+	MUTEX_UNLOCK(queue->mutex);
+}
@@ -0,0 +1,133 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "bscrypt.h"
+#include "threads.h"
+
+// Upgrading hashes off the login path. bscrypt_needsRehash() wants the exact
+// m, t, and p so any settings change rehashes every user on their next login,
+// even when the new settings are cheaper. A policy instead compares the work
+// (m * t * p) and memory (m) of the stored hash with the target settings, so
+// equivalent or stronger hashes are left alone.
+//
+// Hashes that do need an upgrade are handed to a queue right after a correct
+// verify. The queue copies the password into a locked, non-dumpable slot and a
+// single low priority thread rehashes it with maxThreads = 1, backing off while
+// every core is busy with bscrypt_kdf(). The slot is wiped as soon as the new
+// hash is done or the entry expires (ttlMs cancels a rehash in progress), so a
+// password is held for at most ttlMs. The login only pays for the verify.
+//
+// Login:
+//   if (bscrypt_verify(hash, password, passwordSize, ...))
+//   {
+//       bscrypt_rehashQueueSubmit(&queue, hash, password, passwordSize, user);
+//       ...
+//   }
+//
+// The callback gets the old and new hash on the queue's thread. Store the new
+// hash only if the stored hash is still the old one (the password may have
+// changed in the meantime).
+
+const uint32_t BSCRYPT_REHASH_MAX_PASSWORD    = 1024;
+const uint32_t BSCRYPT_REHASH_DEFAULT_PENDING = 1024;
+const uint32_t BSCRYPT_REHASH_DEFAULT_TTL_MS  = 10000;
+const uint32_t BSCRYPT_REHASH_BACKOFF_MS      = 10; // Wait between load checks while every core is busy
+
+const int BSCRYPT_REHASH_NONE    = 0; // Keep the hash
+const int BSCRYPT_REHASH_INVALID = 1; // Couldn't parse the hash
+const int BSCRYPT_REHASH_WEAK    = 2; // Under the floor or the policy's minimum work or memory
+const int BSCRYPT_REHASH_COSTLY  = 3; // Over the policy's maximum work
+
+/**
+ * Target settings and how far a stored hash may be from them. Percents are of
+ * the target's work (m * t * p) or memory (m). Set up with
+ * bscrypt_rehashPolicyInit() then change the percents if you want.
+ */
+struct bscrypt_rehashPolicy
+{
+	uint32_t memoryKiB;
+	uint32_t iterations;
+	uint32_t parallelism;
+	uint32_t minWorkPercent;   // Rehash under this much work (default 100)
+	uint32_t minMemoryPercent; // Rehash under this much memory (default 100)
+	uint32_t maxWorkPercent;   // Rehash over this much work or 0 to never lower cost (default 0)
+};
+
+struct bscrypt_rehashStats
+{
+	uint64_t submitted; // Hashes the policy wanted upgraded
+	uint64_t rehashed;  // New hashes given to the callback
+	uint64_t failed;    // Rehashes that failed
+	uint64_t expired;   // Entries dropped for being past the TTL
+	uint64_t dropped;   // Entries refused for a full queue or long password
+	uint32_t pending;   // Entries waiting now
+	int      locked;    // Whether the slots are locked in memory
+};
+
+/**
+ * This function is called by the queue's thread with an upgraded hash. Don't
+ * do anything slow in here as it holds up the queue.
+ *
+ * @param void       *user      - The user pointer given to bscrypt_rehashQueueInit().
+ * @param void       *entryUser - The user pointer given to bscrypt_rehashQueueSubmit().
+ * @param const char *oldHash   - The hash that was submitted.
+ * @param const char *newHash   - The new hash with the policy's settings.
+ */
+typedef void (*BSCRYPT_REHASH_FUNC)(void *user, void *entryUser, const char *oldHash, const char *newHash);
+
+struct bscrypt_rehashEntry;
+
+/**
+ * A background rehash queue. Set up with bscrypt_rehashQueueInit(). Treat
+ * everything as private.
+ */
+struct bscrypt_rehashQueue
+{
+	bscrypt_rehashPolicy             policy;
+	BSCRYPT_REHASH_FUNC              callback;
+	void                            *user;
+	uint32_t                         ttlMs;
+	int                              wipeSboxes;
+	DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc;
+	void                            *encryptHashParams;
+	MUTEX                            mutex;
+	COND                             cond;
+	THREAD                           thread;
+	bscrypt_rehashEntry             *entries;
+	size_t                           entriesSize;
+	bscrypt_rehashEntry             *freeList;
+	bscrypt_rehashEntry             *head;
+	bscrypt_rehashEntry             *tail;
+	bscrypt_cancelToken              cancel;
+	int                              stop;
+	bscrypt_rehashStats              stats;
+};
+
+void bscrypt_rehashPolicyInit(bscrypt_rehashPolicy *policy, uint32_t memoryKiB, uint32_t iterations, uint32_t parallelism);
+int  bscrypt_rehashCheck(const bscrypt_rehashPolicy *policy, const char *hash);
+
+int  bscrypt_rehashQueueInit(
+	bscrypt_rehashQueue        *queue,
+	const bscrypt_rehashPolicy *policy,
+	BSCRYPT_REHASH_FUNC         callback, void *user,
+	uint32_t maxPending = BSCRYPT_REHASH_DEFAULT_PENDING, uint32_t ttlMs = BSCRYPT_REHASH_DEFAULT_TTL_MS, int wipeSboxes = 0,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc = NULL, void *encryptHashParams = NULL);
+void bscrypt_rehashQueueDestroy(bscrypt_rehashQueue *queue);
+int  bscrypt_rehashQueueSubmit(
+	bscrypt_rehashQueue *queue,
+	const char          *hash,
+	const void          *password, size_t passwordSize,
+	void                *entryUser = NULL);
+void bscrypt_getRehashStats(bscrypt_rehashQueue *queue, bscrypt_rehashStats *stats);
@@ -0,0 +1,325 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include "rotate.h"
+#include "common.h"
+#include <string.h>
+
+// Rotating is a block cipher call and some base64 so spreading less than this
+// over threads costs more than it saves
+const size_t BSCRYPT_ROTATE_PER_THREAD = 1024;
+
+/**
+ * Sets up key rotation.
+ *
+ * @param bscrypt_rotate                  *rotate            - The rotation to init.
+ * @param DETERMINISTIC_DECRYPT_HASH_FUNC  decryptFunc       - Decrypts with the old key or NULL if not encrypted.
+ * @param void                            *decryptHashParams - Parameters to pass to the decryption function.
+ * @param DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc       - Encrypts with the new key or NULL to remove encryption.
+ * @param void                            *encryptHashParams - Parameters to pass to the encryption function.
+ * @param bscrypt_ctx                     *ctx               - Context for the bulk functions' threads or NULL for the default.
+ */
+void bscrypt_rotateInit(bscrypt_rotate *rotate, DETERMINISTIC_DECRYPT_HASH_FUNC decryptFunc, void *decryptHashParams, DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams, bscrypt_ctx *ctx)
+{
+	rotate->ctx               = ctx;
+	rotate->decryptFunc       = decryptFunc;
+	rotate->decryptHashParams = decryptHashParams;
+	rotate->encryptFunc       = encryptFunc;
+	rotate->encryptHashParams = encryptHashParams;
+	rotate->progress          = NULL;
+	rotate->progressUser      = NULL;
+	rotate->cancel            = NULL;
+	rotate->batchSize         = BSCRYPT_ROTATE_BATCH_SIZE;
+	rotate->rotated           = 0;
+	rotate->failed            = 0;
+	rotate->elapsedUs         = 0;
+}
+
+/**
+ * Rotates the key of a parsed hash in place. On error params is unchanged.
+ *
+ * @param const bscrypt_rotate *rotate - The rotation.
+ * @param bscrypt_params       *params - The parsed hash.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_rotateParams(const bscrypt_rotate *rotate, bscrypt_params *params)
+{
+	uint8_t digest[BSCRYPT_ENCRYPTED_HASH_MAX_SIZE];
+	size_t  digestSize = params->digestSize;
+	int     ret        = 1;
+
+	if (digestSize == 0 || digestSize > BSCRYPT_ENCRYPTED_HASH_MAX_SIZE)
+	{
+		return 1;
+	}
+	memcpy(digest, params->digest, digestSize);
+
+	// Decrypt
+	if (rotate->decryptFunc != NULL)
+	{
+		digestSize = rotate->decryptFunc(rotate->decryptHashParams, digest, digestSize, BSCRYPT_ENCRYPTED_HASH_MAX_SIZE);
+	}
+
+	// Encrypt
+	if (digestSize != 0 && digestSize <= BSCRYPT_ENCRYPTED_HASH_MAX_SIZE && rotate->encryptFunc != NULL)
+	{
+		digestSize = rotate->encryptFunc(rotate->encryptHashParams, digest, digestSize, BSCRYPT_ENCRYPTED_HASH_MAX_SIZE);
+	}
+
+	if (digestSize != 0 && digestSize <= BSCRYPT_ENCRYPTED_HASH_MAX_SIZE)
+	{
+		memset(params->digest, 0, sizeof(params->digest));
+		memcpy(params->digest, digest, digestSize);
+		params->digestSize = (uint32_t) digestSize;
+		ret = 0;
+	}
+
+	// Clear
+	secureClearMemory(digest, sizeof(digest));
+
+	return ret;
+}
+
+/**
+ * Rotates the key of a hash. newHash and hash can be the same. On error
+ * newHash is unchanged.
+ *
+ * @param const bscrypt_rotate *rotate                       - The rotation.
+ * @param char                  newHash[BSCRYPT_HASH_MAX_SIZE] - Receives the rotated hash.
+ * @param const char           *hash                         - The hash.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_rotateHash(const bscrypt_rotate *rotate, char newHash[BSCRYPT_HASH_MAX_SIZE], const char *hash)
+{
+	bscrypt_params params;
+	char           tmp[BSCRYPT_HASH_MAX_SIZE] = {0};
+	int            ret = 1;
+
+	if (bscrypt_parseHash(&params, hash) == 0 &&
+		bscrypt_rotateParams(rotate, &params) == 0 &&
+		bscrypt_formatHash(tmp, &params) == 0)
+	{
+		memcpy(newHash, tmp, BSCRYPT_HASH_MAX_SIZE);
+		ret = 0;
+	}
+
+	// Clear
+	secureClearMemory(&params, sizeof(params));
+	secureClearMemory(tmp, sizeof(tmp));
+
+	return ret;
+}
+
+/**
+ * Rotates the key of a binary record. newRecord and record can be the same.
+ * On error newRecord is unchanged.
+ *
+ * @param const bscrypt_rotate *rotate                         - The rotation.
+ * @param uint8_t               newRecord[BSCRYPT_RECORD_SIZE] - Receives the rotated record.
+ * @param const uint8_t         record[BSCRYPT_RECORD_SIZE]    - The record.
+ * @return On success 0, otherwise non-zero.
+ */
+int bscrypt_rotateRecord(const bscrypt_rotate *rotate, uint8_t newRecord[BSCRYPT_RECORD_SIZE], const uint8_t record[BSCRYPT_RECORD_SIZE])
+{
+	bscrypt_params params;
+	uint8_t        tmp[BSCRYPT_RECORD_SIZE];
+	int            ret = 1;
+
+	if (bscrypt_recordToParams(&params, record) == 0 &&
+		bscrypt_rotateParams(rotate, &params) == 0 &&
+		bscrypt_paramsToRecord(tmp, &params) == 0)
+	{
+		memcpy(newRecord, tmp, BSCRYPT_RECORD_SIZE);
+		ret = 0;
+	}
+
+	// Clear
+	secureClearMemory(&params, sizeof(params));
+	secureClearMemory(tmp, sizeof(tmp));
+
+	return ret;
+}
+
+// Lives on the stack of the thread that called bscrypt_rotateBulk()
+struct bscrypt_rotateBatch
+{
+	const bscrypt_rotate *rotate;
+	void                 *newEntries;
+	const void           *entries;
+	int                  *results;
+	size_t                start;
+	int                   records;
+	MUTEX                 mutex;
+	size_t                failed;
+};
+
+static void bscrypt_rotateBatchRun(void *arg, size_t i)
+{
+	bscrypt_rotateBatch *batch = (bscrypt_rotateBatch*) arg;
+	int                  ret;
+
+	i += batch->start;
+	if (batch->records)
+	{
+		const uint8_t *record    = ((const uint8_t*) batch->entries) + i * BSCRYPT_RECORD_SIZE;
+		uint8_t       *newRecord = ((uint8_t*) batch->newEntries) + i * BSCRYPT_RECORD_SIZE;
+
+		ret = bscrypt_rotateRecord(batch->rotate, newRecord, record);
+		if (ret)
+		{
+			memcpy(newRecord, record, BSCRYPT_RECORD_SIZE);
+		}
+	}
+	else
+	{
+		const char *hash    = ((const char (*)[BSCRYPT_HASH_MAX_SIZE]) batch->entries)[i];
+		char       *newHash = ((char (*)[BSCRYPT_HASH_MAX_SIZE]) batch->newEntries)[i];
+
+		ret = bscrypt_rotateHash(batch->rotate, newHash, hash);
+		if (ret)
+		{
+			memcpy(newHash, hash, BSCRYPT_HASH_MAX_SIZE);
+		}
+	}
+
+	if (batch->results != NULL)
+	{
+		batch->results[i] = ret;
+	}
+	if (ret)
+	{
+		MUTEX_LOCK(batch->mutex);
+		batch->failed++;
+		MUTEX_UNLOCK(batch->mutex);
+	}
+}
+
+static int bscrypt_rotateBulk(bscrypt_rotate *rotate, void *newEntries, const void *entries, int records, size_t count, int *results, size_t *resume)
+{
+	bscrypt_rotateBatch batch;
+	bscrypt_ctx        *ctx       = rotate->ctx;
+	size_t              start     = 0;
+	size_t              batchSize = rotate->batchSize;
+	size_t              bytes     = count * (records ? BSCRYPT_RECORD_SIZE : BSCRYPT_HASH_MAX_SIZE);
+	int                 ret       = 0;
+
+	// Overlapping can't be resumed after a crash
+	if ((const uint8_t*) newEntries < (const uint8_t*) entries + bytes &&
+		(const uint8_t*) entries    < (const uint8_t*) newEntries + bytes)
+	{
+		return 1;
+	}
+
+	if (ctx == NULL)
+	{
+		ctx = bscrypt_getDefaultCtx();
+	}
+	if (resume != NULL)
+	{
+		start = *resume;
+	}
+	if (batchSize == 0)
+	{
+		batchSize = BSCRYPT_ROTATE_BATCH_SIZE;
+	}
+
+	batch.rotate     = rotate;
+	batch.newEntries = newEntries;
+	batch.entries    = entries;
+	batch.results = results;
+	batch.records = records;
+	MUTEX_CREATE(batch.mutex);
+	while (start < count)
+	{
+		uint64_t startUs = getTimeUs();
+		size_t   size    = count - start;
+
+		if (rotate->cancel != NULL && bscrypt_cancelTokenIsCanceled(rotate->cancel))
+		{
+			ret = BSCRYPT_ERROR_CANCELED;
+			break;
+		}
+		if (size > batchSize)
+		{
+			size = batchSize;
+		}
+
+		batch.start  = start;
+		batch.failed = 0;
+		bscrypt_ctxParallelFor(ctx, size, BSCRYPT_ROTATE_PER_THREAD, bscrypt_rotateBatchRun, &batch);
+		start += size;
+
+		rotate->rotated   += size - batch.failed;
+		rotate->failed    += batch.failed;
+		rotate->elapsedUs += getTimeUs() - startUs;
+		if (resume != NULL)
+		{
+			*resume = start;
+		}
+		if (rotate->progress != NULL)
+		{
+			rotate->progress(rotate->progressUser, start, count);
+		}
+	}
+	MUTEX_DELETE(batch.mutex);
+
+	return ret;
+}
+
+/**
+ * Rotates the key of hashes on the context's workers. newHashes and hashes
+ * can't overlap.
+ *
+ * @param bscrypt_rotate *rotate                               - The rotation. Totals are added to.
+ * @param char          (*newHashes)[BSCRYPT_HASH_MAX_SIZE]    - Receives the rotated hashes. Failed hashes are copied as is.
+ * @param const char    (*hashes)[BSCRYPT_HASH_MAX_SIZE]       - The hashes.
+ * @param size_t          count                                - Number of hashes.
+ * @param int            *results                              - Optional. Receives 0 for each success, otherwise non-zero.
+ * @param size_t         *resume                               - Optional. Index to start at. Updated after each batch.
+ * @return On success 0 (even if some hashes failed), if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero (overlapping arrays).
+ */
+int bscrypt_rotateHashes(bscrypt_rotate *rotate, char (*newHashes)[BSCRYPT_HASH_MAX_SIZE], const char (*hashes)[BSCRYPT_HASH_MAX_SIZE], size_t count, int *results, size_t *resume)
+{
+	return bscrypt_rotateBulk(rotate, newHashes, hashes, 0, count, results, resume);
+}
+
+/**
+ * Rotates the key of binary records on the context's workers. newRecords and
+ * records can't overlap.
+ *
+ * @param bscrypt_rotate *rotate     - The rotation. Totals are added to.
+ * @param uint8_t        *newRecords - Receives count * BSCRYPT_RECORD_SIZE bytes of rotated records. Failed records are copied as is.
+ * @param const uint8_t  *records    - count * BSCRYPT_RECORD_SIZE bytes of records.
+ * @param size_t          count      - Number of records.
+ * @param int            *results    - Optional. Receives 0 for each success, otherwise non-zero.
+ * @param size_t         *resume     - Optional. Index to start at. Updated after each batch.
+ * @return On success 0 (even if some records failed), if canceled BSCRYPT_ERROR_CANCELED, otherwise non-zero (overlapping arrays).
+ */
+int bscrypt_rotateRecords(bscrypt_rotate *rotate, uint8_t *newRecords, const uint8_t *records, size_t count, int *results, size_t *resume)
+{
+	return bscrypt_rotateBulk(rotate, newRecords, records, 1, count, results, resume);
+}
+
+/**
+ * Gets the throughput of the bulk functions so far.
+ *
+ * @param const bscrypt_rotate *rotate - The rotation.
+ * @return Entries per second.
+ */
+double bscrypt_rotatePerSecond(const bscrypt_rotate *rotate)
+{
+	if (rotate->elapsedUs == 0)
+	{
+		return 0.0;
+	}
+	return (rotate->rotated + rotate->failed) / (rotate->elapsedUs / 1000000.0);
+}
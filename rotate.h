@@ -0,0 +1,63 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "bscrypt.h"
+#include "record.h"
+
+// Rotates the key of encrypted hashes without the passwords. Each digest is
+// decrypted with the old key and encrypted with the new key. The m, t, p, and
+// salt are kept as is. A NULL decrypt function means the hashes aren't
+// encrypted yet and a NULL encrypt function removes the encryption.
+//
+// The bulk functions read an array of hashes or records and write the rotated
+// entries to a separate array. So for a file of records, mmap it (or read a
+// chunk at a time) and write a new file. They work on batchSize entries at a
+// time and update *resume after each batch. Output before *resume is done. If
+// canceled or the process dies, pass the last saved *resume back in to carry
+// on. Entries after it are redone from the untouched input, so nothing is
+// encrypted twice. Entries that fail are copied as is. The input and output
+// can't overlap since rotating in place can't be resumed safely.
+
+const size_t BSCRYPT_ROTATE_BATCH_SIZE = 65536;
+
+struct bscrypt_rotate
+{
+	bscrypt_ctx                     *ctx;
+	DETERMINISTIC_DECRYPT_HASH_FUNC  decryptFunc;
+	void                            *decryptHashParams;
+	DETERMINISTIC_ENCRYPT_HASH_FUNC  encryptFunc;
+	void                            *encryptHashParams;
+	BSCRYPT_PROGRESS_FUNC            progress;
+	void                            *progressUser;
+	bscrypt_cancelToken             *cancel;
+	size_t                           batchSize;
+
+	// Totals since bscrypt_rotateInit()
+	size_t                           rotated;
+	size_t                           failed;
+	uint64_t                         elapsedUs;
+};
+
+void   bscrypt_rotateInit(
+	bscrypt_rotate *rotate,
+	DETERMINISTIC_DECRYPT_HASH_FUNC decryptFunc, void *decryptHashParams,
+	DETERMINISTIC_ENCRYPT_HASH_FUNC encryptFunc, void *encryptHashParams,
+	bscrypt_ctx *ctx = NULL);
+int    bscrypt_rotateParams(const bscrypt_rotate *rotate, bscrypt_params *params);
+int    bscrypt_rotateHash(const bscrypt_rotate *rotate, char newHash[BSCRYPT_HASH_MAX_SIZE], const char *hash);
+int    bscrypt_rotateRecord(const bscrypt_rotate *rotate, uint8_t newRecord[BSCRYPT_RECORD_SIZE], const uint8_t record[BSCRYPT_RECORD_SIZE]);
+int    bscrypt_rotateHashes(bscrypt_rotate *rotate, char (*newHashes)[BSCRYPT_HASH_MAX_SIZE], const char (*hashes)[BSCRYPT_HASH_MAX_SIZE], size_t count, int *results = NULL, size_t *resume = NULL);
+int    bscrypt_rotateRecords(bscrypt_rotate *rotate, uint8_t *newRecords, const uint8_t *records, size_t count, int *results = NULL, size_t *resume = NULL);
+double bscrypt_rotatePerSecond(const bscrypt_rotate *rotate);
@@ -0,0 +1,130 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+// AVX2 vs scalar base64. Every input is decoded with AVX2 first, then AVX2 is
+// masked off (getInstructionSets() keeps the mask) and the same inputs are
+// decoded by the scalar code. Results and output must match exactly.
+
+#include "../base64.h"
+#include "../common.h"
+#include <stdio.h>
+#include <string.h>
+
+const size_t TEST_COUNT    = 200000;
+const size_t TEST_MAX_SIZE = 100;
+
+struct testCase
+{
+	char    src[TEST_MAX_SIZE];
+	size_t  srcSize;
+	int     flags;
+	int     ret;
+	uint8_t dest[TEST_MAX_SIZE];
+};
+
+static uint64_t rngState = 0x0123456789abcdef;
+
+static uint32_t rng()
+{
+	rngState = rngState * 6364136223846793005 + 1442695040888963407;
+	return (uint32_t) (rngState >> 33);
+}
+
+static void makeCase(testCase &test)
+{
+	static const char chars[] = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+	// Mostly 32 to 100 characters so the AVX2 code runs
+	test.srcSize = 32 + rng() % (TEST_MAX_SIZE - 32 + 1);
+	if (rng() % 4 == 0)
+	{
+		test.srcSize = 4 * (8 + rng() % 17);
+	}
+	test.flags = (int) (rng() % 4);
+	for (size_t i = 0; i < test.srcSize; i++)
+	{
+		test.src[i] = chars[rng() % 64];
+	}
+
+	// Padding, misplaced padding, and bad characters
+	for (uint32_t i = rng() % 4; i > 0; i--)
+	{
+		size_t pos = test.srcSize - 1 - rng() % (rng() % 2 ? 4 : test.srcSize);
+
+		test.src[pos] = (rng() % 8 == 0) ? (char) (rng() % 256) : '=';
+	}
+}
+
+int main()
+{
+	testCase *tests    = new testCase[TEST_COUNT];
+	uint8_t   data[75];
+	char      encoded[TEST_MAX_SIZE + 4];
+	int       hasAvx2  = (getInstructionSets() & (IS_AVX2 | IS_OS_YMM)) == (IS_AVX2 | IS_OS_YMM);
+	int       failures = 0;
+
+	// Round trips for every size
+	for (size_t size = 0; size <= sizeof(data); size++)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			data[i] = (uint8_t) rng();
+		}
+		for (int flags = 0; flags < 2; flags++)
+		{
+			uint8_t decoded[sizeof(data) + 2];
+			size_t  chars = base64Encode(encoded, data, size, flags);
+
+			if (base64Decode(decoded, encoded, chars, BASE64_DECODE_FLAG_IGNORE_NO_PAD) != 0 || memcmp(decoded, data, size) != 0)
+			{
+				printf("FAIL: round trip size %u flags %d\n", (unsigned) size, flags);
+				failures++;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < TEST_COUNT; i++)
+	{
+		makeCase(tests[i]);
+		memset(tests[i].dest, 0, sizeof(tests[i].dest));
+		tests[i].ret = base64Decode(tests[i].dest, tests[i].src, tests[i].srcSize, tests[i].flags);
+	}
+
+	if (!hasAvx2)
+	{
+		printf("No AVX2, only the scalar code was tested\n");
+	}
+	getInstructionSets(~(uint32_t) IS_AVX2);
+	for (size_t i = 0; i < TEST_COUNT; i++)
+	{
+		uint8_t dest[TEST_MAX_SIZE] = {0};
+		int     ret = base64Decode(dest, tests[i].src, tests[i].srcSize, tests[i].flags);
+
+		if (ret != tests[i].ret || (ret == 0 && memcmp(dest, tests[i].dest, sizeof(dest)) != 0))
+		{
+			if (failures < 10)
+			{
+				printf("FAIL: \"%.*s\" flags %d: AVX2 %d, scalar %d\n", (int) tests[i].srcSize, tests[i].src, tests[i].flags, tests[i].ret, ret);
+			}
+			failures++;
+		}
+	}
+
+	delete [] tests;
+	if (failures)
+	{
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+// Hash string round trips: base64DecodedSize(), bscrypt_parseHash(),
+// bscrypt_formatHash(), bscrypt_verify(), and bscrypt_verifyInit()/Finish()
+// for every digest size an encrypt function can return.
+
+#include "../base64.h"
+#include "../bscrypt.h"
+#include "../rehash.h"
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+static void check(int ok, const char *what, size_t size)
+{
+	if (!ok)
+	{
+		printf("FAIL: %s (size %u)\n", what, (unsigned) size);
+		failures++;
+	}
+}
+
+// "Encrypts" to *(size_t*) params bytes by repeating the hash
+static size_t stretchHash(void *encryptHashParams, void *hash, size_t hashSize, size_t maxEncryptedHashSize)
+{
+	size_t   size = *(size_t*) encryptHashParams;
+	uint8_t  tmp[64];
+	uint8_t *out  = (uint8_t*) hash;
+
+	if (size > maxEncryptedHashSize || size > sizeof(tmp))
+	{
+		return size;
+	}
+	for (size_t i = 0; i < size; i++)
+	{
+		tmp[i] = out[i % hashSize] ^ (uint8_t) i;
+	}
+	memcpy(out, tmp, size);
+	return size;
+}
+
+static int stepVerify(const char *hash, const char *password, size_t *size)
+{
+	bscrypt_kdfState state;
+
+	if (bscrypt_verifyInit(&state, hash, password, strlen(password), 0))
+	{
+		return 0;
+	}
+	while (bscrypt_kdfStep(&state, 1000))
+	{
+	}
+	return bscrypt_verifyFinish(&state, hash, stretchHash, size);
+}
+
+static void testDecodedSize()
+{
+	uint8_t data[100];
+	char    encoded[200];
+
+	for (size_t i = 0; i < sizeof(data); i++)
+	{
+		data[i] = (uint8_t) (i * 7);
+	}
+	for (size_t size = 0; size <= sizeof(data); size++)
+	{
+		size_t chars = base64Encode(encoded, data, size, BASE64_ENCODE_FLAG_NO_PAD);
+
+		check(base64DecodedSize(encoded, chars, BASE64_DECODE_FLAG_IGNORE_NO_PAD) == size, "decoded size without padding", size);
+		chars = base64Encode(encoded, data, size, BASE64_FLAG_NONE);
+		check(base64DecodedSize(encoded, chars, BASE64_FLAG_NONE) == size, "decoded size with padding", size);
+	}
+}
+
+static void testDigestSizes()
+{
+	bscrypt_rehashPolicy policy;
+
+	bscrypt_rehashPolicyInit(&policy, 16, 2, 1);
+	for (size_t size = 16; size <= 64; size++)
+	{
+		char           hash[BSCRYPT_HASH_MAX_SIZE];
+		char           formatted[BSCRYPT_HASH_MAX_SIZE];
+		bscrypt_params params;
+		int            ret;
+
+		ret = bscrypt_hash(hash, "password", 8, 16, 2, 1, 1, 0, stretchHash, &size);
+		if (size > BSCRYPT_ENCRYPTED_HASH_MAX_SIZE)
+		{
+			uint8_t digest[64] = {0};
+			char   *end;
+
+			check(ret != 0, "hash refuses oversized digest", size);
+
+			// Hand built hash string with an oversized digest
+			bscrypt_hash(hash, "password", 8, 16, 2, 1, 1, 0);
+			end = hash + strlen(hash) - 32;
+			base64Encode(end, digest, size, BASE64_ENCODE_FLAG_NO_PAD);
+			check(bscrypt_parseHash(&params, hash) != 0, "parse refuses oversized digest", size);
+			continue;
+		}
+
+		check(ret == 0, "hash", size);
+		check(bscrypt_parseHash(&params, hash) == 0, "parse", size);
+		check(params.digestSize == size, "parsed digest size", size);
+		check(bscrypt_formatHash(formatted, &params) == 0 && strcmp(formatted, hash) == 0, "format round trip", size);
+		check(bscrypt_verify(hash, "password", 8, 1, 0, stretchHash, &size) == 1, "verify correct password", size);
+		check(bscrypt_verify(hash, "Password", 8, 1, 0, stretchHash, &size) == 0, "verify wrong password", size);
+		check(stepVerify(hash, "password", &size) == 1, "step verify correct password", size);
+		check(stepVerify(hash, "Password", &size) == 0, "step verify wrong password", size);
+
+		// Change the digest's second to last character (always 6 full bits)
+		char *tail = hash + strlen(hash) - 2;
+		*tail = *tail == 'A' ? 'B' : 'A';
+		check(bscrypt_verify(hash, "password", 8, 1, 0, stretchHash, &size) == 0, "verify changed tail", size);
+		check(stepVerify(hash, "password", &size) == 0, "step verify changed tail", size);
+		check(bscrypt_rehashCheck(&policy, hash) != BSCRYPT_REHASH_INVALID, "rehash check parses", size);
+	}
+}
+
+int main()
+{
+	testDecodedSize();
+	testDigestSizes();
+	if (failures)
+	{
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,184 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+// Key rotation: rotated hashes and records verify with the new key and not
+// the old one, failed entries are copied as is, overlapping arrays are
+// refused, and a run that is stopped part way (with the unfinished part of
+// the output trashed like after a crash) resumes to the same output as one
+// uninterrupted run.
+
+#include "../bscrypt.h"
+#include "../record.h"
+#include "../rotate.h"
+#include <stdio.h>
+#include <string.h>
+
+const size_t TEST_PASSWORDS  = 16;
+const size_t TEST_COUNT      = 5000;
+const size_t TEST_BATCH_SIZE = 1000;
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+// XOR "cipher" keyed by *(uint8_t*) params. Encrypt and decrypt are the same.
+static size_t xorHash(void *params, void *hash, size_t hashSize, size_t maxSize)
+{
+	uint8_t key = *(uint8_t*) params;
+
+	(void) maxSize;
+	for (size_t i = 0; i < hashSize; i++)
+	{
+		((uint8_t*) hash)[i] ^= (uint8_t) (key + i);
+	}
+	return hashSize;
+}
+
+static uint8_t keyOld = 0x5a;
+static uint8_t keyNew = 0xc3;
+
+static void cancelAfterTwo(void *user, size_t done, size_t total)
+{
+	(void) total;
+	if (done >= 2 * TEST_BATCH_SIZE)
+	{
+		bscrypt_cancelTokenCancel((bscrypt_cancelToken*) user);
+	}
+}
+
+static void password(char pw[16], size_t i)
+{
+	snprintf(pw, 16, "password%u", (unsigned) (i % TEST_PASSWORDS));
+}
+
+int main()
+{
+	char             (*hashes)[BSCRYPT_HASH_MAX_SIZE]    = new char[TEST_COUNT][BSCRYPT_HASH_MAX_SIZE];
+	char             (*newHashes)[BSCRYPT_HASH_MAX_SIZE] = new char[TEST_COUNT][BSCRYPT_HASH_MAX_SIZE];
+	char             (*expected)[BSCRYPT_HASH_MAX_SIZE]  = new char[TEST_COUNT][BSCRYPT_HASH_MAX_SIZE];
+	uint8_t           *records    = new uint8_t[TEST_COUNT * BSCRYPT_RECORD_SIZE];
+	uint8_t           *newRecords = new uint8_t[TEST_COUNT * BSCRYPT_RECORD_SIZE];
+	int               *results    = new int[TEST_COUNT];
+	bscrypt_rotate     rotate;
+	bscrypt_cancelToken cancel;
+	size_t             resume;
+	char               pw[16];
+	int                ret;
+
+	// Hashes under the old key with one bad entry
+	memset(hashes, 0, TEST_COUNT * BSCRYPT_HASH_MAX_SIZE);
+	for (size_t i = 0; i < TEST_PASSWORDS; i++)
+	{
+		password(pw, i);
+		bscrypt_hash(hashes[i], pw, strlen(pw), 16, 2, 1, 1, 0, xorHash, &keyOld);
+	}
+	for (size_t i = TEST_PASSWORDS; i < TEST_COUNT; i++)
+	{
+		memcpy(hashes[i], hashes[i % TEST_PASSWORDS], BSCRYPT_HASH_MAX_SIZE);
+	}
+	strcpy(hashes[7], "$bscrypt$not a hash");
+
+	bscrypt_rotateInit(&rotate, xorHash, &keyOld, xorHash, &keyNew);
+	rotate.batchSize = TEST_BATCH_SIZE;
+
+	// One uninterrupted run
+	check(bscrypt_rotateHashes(&rotate, expected, hashes, TEST_COUNT, results) == 0, "rotate hashes");
+	check(results[7] != 0 && strcmp(expected[7], hashes[7]) == 0, "failed hash copied as is");
+	check(rotate.rotated == TEST_COUNT - 1 && rotate.failed == 1, "totals");
+	for (size_t i = 0; i < 2 * TEST_PASSWORDS; i++)
+	{
+		if (i % TEST_PASSWORDS == 7)
+		{
+			continue;
+		}
+		password(pw, i);
+		check(results[i] == 0, "rotate result");
+		check(bscrypt_verify(expected[i], pw, strlen(pw), 1, 0, xorHash, &keyNew) == 1, "verify with new key");
+		check(bscrypt_verify(expected[i], pw, strlen(pw), 1, 0, xorHash, &keyOld) == 0, "old key fails");
+	}
+
+	// Overlapping arrays
+	check(bscrypt_rotateHashes(&rotate, hashes, hashes, TEST_COUNT) != 0, "in place refused");
+	check(bscrypt_rotateHashes(&rotate, hashes + 1, hashes, TEST_COUNT) != 0, "overlap refused");
+
+	// Stop after two batches, trash everything after *resume, and resume
+	bscrypt_cancelTokenInit(&cancel);
+	rotate.cancel       = &cancel;
+	rotate.progress     = cancelAfterTwo;
+	rotate.progressUser = &cancel;
+	resume = 0;
+	memset(newHashes, 0, TEST_COUNT * BSCRYPT_HASH_MAX_SIZE);
+	ret = bscrypt_rotateHashes(&rotate, newHashes, hashes, TEST_COUNT, NULL, &resume);
+	check(ret == BSCRYPT_ERROR_CANCELED && resume == 2 * TEST_BATCH_SIZE, "canceled after two batches");
+	for (size_t i = resume; i < TEST_COUNT; i++)
+	{
+		// Half rotated like a crash part way through a batch
+		bscrypt_rotateHash(&rotate, newHashes[i], hashes[i]);
+	}
+	bscrypt_cancelTokenInit(&cancel);
+	rotate.progress = NULL;
+	check(bscrypt_rotateHashes(&rotate, newHashes, hashes, TEST_COUNT, NULL, &resume) == 0 && resume == TEST_COUNT, "resume");
+	for (size_t i = 0; i < TEST_COUNT; i++)
+	{
+		if (strcmp(newHashes[i], expected[i]) != 0)
+		{
+			check(0, "resumed output matches");
+			break;
+		}
+	}
+	rotate.cancel = NULL;
+
+	// Records
+	for (size_t i = 0; i < TEST_COUNT; i++)
+	{
+		if (bscrypt_hashToRecord(records + i * BSCRYPT_RECORD_SIZE, hashes[i]))
+		{
+			memset(records + i * BSCRYPT_RECORD_SIZE, 0, BSCRYPT_RECORD_SIZE);
+		}
+	}
+	check(bscrypt_rotateRecords(&rotate, newRecords, records, TEST_COUNT, results) == 0, "rotate records");
+	check(bscrypt_rotateRecords(&rotate, records, records, TEST_COUNT) != 0, "records in place refused");
+	check(results[7] != 0 && memcmp(newRecords + 7 * BSCRYPT_RECORD_SIZE, records + 7 * BSCRYPT_RECORD_SIZE, BSCRYPT_RECORD_SIZE) == 0, "failed record copied as is");
+	for (size_t i = 0; i < TEST_PASSWORDS; i++)
+	{
+		char hash[BSCRYPT_HASH_MAX_SIZE];
+
+		if (i == 7)
+		{
+			continue;
+		}
+		password(pw, i);
+		check(bscrypt_verifyRecord(newRecords + i * BSCRYPT_RECORD_SIZE, pw, strlen(pw), 1, 0, xorHash, &keyNew) == 1, "record verify with new key");
+		check(bscrypt_recordToHash(hash, newRecords + i * BSCRYPT_RECORD_SIZE) == 0 && strcmp(hash, expected[i]) == 0, "record matches hash");
+	}
+
+	delete [] hashes;
+	delete [] newHashes;
+	delete [] expected;
+	delete [] records;
+	delete [] newRecords;
+	delete [] results;
+	if (failures)
+	{
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,202 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include "threadpool.h"
+#include <stddef.h>
+
+static void *threadPool_thread(void *args)
+{
+	threadPool     *pool = (threadPool*) args;
+	threadPoolTask *task;
+
+	MUTEX_LOCK(pool->mutex);
+	while (1)
+	{
+		// Next task
+		while (pool->head == NULL && !pool->stop)
+		{
+			COND_WAIT(pool->cond, pool->mutex);
+		}
+		task = pool->head;
+		if (task == NULL)
+		{
+			break;
+		}
+		pool->head = task->next;
+		if (pool->head == NULL)
+		{
+			pool->tail = NULL;
+		}
+		pool->queued--;
+		pool->busy++;
+		MUTEX_UNLOCK(pool->mutex);
+
+		// Do task
+		task->func(task->arg);
+
+		MUTEX_LOCK(pool->mutex);
+		pool->busy--;
+	}
+	MUTEX_UNLOCK(pool->mutex);
+
+	return NULL;
+}
+
+/**
+ * Starts a thread pool.
+ *
+ * @param threadPool *pool       - The thread pool.
+ * @param uint32_t    numThreads - Number of worker threads or 0 for the number of cores.
+ * @return On success 0, otherwise non-zero.
+ */
+int threadPool_init(threadPool *pool, uint32_t numThreads)
+{
+	if (numThreads == 0)
+	{
+		int cores = getNumCores();
+
+		numThreads = 1;
+		if (cores > 1)
+		{
+			numThreads = (uint32_t) cores;
+		}
+	}
+
+	MUTEX_CREATE(pool->mutex);
+	COND_CREATE(pool->cond);
+	pool->threads    = new THREAD[numThreads];
+	pool->numThreads = 0;
+	pool->busy       = 0;
+	pool->queued     = 0;
+	pool->head       = NULL;
+	pool->tail       = NULL;
+	pool->stop       = 0;
+
+	for (uint32_t i = 0; i < numThreads; i++)
+	{
+		if (THREAD_CREATE(pool->threads[i], threadPool_thread, pool))
+		{
+			break;
+		}
+		pool->numThreads++;
+	}
+	if (pool->numThreads == 0)
+	{
+		threadPool_destroy(pool);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stops a thread pool. Tasks that are already queued are run first.
+ *
+ * @param threadPool *pool - The thread pool.
+ */
+void threadPool_destroy(threadPool *pool)
+{
+	MUTEX_LOCK(pool->mutex);
+	pool->stop = 1;
+	COND_SIGNAL_ALL(pool->cond);
+	MUTEX_UNLOCK(pool->mutex);
+
+	for (uint32_t i = 0; i < pool->numThreads; i++)
+	{
+		THREAD_WAIT(pool->threads[i]);
+	}
+
+	COND_DELETE(pool->cond);
+	MUTEX_DELETE(pool->mutex);
+	delete [] pool->threads;
+	pool->threads    = NULL;
+	pool->numThreads = 0;
+}
+
+/**
+ * Queues a task to be run by a worker thread.
+ *
+ * @param threadPool     *pool - The thread pool.
+ * @param threadPoolTask *task - The task. func and arg must be set.
+ */
+void threadPool_submit(threadPool *pool, threadPoolTask *task)
+{
+	task->next = NULL;
+
+	MUTEX_LOCK(pool->mutex);
+	if (pool->tail == NULL)
+	{
+		pool->head = task;
+	}
+	else
+	{
+		pool->tail->next = task;
+	}
+	pool->tail = task;
+	pool->queued++;
+	COND_SIGNAL(pool->cond);
+	MUTEX_UNLOCK(pool->mutex);
+}
+
+/**
+ * Removes a task if it has not started yet.
+ *
+ * @param threadPool     *pool - The thread pool.
+ * @param threadPoolTask *task - The task.
+ * @return If removed, non-zero. If already started (or done), 0.
+ */
+int threadPool_remove(threadPool *pool, threadPoolTask *task)
+{
+	threadPoolTask *prev = NULL;
+	int             ret  = 0;
+
+	MUTEX_LOCK(pool->mutex);
+	for (threadPoolTask *cur = pool->head; cur != NULL; prev = cur, cur = cur->next)
+	{
+		if (cur == task)
+		{
+			if (prev == NULL)
+			{
+				pool->head = cur->next;
+			}
+			else
+			{
+				prev->next = cur->next;
+			}
+			if (pool->tail == cur)
+			{
+				pool->tail = prev;
+			}
+			pool->queued--;
+			ret = 1;
+			break;
+		}
+	}
+	MUTEX_UNLOCK(pool->mutex);
+
+	return ret;
+}
+
+/**
+ * Gets the current load of a thread pool.
+ *
+ * @param threadPool *pool   - The thread pool.
+ * @param uint32_t   &busy   - Receives the number of workers running a task.
+ * @param uint32_t   &queued - Receives the number of tasks waiting for a worker.
+ */
+void threadPool_load(threadPool *pool, uint32_t &busy, uint32_t &queued)
+{
+	MUTEX_LOCK(pool->mutex);
+	busy   = pool->busy;
+	queued = pool->queued;
+	MUTEX_UNLOCK(pool->mutex);
+}
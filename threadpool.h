@@ -0,0 +1,47 @@
+/*
+	bscrypt
+
+	Written in 2019-2022 Steve "Sc00bz" Thomas (steve at tobtu dot com)
+
+	To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring
+	rights to this software to the public domain worldwide. This software is distributed without any warranty.
+
+	You should have received a copy of the CC0 Public Domain Dedication along with this software.
+	If not, see <https://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "threads.h"
+
+/**
+ * A task for a thread pool. The caller owns the memory and it must stay valid
+ * until the task has run or was removed with threadPool_remove(). Nothing is
+ * allocated when submitting.
+ */
+struct threadPoolTask
+{
+	void          (*func)(void *arg);
+	void           *arg;
+	threadPoolTask *next;
+};
+
+struct threadPool
+{
+	MUTEX           mutex;
+	COND            cond;
+	THREAD         *threads;
+	uint32_t        numThreads;
+	uint32_t        busy;
+	uint32_t        queued;
+	threadPoolTask *head;
+	threadPoolTask *tail;
+	int             stop;
+};
+
+int  threadPool_init(threadPool *pool, uint32_t numThreads);
+void threadPool_destroy(threadPool *pool);
+void threadPool_submit(threadPool *pool, threadPoolTask *task);
+int  threadPool_remove(threadPool *pool, threadPoolTask *task);
+void threadPool_load(threadPool *pool, uint32_t &busy, uint32_t &queued);